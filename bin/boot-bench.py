@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+# Boots the drive image headless under QEMU a number of times, and reports
+# the median and 95th percentile of every boot phase the kernel prints on
+# the serial port (see src/boot_timeline.h), along with its boot-metric
+# lines.
+#
+#     bin/boot-bench.py --runs 10 --json build/boot-bench.json
+#     bin/boot-bench.py --runs 10 --baseline build/boot-bench.json
+#
+# The kernel, as built by `make bench` (KERNEL_BENCH_EXIT), ends each run by
+# writing to the isa-debug-exit device, which makes QEMU exit with status
+# (value << 1) | 1. The drive is opened with
+# snapshot=on, so runs can't affect each other.
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+import time
+
+
+QEMU_DEBUG_EXIT_PORT   = 0xF4
+QEMU_DEBUG_EXIT_STATUS = (0x10 << 1) | 1   # The kernel writes 0x10.
+
+
+def qemu_command(args):
+    return [
+        args.qemu,
+        '-drive', 'format=raw,file={},snapshot=on'.format(args.drive),
+        '-bios', args.bios,
+        '-m', args.memory,
+        '-machine', 'q35',
+        '-smp', str(args.smp),
+        '-vga', 'std',
+        '-display', 'none',
+        '-serial', 'stdio',
+        '-monitor', 'none',
+        '-no-reboot',
+        '-device', 'isa-debug-exit,iobase={:#x},iosize=0x01'.format(QEMU_DEBUG_EXIT_PORT),
+    ] + args.qemu_arg
+
+
+def parse_serial(output):
+    """The boot phases, in order, and the metrics of one run."""
+    phases  = []
+    metrics = {}
+    tsc_hz  = 0
+    for line in output.splitlines():
+        fields = line.strip().split()
+        if len(fields) == 3 and fields[:2] == ['boot-timeline', 'tsc-hz']:
+            tsc_hz = int(fields[2])
+        elif len(fields) == 5 and fields[0] == 'boot-phase':
+            phases.append((fields[2], int(fields[3]), int(fields[4])))
+        elif len(fields) == 3 and fields[0] == 'boot-metric':
+            metrics[fields[1]] = int(fields[2])
+    return tsc_hz, phases, metrics
+
+
+def boot_once(args):
+    start = time.monotonic()
+    try:
+        result = subprocess.run(qemu_command(args), stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=args.timeout)
+    except subprocess.TimeoutExpired as error:
+        output = (error.stdout or b'').decode('utf-8', 'replace')
+        sys.exit('QEMU didn\'t exit within {} s. Serial output:\n{}'.format(args.timeout, output))
+    wall = time.monotonic() - start
+
+    output = result.stdout.decode('utf-8', 'replace')
+    if result.returncode != QEMU_DEBUG_EXIT_STATUS:
+        sys.exit('QEMU exited with {} instead of {}. Serial output:\n{}\n{}'.format(
+            result.returncode, QEMU_DEBUG_EXIT_STATUS, output, result.stderr.decode('utf-8', 'replace')))
+
+    tsc_hz, phases, metrics = parse_serial(output)
+    if not phases:
+        sys.exit('The kernel didn\'t print a boot timeline. Serial output:\n' + output)
+    return tsc_hz, phases, metrics, wall
+
+
+def percentile(values, fraction):
+    """Nearest rank, so it's always one of the samples."""
+    ordered = sorted(values)
+    return ordered[max(0, math.ceil(fraction * len(ordered)) - 1)]
+
+
+def summarize(runs):
+    """Median and p95 of every phase (in microseconds) and metric, keyed by
+    name. A phase that shows up more than once in a run, as after kexec, is
+    numbered from its second appearance on."""
+    phases  = {}
+    order   = []
+    metrics = {}
+    for _, run_phases, run_metrics, _ in runs:
+        seen = {}
+        for name, _, microseconds in run_phases:
+            seen[name] = seen.get(name, 0) + 1
+            key = name if seen[name] == 1 else '{}#{}'.format(name, seen[name])
+            if key not in phases:
+                phases[key] = []
+                order.append(key)
+            phases[key].append(microseconds)
+        for name, value in run_metrics.items():
+            metrics.setdefault(name, []).append(value)
+
+    totals = [sum(microseconds for _, _, microseconds in run[1]) for run in runs]
+    walls  = [int(run[3] * 1000000) for run in runs]
+
+    def stats(values):
+        return { 'median': percentile(values, 0.5), 'p95': percentile(values, 0.95), 'runs': len(values) }
+
+    return {
+        'tsc_hz':  runs[-1][0],
+        'phases':  [dict(name=key, **stats(phases[key])) for key in order],
+        'total':   stats(totals),
+        'wall':    stats(walls),
+        'metrics': { name: stats(values) for name, values in sorted(metrics.items()) },
+    }
+
+
+def change(current, baseline):
+    if baseline is None:
+        return ''
+    if baseline == 0:
+        return '         new' if current else ''
+    return '{:+11.1f}%'.format(100.0 * (current - baseline) / baseline)
+
+
+def report(summary, baseline):
+    previous_phases  = { phase['name']: phase for phase in baseline['phases'] } if baseline else {}
+    previous_metrics = baseline['metrics'] if baseline else {}
+
+    print('{:<24} {:>12} {:>12} {:>12}'.format('phase (us)', 'median', 'p95', 'vs baseline' if baseline else ''))
+    for phase in summary['phases']:
+        before = previous_phases.get(phase['name'])
+        print('{:<24} {:>12} {:>12} {}'.format(phase['name'], phase['median'], phase['p95'], change(phase['median'], before['median'] if before else None)))
+    for name in ('total', 'wall'):
+        before = baseline[name]['median'] if baseline else None
+        print('{:<24} {:>12} {:>12} {}'.format(name, summary[name]['median'], summary[name]['p95'], change(summary[name]['median'], before)))
+
+    if summary['metrics']:
+        print()
+        print('{:<24} {:>12} {:>12} {:>12}'.format('metric', 'median', 'p95', 'vs baseline' if baseline else ''))
+        for name, values in summary['metrics'].items():
+            before = previous_metrics.get(name)
+            print('{:<24} {:>12} {:>12} {}'.format(name, values['median'], values['p95'], change(values['median'], before['median'] if before else None)))
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+    parser = argparse.ArgumentParser(description='Headless boot-time benchmark.')
+    parser.add_argument('--runs',     type=int,   default=10)
+    parser.add_argument('--timeout',  type=float, default=60.0, help='Seconds per boot.')
+    parser.add_argument('--qemu',     default='qemu-system-x86_64')
+    parser.add_argument('--drive',    default=os.path.join(root, 'drive', 'drive.hdd'))
+    parser.add_argument('--bios',     default=os.path.join(root, 'qemu', 'bios64.bin'))
+    parser.add_argument('--memory',   default='256M')
+    parser.add_argument('--smp',      type=int, default=1)
+    parser.add_argument('--qemu-arg', action='append', default=[], help='Passed on to QEMU, once per argument.')
+    parser.add_argument('--json',     help='Write the summary here.')
+    parser.add_argument('--baseline', help='A summary from an earlier --json to compare against.')
+    args = parser.parse_args()
+
+    if args.runs < 1:
+        parser.error('--runs must be at least 1')
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as file:
+            baseline = json.load(file)
+
+    runs = []
+    for i in range(args.runs):
+        runs.append(boot_once(args))
+        print('run {}/{}: {} us'.format(i + 1, args.runs, sum(phase[2] for phase in runs[-1][1])), file=sys.stderr)
+
+    summary = summarize(runs)
+    report(summary, baseline)
+
+    if args.json:
+        with open(args.json, 'w') as file:
+            json.dump(summary, file, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,110 @@
+// Runs the bootloader's chunked read (src/bootloader/chunked_read.c) against
+// a simulated file, the way kernel_image_read_segment uses it, and checks
+// that every read is begun and ended in pairs, that together they cover the
+// range exactly once and in order, and that the CRC is the one over the
+// whole range.
+//
+//     chunked_read
+#include "../src/bootloader/chunked_read.c"
+#include "../src/crc32c.c"
+#include "../src/x86_64/cpu.c"
+#include "../src/kernel_pack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct SimulatedFile
+{
+    const u8* data;
+    u64       size;
+    bool      in_flight;
+    u64       in_flight_size;
+    u64       next_offset;  // Where the next read has to start, to be in order.
+    int       failed;
+} SimulatedFile;
+
+
+static void fail(SimulatedFile* file, const char* message, u64 value)
+{
+    if (!file->failed)
+        fprintf(stderr, "%s (%llu)\n", message, (unsigned long long) value);
+    file->failed = 1;
+}
+
+static void simulated_begin(void* context, u64 offset, u8* destination, u64 size)
+{
+    SimulatedFile* file = (SimulatedFile *) context;
+    if (file->in_flight)
+        fail(file, "Read begun while another is in flight", offset);
+    if (offset != file->next_offset)
+        fail(file, "Read doesn't continue where the last one stopped", offset);
+    if (size == 0 || offset + size > file->size)
+        fail(file, "Read is empty or past the end", size);
+    if (file->failed)
+        return;
+
+    memcpy(destination, file->data + offset, size);
+    file->in_flight      = 1;
+    file->in_flight_size = size;
+    file->next_offset    = offset + size;
+}
+
+static void simulated_end(void* context, u64 size)
+{
+    SimulatedFile* file = (SimulatedFile *) context;
+    if (!file->in_flight)
+        fail(file, "Read ended without one in flight", size);
+    else if (size != file->in_flight_size)
+        fail(file, "Read ended with the wrong size", size);
+    file->in_flight = 0;
+}
+
+
+static int check(const u8* data, u64 size, u64 offset)
+{
+    u8* destination = calloc(1, size + 1);
+    SimulatedFile file = { .data=data, .size=offset + size, .next_offset=offset };
+    ChunkedRead read = { .context=&file, .begin=simulated_begin, .end=simulated_end };
+
+    u32 crc      = chunked_read(&read, offset, destination, size, KERNEL_PACK_BLOCK_SIZE, CRC32C_INITIAL);
+    u32 expected = crc32c_update(CRC32C_INITIAL, data + offset, size);
+
+    if (!file.failed && file.in_flight)
+        fail(&file, "A read was left in flight", size);
+    if (!file.failed && file.next_offset != offset + size)
+        fail(&file, "The reads stopped short", file.next_offset - offset);
+    if (!file.failed && (memcmp(destination, data + offset, size) != 0 || crc != expected))
+        fail(&file, "The data or the CRC is wrong", size);
+
+    printf("%8llu bytes at %4llu: %s\n", (unsigned long long) size, (unsigned long long) offset, file.failed ? "FAILED" : "ok");
+    free(destination);
+    return file.failed;
+}
+
+
+int main()
+{
+    static const u64 SIZES[] = {
+        0, 1, 4096, KERNEL_PACK_BLOCK_SIZE - 1, KERNEL_PACK_BLOCK_SIZE, KERNEL_PACK_BLOCK_SIZE + 1,
+        100000, 2 * KERNEL_PACK_BLOCK_SIZE, 3 * KERNEL_PACK_BLOCK_SIZE + 12345,
+    };
+
+    crc32c_init();
+
+    u64 largest = 4 * KERNEL_PACK_BLOCK_SIZE + 4096;
+    u8* data    = malloc(largest);
+    for (u64 i = 0; i < largest; ++i)
+        data[i] = (u8) rand();
+
+    int failed = 0;
+    for (usize i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); ++i)
+    {
+        failed |= check(data, SIZES[i], 0);
+        failed |= check(data, SIZES[i], 4000);
+    }
+
+    free(data);
+    return failed;
+}
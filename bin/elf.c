@@ -1,3 +1,11 @@
+// Host-side ELF loader, for measuring loader changes on Linux.
+//
+//     elf --copy  <elf>                    Read the file and copy each segment into place.
+//     elf --map   <elf>                    Map each segment straight from the file.
+//     elf --bench [MiB] [iterations]       Time both on a synthetic ELF of that size.
+//
+// The kernel is linked in the top 2 GiB, which user space can't map, so
+// segments are placed at the same offsets from a base the host picks.
 #include "../src/elf.h"
 
 #include <stdio.h>
@@ -6,113 +14,418 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <time.h>
 
-int load_elf64(const uint8_t* data)
+
+typedef struct LoadTimes
+{
+    uint64_t parse;  // Getting the headers (and for --copy, the whole file) into memory.
+    uint64_t map;    // Setting up the mappings.
+    uint64_t copy;   // Copying file data and zeroing .bss tails.
+    uint64_t touch;  // Faulting in every page, so lazy mappings pay their way too.
+} LoadTimes;
+
+typedef struct LoadedImage
+{
+    uint8_t* base;   // Where the lowest segment's page ended up.
+    uint64_t size;   // Of the whole reservation.
+    uint64_t bias;   // Added to every virtual address in the ELF.
+    uint64_t entry;  // Biased.
+} LoadedImage;
+
+
+static uint64_t now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ULL + (uint64_t) time.tv_nsec;
+}
+
+static int protection_from_flags(uint32_t flags)
 {
-    if (!is_elf64(data))
+    return ((flags & PF_R) ? PROT_READ : 0) | ((flags & PF_W) ? PROT_WRITE : 0) | ((flags & PF_X) ? PROT_EXEC : 0);
+}
+
+
+/// Reserve address space for every PT_LOAD, keeping their relative layout.
+static LoadedImage reserve(const Elf64Header* header, const Elf64ProgramHeader* programs, uint64_t page_size)
+{
+    uint64_t low  = UINT64_MAX;
+    uint64_t high = 0;
+    for (int i = 0; i < header->program_header_entries; ++i)
+    {
+        const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD)
+            continue;
+        if (program->virtual_address < low)
+            low = program->virtual_address;
+        if (program->virtual_address + program->memory_size > high)
+            high = program->virtual_address + program->memory_size;
+    }
+
+    low  &= ~(page_size - 1);
+    high  = (high + page_size - 1) & ~(page_size - 1);
+
+    void* base = mmap(NULL, high - low, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(base != MAP_FAILED);
+
+    LoadedImage image = { .base=base, .size=high - low, .bias=(uint64_t) base - low };
+    image.entry = header->entry_point + image.bias;
+    return image;
+}
+
+
+/// Read one byte of every page, so that pages that are mapped but not yet
+/// populated are faulted in and counted.
+static void touch(const LoadedImage* image, const Elf64Header* header, const Elf64ProgramHeader* programs, uint64_t page_size)
+{
+    volatile uint8_t sink = 0;
+    for (int i = 0; i < header->program_header_entries; ++i)
+    {
+        const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD || !(program->flags & PF_R))
+            continue;
+
+        uint64_t start = (program->virtual_address + image->bias) & ~(page_size - 1);
+        for (uint64_t page = start; page < program->virtual_address + image->bias + program->memory_size; page += page_size)
+            sink += *(const uint8_t *) page;
+    }
+    (void) sink;
+}
+
+
+/// The original loader: read the whole file, then copy each segment into
+/// anonymous memory. Every byte of file data is read once and copied once.
+int load_elf64_copy(const char* path, LoadedImage* image, LoadTimes* times)
+{
+    uint64_t page_size = (uint64_t) getpagesize();
+    uint64_t start     = now();
+
+    FILE* file = fopen(path, "rb");
+    if (!file)
         return ELF_ERROR;
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+    if (size < (long) sizeof(Elf64Header))
+    {
+        fclose(file);
+        return ELF_ERROR;
+    }
 
-    uint64_t page_size = getpagesize();
+    uint8_t* data = malloc((size_t) size);
+    int      read = data && fread(data, 1, (size_t) size, file) == (size_t) size;
+    fclose(file);
+    if (!read || is_elf64(data) != ELF_YES || ((const Elf64Header*) data)->program_header_entry_size != sizeof(Elf64ProgramHeader))
+    {
+        free(data);
+        return ELF_ERROR;
+    }
 
     const Elf64Header*        header   = (Elf64Header*) data;
     const Elf64ProgramHeader* programs = (Elf64ProgramHeader*) (data + header->program_header_offset);
-    const Elf64SectionHeader* section  = (Elf64SectionHeader*) (data + header->section_header_offset);
+    times->parse = now() - start;
 
-    // https://wiki.osdev.org/ELF
+    start  = now();
+    *image = reserve(header, programs, page_size);
     for (int i = 0; i < header->program_header_entries; ++i)
     {
         const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD)
+            continue;
 
-        if (program->type == PT_LOAD)
-        {
-            // Allocate `size` virtual memory at `address` and copy from
-            // source to destination.
-            // If the file_size and memory_size members differ,
-            // the segment is padded with zeros.
+        uint64_t aligned = (program->virtual_address + image->bias) & ~(page_size - 1);
+        uint64_t end     = program->virtual_address + image->bias + program->memory_size;
 
-            uint64_t destination = program->virtual_address;
-            uint64_t dest_size   = program->memory_size;
+        void* result = mmap((void *) aligned, end - aligned, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        assert(result == (void *) aligned);
+    }
+    times->map = now() - start;
 
-            const uint8_t* source = data + program->file_offset;
-            uint64_t source_size  = program->file_size;
+    start = now();
+    for (int i = 0; i < header->program_header_entries; ++i)
+    {
+        const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD)
+            continue;
+
+        uint64_t aligned = (program->virtual_address + image->bias) & ~(page_size - 1);
+        uint64_t end     = program->virtual_address + image->bias + program->memory_size;
+        memcpy((void *) (program->virtual_address + image->bias), data + program->file_offset, program->file_size);
+        mprotect((void *) aligned, end - aligned, protection_from_flags(program->flags));
+    }
+    times->copy = now() - start;
+
+    start = now();
+    touch(image, header, programs, page_size);
+    times->touch = now() - start;
+
+    free(data);
+    return ELF_YES;
+}
 
-            uint64_t aligned    = destination;
-            uint64_t align_size = dest_size;
-            if (aligned % page_size != 0)
-            {
-                aligned    = aligned & (~(page_size-1));
-                align_size = (destination + dest_size) - aligned;
-            }
 
+/// Map each segment's file data straight from the page cache with
+/// MAP_PRIVATE. Nothing is copied, except for the one page a segment's file
+/// data and .bss may share, whose tail has to be zeroed (and so becomes a
+/// private copy). The rest of .bss is anonymous memory.
+int load_elf64_map(const char* path, LoadedImage* image, LoadTimes* times)
+{
+    uint64_t page_size = (uint64_t) getpagesize();
+    uint64_t start     = now();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return ELF_ERROR;
+
+    // A short read means the file is smaller than a header.
+    Elf64Header header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || is_elf64((const uint8_t *) &header) != ELF_YES ||
+        header.program_header_entry_size != sizeof(Elf64ProgramHeader))
+    {
+        close(fd);
+        return ELF_ERROR;
+    }
+
+    size_t programs_size = header.program_header_entries * sizeof(Elf64ProgramHeader);
+    Elf64ProgramHeader* programs = malloc(programs_size);
+    if (!programs || pread(fd, programs, programs_size, (off_t) header.program_header_offset) != (ssize_t) programs_size)
+    {
+        free(programs);
+        close(fd);
+        return ELF_ERROR;
+    }
+    times->parse = now() - start;
+
+    start  = now();
+    *image = reserve(&header, programs, page_size);
+    uint64_t copy = 0;
+    for (int i = 0; i < header.program_header_entries; ++i)
+    {
+        const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD)
+            continue;
+
+        uint64_t destination = program->virtual_address + image->bias;
+        uint64_t aligned     = destination & ~(page_size - 1);
+        uint64_t file_end    = destination + program->file_size;
+        uint64_t file_pages  = (file_end + page_size - 1) & ~(page_size - 1);
+        uint64_t end         = (destination + program->memory_size + page_size - 1) & ~(page_size - 1);
+        int      protection  = protection_from_flags(program->flags);
+
+        if (program->file_size)
+        {
+            // Only possible if the file offset and address agree modulo the
+            // page size, which the ELF spec asks of every PT_LOAD.
+            assert((program->file_offset & (page_size - 1)) == (destination & (page_size - 1)));
+
+            int tail = file_end != file_pages && program->memory_size > program->file_size;
             void* result = mmap(
-                    (void *) aligned, align_size,
-                    PROT_READ | PROT_WRITE | PROT_EXEC,
-                    MAP_PRIVATE | MAP_ANONYMOUS,
-                    -1, 0
+                (void *) aligned, file_pages - aligned, protection | (tail ? PROT_WRITE : 0),
+                MAP_PRIVATE | MAP_FIXED, fd, (off_t) (program->file_offset & ~(page_size - 1))
             );
+            assert(result == (void *) aligned);
 
-            assert(result != MAP_FAILED);
-            assert((uint64_t) result == aligned);
-            memcpy((void *)destination, source, source_size);
+            if (tail)
+            {
+                uint64_t copy_start = now();
+                memset((void *) file_end, 0, file_pages - file_end);
+                copy += now() - copy_start;
+                if (!(protection & PROT_WRITE))
+                    mprotect((void *) (file_pages - page_size), page_size, protection);
+            }
+        }
+        else
+        {
+            file_pages = aligned;
         }
-    }
 
-    typedef int (*elf_main_fn)(int*);
+        if (end > file_pages)
+        {
+            void* result = mmap((void *) file_pages, end - file_pages, protection, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            assert(result == (void *) file_pages);
+        }
+    }
+    times->map  = now() - start - copy;
+    times->copy = copy;
 
-    void* entry_point_address = (void *) header->entry_point;
-    elf_main_fn entry_point = (elf_main_fn) entry_point_address;
+    start = now();
+    touch(image, &header, programs, page_size);
+    times->touch = now() - start;
 
-    int temp = 1;
-    int result = entry_point(&temp);
-    return result;
+    free(programs);
+    close(fd);
+    return ELF_YES;
 }
 
 
+static void unload(const LoadedImage* image)
+{
+    munmap(image->base, image->size);
+}
+
 
+/// Write an ELF with `segments` PT_LOADs of `segment_size` bytes of file data
+/// each, with a page and a half of .bss after the last one. The contents are
+/// noise; only the layout matters.
+static int write_synthetic_elf(const char* path, uint64_t segment_size, int segments, uint64_t page_size)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return 0;
+
+    uint64_t data_offset = page_size;
+    Elf64Header header = {
+        .magic_number=0x464C457F,
+        .bits=2,
+        .endianness=1,
+        .version_1=1,
+        .type=2,
+        .instruction_set=0x3E,
+        .version_2=1,
+        .entry_point=0xFFFFFFFF80000000ULL,
+        .program_header_offset=sizeof(Elf64Header),
+        .header_size=sizeof(Elf64Header),
+        .program_header_entry_size=sizeof(Elf64ProgramHeader),
+        .program_header_entries=(uint16_t) segments,
+    };
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (int i = 0; i < segments; ++i)
+    {
+        uint64_t offset = data_offset + (uint64_t) i * segment_size;
+        Elf64ProgramHeader program = {
+            .type=PT_LOAD,
+            .flags=PF_R | (i == 0 ? PF_X : PF_W),
+            .file_offset=offset,
+            .virtual_address=0xFFFFFFFF80000000ULL + offset - data_offset,
+            .file_size=segment_size,
+            .memory_size=segment_size + (i == segments - 1 ? page_size * 3 / 2 : 0),
+            .alignment=page_size,
+        };
+        fwrite(&program, sizeof(program), 1, file);
+    }
 
+    uint8_t* chunk = malloc(page_size);
+    uint32_t noise = 0x12345678;
+    fseek(file, (long) data_offset, SEEK_SET);
+    for (uint64_t written = 0; written < segment_size * (uint64_t) segments; written += page_size)
+    {
+        for (uint64_t i = 0; i < page_size; ++i)
+        {
+            noise  = noise * 1664525U + 1013904223U;
+            chunk[i] = (uint8_t) (noise >> 24);
+        }
+        fwrite(chunk, 1, page_size, file);
+    }
+    free(chunk);
 
+    fclose(file);
+    return 1;
+}
 
 
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
 
+static uint64_t median(uint64_t* samples, int count)
+{
+    qsort(samples, (size_t) count, sizeof(uint64_t), compare_u64);
+    return samples[count / 2];
+}
 
 
+typedef int (*loader_fn)(const char*, LoadedImage*, LoadTimes*);
 
-int main()
+static void bench(const char* name, loader_fn loader, const char* path, int iterations)
 {
-    FILE* file = fopen("../../build/kernel", "rb");
-    char* source = NULL;
-    long  size   = 0;
-    if (file)
+    uint64_t* samples = malloc(5 * (size_t) iterations * sizeof(uint64_t));
+    uint64_t* parse   = samples;
+    uint64_t* map     = samples + iterations;
+    uint64_t* copy    = samples + iterations * 2;
+    uint64_t* touched = samples + iterations * 3;
+    uint64_t* total   = samples + iterations * 4;
+
+    for (int i = 0; i < iterations; ++i)
     {
-        if (fseek(file, 0L, SEEK_END) == 0)
+        LoadedImage image;
+        LoadTimes   times = { 0 };
+        if (loader(path, &image, &times) != ELF_YES)
         {
-            size = ftell(file);
-            if (size == -1)
-                return -1;
-
-            /* Allocate our buffer to that size. */
-            source = malloc(sizeof(char) * (size + 1));
-            if (!source)
-                return -1;
-
-            /* Go back to the start of the file. */
-            if (fseek(file, 0L, SEEK_SET) != 0)
-                return -1;
-
-            /* Read the entire file into memory. */
-            size_t actual_size = fread(source, sizeof(char), size, file);
-            if (ferror(file) != 0)
-                fputs("Error reading file", stderr);
-            else
-                source[actual_size] = '\0';
+            fprintf(stderr, "%s: couldn't load '%s'\n", name, path);
+            exit(1);
         }
+        unload(&image);
+
+        parse[i]   = times.parse;
+        map[i]     = times.map;
+        copy[i]    = times.copy;
+        touched[i] = times.touch;
+        total[i]   = times.parse + times.map + times.copy + times.touch;
     }
 
-    return load_elf64((uint8_t*)source);
+    printf(
+        "%-6s parse %8.3f ms   map %8.3f ms   copy %8.3f ms   touch %8.3f ms   total %8.3f ms\n", name,
+        (double) median(parse, iterations) / 1e6, (double) median(map, iterations) / 1e6,
+        (double) median(copy, iterations) / 1e6, (double) median(touched, iterations) / 1e6,
+        (double) median(total, iterations) / 1e6
+    );
+    free(samples);
 }
 
 
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+    {
+        uint64_t megabytes  = argc >= 3 ? strtoull(argv[2], NULL, 10) : 64;
+        int      iterations = argc >= 4 ? atoi(argv[3]) : 9;
+        uint64_t page_size  = (uint64_t) getpagesize();
+        int      segments   = 3;
+        uint64_t segment_size = ((megabytes << 20) / (uint64_t) segments + page_size - 1) & ~(page_size - 1);
+
+        char path[] = "/tmp/elf-bench-XXXXXX";
+        int  fd     = mkstemp(path);
+        if (fd < 0 || !write_synthetic_elf(path, segment_size, segments, page_size))
+        {
+            fprintf(stderr, "Couldn't write a synthetic ELF\n");
+            return 1;
+        }
+        close(fd);
 
+        // The file was just written, so it's in the page cache: this measures
+        // the loaders, not the disk. Medians of `iterations` runs.
+        printf("%d segments of %llu KiB, %d iterations\n", segments, (unsigned long long) (segment_size >> 10), iterations);
+        bench("copy", load_elf64_copy, path, iterations);
+        bench("map",  load_elf64_map,  path, iterations);
 
+        unlink(path);
+        return 0;
+    }
 
+    if (argc == 3 && (strcmp(argv[1], "--copy") == 0 || strcmp(argv[1], "--map") == 0))
+    {
+        LoadedImage image;
+        LoadTimes   times = { 0 };
+        loader_fn   loader = strcmp(argv[1], "--copy") == 0 ? load_elf64_copy : load_elf64_map;
+        if (loader(argv[2], &image, &times) != ELF_YES)
+        {
+            fprintf(stderr, "Couldn't load '%s'\n", argv[2]);
+            return 1;
+        }
 
+        printf("Loaded at %p (bias %llx), entry at %llx\n", (void *) image.base, (unsigned long long) image.bias, (unsigned long long) image.entry);
+        printf("parse %llu ns, map %llu ns, copy %llu ns, touch %llu ns\n",
+               (unsigned long long) times.parse, (unsigned long long) times.map, (unsigned long long) times.copy, (unsigned long long) times.touch);
+        unload(&image);
+        return 0;
+    }
+
+    fprintf(stderr, "Usage: %s --copy <elf> | --map <elf> | --bench [MiB] [iterations]\n", argv[0]);
+    return 1;
+}
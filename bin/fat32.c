@@ -0,0 +1,322 @@
+// Runs the bootloader's FAT32 reader (src/bootloader/fat32.c) against a
+// FAT32 image generated in memory, behind a simulated EFI_BLOCK_IO_PROTOCOL,
+// and checks 8.3 lookups in the root directory, cluster chains resolved into
+// extents (contiguous, fragmented, and across FAT window reloads), and that
+// chains ending early, running into free clusters or out of the volume are
+// refused rather than read.
+//
+//     fat32
+#include <stdlib.h>
+#include <string.h>
+
+// Built as the bootloader is, with wide strings. Its printf takes those,
+// which collides with stdio's.
+#define USE_WIDE_CHARACTER 1
+#define printf efi_printf
+#include "../src/types.h"
+#include "../src/page_allocator.h"
+#include "../src/bootloader/fat32.c"
+#undef printf
+
+#include <stdio.h>
+
+
+#define SECTOR_SIZE      512
+#define TOTAL_SECTORS    20000
+#define RESERVED_SECTORS 32
+#define FAT_SECTORS      160   // More than FAT32_FAT_WINDOW, so the window moves.
+#define DATA_SECTOR      (RESERVED_SECTORS + 2 * FAT_SECTORS)
+#define CLUSTER_COUNT    (TOTAL_SECTORS - DATA_SECTOR)
+
+#define END_OF_CHAIN     0x0FFFFFFF
+
+
+EFI_GUID           EFI_BLOCK_IO_PROTOCOL_GUID = { 0 };
+EFI_BOOT_SERVICES* g_BootServices             = NULL;
+
+static u8*   g_image        = NULL;
+static usize g_reads        = 0;
+static usize g_pool_in_use  = 0;
+static int   g_failed       = 0;
+
+
+void debug_break()
+{
+    abort();
+}
+
+void EfiAssert(EFI_STATUS status, const CHAR16* file, int line)
+{
+    if (status != EFI_SUCCESS)
+    {
+        fprintf(stderr, "EFI_ASSERT failed on line %d\n", line);
+        abort();
+    }
+}
+
+
+static EFI_STATUS simulated_read_blocks(EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId, EFI_LBA LBA, UINTN BufferSize, void* Buffer)
+{
+    if (MediaId != This->Media->MediaId || BufferSize % SECTOR_SIZE != 0 || LBA + BufferSize / SECTOR_SIZE > TOTAL_SECTORS)
+        return EFI_DEVICE_ERROR;
+    memcpy(Buffer, g_image + LBA * SECTOR_SIZE, BufferSize);
+    g_reads += 1;
+    return EFI_SUCCESS;
+}
+
+static EFI_BLOCK_IO_MEDIA    g_media = { .MediaId=7, .MediaPresent=1, .BlockSize=SECTOR_SIZE, .IoAlign=1, .LastBlock=TOTAL_SECTORS - 1 };
+static EFI_BLOCK_IO_PROTOCOL g_io    = { .Revision=EFI_BLOCK_IO_PROTOCOL_REVISION2, .Media=&g_media, .ReadBlocks=simulated_read_blocks };
+
+static EFI_STATUS simulated_handle_protocol(EFI_HANDLE Handle, EFI_GUID* Protocol, void** Interface)
+{
+    *Interface = &g_io;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS simulated_allocate_pool(UINTN PoolType, UINTN Size, void** Buffer)
+{
+    *Buffer = malloc(Size);
+    g_pool_in_use += 1;
+    return *Buffer ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS simulated_free_pool(void* Buffer)
+{
+    free(Buffer);
+    g_pool_in_use -= 1;
+    return EFI_SUCCESS;
+}
+
+
+/* ---- IMAGE ---- */
+static void set_fat(u32 cluster, u32 next)
+{
+    for (u64 fat = 0; fat < 2; ++fat)
+        memcpy(g_image + (RESERVED_SECTORS + fat * FAT_SECTORS) * SECTOR_SIZE + cluster * 4, &next, sizeof(next));
+}
+
+static u8* cluster_data(u32 cluster)
+{
+    return g_image + (DATA_SECTOR + (u64) (cluster - 2)) * SECTOR_SIZE;
+}
+
+/// Link `count` runs of clusters given as first and length pairs into one
+/// chain, ending it with `end`.
+static void chain(const u32* runs, usize count, u32 end)
+{
+    for (usize run = 0; run < count; ++run)
+    {
+        u32 first  = runs[2 * run];
+        u32 length = runs[2 * run + 1];
+        for (u32 i = 0; i < length; ++i)
+        {
+            bool last = i + 1 == length;
+            u32  next = !last ? first + i + 1 : run + 1 < count ? runs[2 * run + 2] : end;
+            set_fat(first + i, next);
+        }
+    }
+}
+
+static void directory_entry(u32 directory_cluster, usize index, const char name[11], u8 attributes, u32 cluster, u32 size)
+{
+    Fat32DirectoryEntry entry = { 0 };
+    memcpy(entry.name, name, 11);
+    entry.attributes   = attributes;
+    entry.cluster_high = (u16) (cluster >> 16);
+    entry.cluster_low  = (u16) cluster;
+    entry.size         = size;
+    memcpy(cluster_data(directory_cluster) + index * sizeof(entry), &entry, sizeof(entry));
+}
+
+
+static const u32 KERNEL_RUNS[]  = { 10, 10, 3000, 5, 100, 6 };  // Three extents, the middle one past the first FAT window.
+static const u32 A_RUNS[]       = { 30, 1 };
+static const u32 LATE_RUNS[]    = { 40, 2 };
+static const u32 SHORT_RUNS[]   = { 50, 2 };
+static const u32 FREE_RUNS[]    = { 60, 2 };
+static const u32 OUTSIDE_RUNS[] = { 70, 2 };
+
+#define KERNEL_SIZE (20 * SECTOR_SIZE + 123)
+
+static void make_image()
+{
+    g_image = calloc(TOTAL_SECTORS, SECTOR_SIZE);
+
+    Fat32BootSector boot = {
+        .jump={ 0xEB, 0x58, 0x90 },
+        .bytes_per_sector=SECTOR_SIZE,
+        .sectors_per_cluster=1,
+        .reserved_sectors=RESERVED_SECTORS,
+        .fat_count=2,
+        .media=0xF8,
+        .total_sectors_32=TOTAL_SECTORS,
+        .fat_size_32=FAT_SECTORS,
+        .root_cluster=2,
+    };
+    memcpy(g_image, &boot, sizeof(boot));
+    g_image[510] = 0x55;
+    g_image[511] = 0xAA;
+
+    set_fat(0, 0x0FFFFFF8);
+    set_fat(1, END_OF_CHAIN);
+
+    // The root directory takes two clusters that aren't next to each other,
+    // with more entries than fit in the first.
+    u32 root[] = { 2, 1, 5000, 1 };
+    chain(root, 2, END_OF_CHAIN);
+    directory_entry(2, 0, "BOOTDISK   ", FAT32_ATTRIBUTE_VOLUME_ID, 0, 0);
+    directory_entry(2, 1, "KERNEL     ", 0, 9999, KERNEL_SIZE);  // Deleted below.
+    cluster_data(2)[1 * sizeof(Fat32DirectoryEntry)] = 0xE5;
+    directory_entry(2, 2, "Bxxxxxxxxxx", FAT32_ATTRIBUTE_LONG_NAME, 0, 0);
+    directory_entry(2, 3, "EFI        ", FAT32_ATTRIBUTE_DIRECTORY, 20, 0);
+    directory_entry(2, 4, "KERNEL     ", 0, KERNEL_RUNS[0], KERNEL_SIZE);
+    directory_entry(2, 5, "A       TXT", 0, A_RUNS[0], 11);
+    directory_entry(2, 6, "SHORT   BIN", 0, SHORT_RUNS[0], 5 * SECTOR_SIZE);
+    directory_entry(2, 7, "FREE    BIN", 0, FREE_RUNS[0], 4 * SECTOR_SIZE);
+    directory_entry(2, 8, "OUTSIDE BIN", 0, OUTSIDE_RUNS[0], 4 * SECTOR_SIZE);
+    directory_entry(2, 9, "EMPTY      ", 0, 0, 0);
+    for (usize i = 10; i < SECTOR_SIZE / sizeof(Fat32DirectoryEntry); ++i)
+        directory_entry(2, i, "FILLER  BIN", 0, 0, 0);
+    directory_entry(5000, 0, "LATE    BIN", 0, LATE_RUNS[0], 2 * SECTOR_SIZE);
+    // Entry 1 of the second cluster is zero: the end of the directory.
+    directory_entry(5000, 2, "HIDDEN  BIN", 0, A_RUNS[0], 11);
+
+    chain(KERNEL_RUNS,  3, END_OF_CHAIN);
+    chain(A_RUNS,       1, END_OF_CHAIN);
+    chain(LATE_RUNS,    1, END_OF_CHAIN);
+    chain(SHORT_RUNS,   1, END_OF_CHAIN);        // Two clusters for five.
+    chain(FREE_RUNS,    1, 0);                   // Runs into a free cluster.
+    chain(OUTSIDE_RUNS, 1, CLUSTER_COUNT + 2);   // Runs off the end of the volume.
+
+    for (usize run = 0; run < 3; ++run)
+        for (u32 i = 0; i < KERNEL_RUNS[2 * run + 1]; ++i)
+            for (usize j = 0; j < SECTOR_SIZE; ++j)
+                cluster_data(KERNEL_RUNS[2 * run] + i)[j] = (u8) rand();
+    memcpy(cluster_data(A_RUNS[0]), "hello world", 11);
+}
+
+
+/// The file's bytes, gathered by following KERNEL_RUNS by hand.
+static void kernel_expected(u8* expected)
+{
+    usize at = 0;
+    for (usize run = 0; run < 3; ++run)
+        for (u32 i = 0; i < KERNEL_RUNS[2 * run + 1]; ++i, at += SECTOR_SIZE)
+            memcpy(expected + at, cluster_data(KERNEL_RUNS[2 * run] + i), SECTOR_SIZE);
+}
+
+
+/* ---- CHECKS ---- */
+static void expect(bool condition, const char* name)
+{
+    printf("%-48s %s\n", name, condition ? "ok" : "FAILED");
+    g_failed |= !condition;
+}
+
+static bool find(Fat32Volume* volume, const char* name, u32 cluster, u32 size)
+{
+    u32 found_cluster = 0;
+    u32 found_size    = 0;
+    return fat32_find(volume, name, &found_cluster, &found_size) && found_cluster == cluster && found_size == size;
+}
+
+static bool missing(Fat32Volume* volume, const char* name)
+{
+    u32 found_cluster = 0;
+    u32 found_size    = 0;
+    return !fat32_find(volume, name, &found_cluster, &found_size);
+}
+
+/// Whether the chain from `cluster` is refused for `size` bytes, leaving
+/// nothing allocated.
+static bool refused(Fat32Volume* volume, u32 cluster, u64 size)
+{
+    Fat32Extent* extents = (Fat32Extent *) 1;
+    usize        count   = 1;
+    return !fat32_extents(volume, cluster, size, &extents, &count) && extents == NULL && count == 0;
+}
+
+
+static void check_kernel(Fat32Volume* volume, u64 transfer_sectors, const char* name)
+{
+    Fat32Extent* extents = NULL;
+    usize        count   = 0;
+    bool resolved = fat32_extents(volume, KERNEL_RUNS[0], KERNEL_SIZE, &extents, &count);
+    bool shaped   = resolved && count == 3;
+    for (usize run = 0; shaped && run < 3; ++run)
+        shaped = extents[run].sector == DATA_SECTOR + KERNEL_RUNS[2 * run] - 2 && extents[run].sectors == KERNEL_RUNS[2 * run + 1];
+
+    usize rounded     = (KERNEL_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    u8*   destination = calloc(1, rounded);
+    u8*   expected    = calloc(1, 21 * SECTOR_SIZE);
+    kernel_expected(expected);
+
+    volume->transfer_sectors = transfer_sectors;
+    g_reads = 0;
+    bool read = shaped && fat32_read_extents(volume, extents, count, destination, KERNEL_SIZE);
+    expect(read && memcmp(destination, expected, KERNEL_SIZE) == 0, name);
+
+    free(destination);
+    free(expected);
+    if (extents)
+        simulated_free_pool(extents);
+}
+
+
+int main()
+{
+    EFI_BOOT_SERVICES services = { 0 };
+    services.HandleProtocol = simulated_handle_protocol;
+    services.AllocatePool   = simulated_allocate_pool;
+    services.FreePool       = simulated_free_pool;
+    g_BootServices = &services;
+
+    make_image();
+
+    Fat32Volume volume = { 0 };
+    expect(fat32_open(&volume, NULL) && volume.data_sector == DATA_SECTOR && volume.cluster_count == CLUSTER_COUNT, "open");
+
+    expect(find(&volume, "kernel", KERNEL_RUNS[0], KERNEL_SIZE),    "8.3: past deleted, long and label entries");
+    expect(find(&volume, "KERNEL", KERNEL_RUNS[0], KERNEL_SIZE),    "8.3: upper case");
+    expect(find(&volume, "a.txt", A_RUNS[0], 11),                   "8.3: name and extension");
+    expect(find(&volume, "late.bin", LATE_RUNS[0], 2 * SECTOR_SIZE), "8.3: in the second directory cluster");
+    expect(missing(&volume, "hidden.bin"),                          "8.3: nothing after the end of the directory");
+    expect(missing(&volume, "efi"),                                 "8.3: directories aren't files");
+    expect(missing(&volume, "nothere"),                             "8.3: missing");
+    expect(missing(&volume, "toolongname"),                         "8.3: name too long");
+    expect(missing(&volume, "kernel.elf2"),                         "8.3: extension too long");
+    expect(missing(&volume, "a.b.c"),                               "8.3: two dots");
+    expect(missing(&volume, ".txt"),                                "8.3: no name");
+
+    u64 transfer = volume.transfer_sectors;
+    check_kernel(&volume, transfer, "chain: fragmented file read");
+    expect(g_reads == 3, "chain: one read per extent");
+    check_kernel(&volume, 3, "chain: reads split by transfer size");
+
+    Fat32Extent* extents = (Fat32Extent *) 1;
+    usize        count   = 1;
+    expect(fat32_extents(&volume, 0, 0, &extents, &count) && extents == NULL && count == 0, "chain: empty file");
+    expect(refused(&volume, SHORT_RUNS[0], 5 * SECTOR_SIZE),     "chain: end of chain before the end of the file");
+    expect(refused(&volume, FREE_RUNS[0], 4 * SECTOR_SIZE),      "chain: runs into a free cluster");
+    expect(refused(&volume, OUTSIDE_RUNS[0], 4 * SECTOR_SIZE),   "chain: runs off the volume");
+    expect(refused(&volume, CLUSTER_COUNT + 2, SECTOR_SIZE),     "chain: starts off the volume");
+    expect(refused(&volume, 1, SECTOR_SIZE),                     "chain: starts at a reserved cluster");
+    expect(!fat32_read_extents(&volume, NULL, 0, NULL, 1),       "read: more than the extents hold");
+
+    fat32_close(&volume);
+    expect(g_pool_in_use == 0, "pool: everything freed");
+
+    // Volumes it doesn't understand are turned down, for EFI_FILE_PROTOCOL.
+    g_image[510] = 0;
+    expect(!fat32_open(&volume, NULL), "open: no boot signature");
+    g_image[510] = 0x55;
+    g_media.BlockSize = 4096;
+    expect(!fat32_open(&volume, NULL), "open: block size isn't the sector size");
+    g_media.BlockSize = SECTOR_SIZE;
+    u16 fat_size_16 = 32;
+    memcpy(g_image + 22, &fat_size_16, sizeof(fat_size_16));
+    expect(!fat32_open(&volume, NULL), "open: FAT16");
+
+    free(g_image);
+    return g_failed;
+}
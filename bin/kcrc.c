@@ -0,0 +1,84 @@
+// Writes the digest the bootloader checks the kernel against (see
+// KERNEL_DIGEST_FILE_NAME in src/kernel_pack.h).
+//
+//     kcrc build/kernel build/kernel.crc
+//
+// It's taken over the ELF, so it's the same for the packed kernel.
+#include "../src/elf.h"
+#include "../src/kernel_pack.h"
+#include "../src/crc32c.c"
+#include "../src/x86_64/cpu.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <kernel elf> <digest output>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Couldn't open '%s'\n", argv[1]);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    usize size = (usize) ftell(file);
+    fseek(file, 0, SEEK_SET);
+    u8* elf = malloc(size);
+    if (fread(elf, 1, size, file) != size || size < sizeof(Elf64Header) || memcmp(elf, "\x7F" "ELF", 4) != 0 || elf[4] != 2)
+    {
+        fprintf(stderr, "Couldn't read a 64-bit ELF from '%s'\n", argv[1]);
+        return 1;
+    }
+    fclose(file);
+
+    crc32c_init();
+
+    const Elf64Header*        header   = (const Elf64Header*) elf;
+    const Elf64ProgramHeader* programs = (const Elf64ProgramHeader*) (elf + header->program_header_offset);
+
+    // In the order the bootloader reads it.
+    u32 crc = CRC32C_INITIAL;
+    crc = crc32c_update(crc, header, sizeof(Elf64Header));
+    crc = crc32c_update(crc, programs, header->program_header_entries * sizeof(Elf64ProgramHeader));
+    for (int i = 0; i < header->program_header_entries; ++i)
+    {
+        if (programs[i].type == PT_LOAD)
+            crc = crc32c_update(crc, elf + programs[i].file_offset, programs[i].file_size);
+    }
+    crc = CRC32C_FINAL(crc);
+
+    // Both implementations have to agree, or the bootloader would reject
+    // good kernels on one kind of machine.
+    u32 software = CRC32C_INITIAL;
+    software = crc32c_update_software(software, (const u8*) header, sizeof(Elf64Header));
+    software = crc32c_update_software(software, (const u8*) programs, header->program_header_entries * sizeof(Elf64ProgramHeader));
+    for (int i = 0; i < header->program_header_entries; ++i)
+    {
+        if (programs[i].type == PT_LOAD)
+            software = crc32c_update_software(software, elf + programs[i].file_offset, programs[i].file_size);
+    }
+    if (CRC32C_FINAL(software) != crc)
+    {
+        fprintf(stderr, "Hardware and table CRC32C disagree: %08x != %08x\n", crc, CRC32C_FINAL(software));
+        return 1;
+    }
+
+    FILE* output = fopen(argv[2], "wb");
+    if (!output || fprintf(output, "%08x", crc) != 8)
+    {
+        fprintf(stderr, "Couldn't write '%s'\n", argv[2]);
+        return 1;
+    }
+    fclose(output);
+
+    printf("%08x (%s)\n", crc, crc32c_is_hardware() ? "sse4.2" : "table");
+    return 0;
+}
@@ -0,0 +1,260 @@
+// Packs a kernel ELF for the bootloader by LZ4 compressing its PT_LOAD
+// payloads (see src/kernel_pack.h for the layout).
+//
+//     kpack build/kernel build/kernel.lz4
+//
+// Every block is decompressed again and compared before it's written, so a
+// packed kernel that comes out of here is known to unpack correctly.
+#include "../src/elf.h"
+#include "../src/kernel_pack.h"
+#include "../src/lz4.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define HASH_LOG 16
+
+static u32 read_u32(const u8* source)
+{
+    u32 value;
+    memcpy(&value, source, sizeof(value));
+    return value;
+}
+
+static u8* write_length(u8* output, usize length)
+{
+    for (; length >= 255; length -= 255)
+        *output++ = 255;
+    *output++ = (u8) length;
+    return output;
+}
+
+static u8* write_sequence(u8* output, const u8* literals, usize literal, usize offset, usize match)
+{
+    u8* token = output++;
+    *token = (u8) ((literal < 15 ? literal : 15) << 4);
+    if (literal >= 15)
+        output = write_length(output, literal - 15);
+
+    memcpy(output, literals, literal);
+    output += literal;
+
+    // The last sequence of a block has no match.
+    if (match == 0)
+        return output;
+
+    *output++ = (u8) (offset & 0xFF);
+    *output++ = (u8) (offset >> 8);
+
+    match -= LZ4_MIN_MATCH;
+    *token |= (u8) (match < 15 ? match : 15);
+    if (match >= 15)
+        output = write_length(output, match - 15);
+    return output;
+}
+
+
+/// Greedy single-probe compressor. It's the decoder speed that matters, and
+/// any valid block decodes equally fast; this only has to be good enough.
+static usize lz4_compress_block(const u8* source, usize size, u8* destination)
+{
+    static u32 table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));  // Positions + 1, 0 being empty.
+
+    u8*   output = destination;
+    usize anchor = 0;
+    usize i      = 0;
+
+    while (size >= LZ4_MF_LIMIT + 1 && i < size - LZ4_MF_LIMIT)
+    {
+        u32   sequence  = read_u32(source + i);
+        u32   hash      = (sequence * 2654435761U) >> (32 - HASH_LOG);
+        usize candidate = table[hash];
+        table[hash] = (u32) (i + 1);
+
+        if (candidate == 0 || i - (candidate - 1) > 0xFFFF || read_u32(source + candidate - 1) != sequence)
+        {
+            i += 1;
+            continue;
+        }
+
+        usize reference = candidate - 1;
+        usize match     = LZ4_MIN_MATCH;
+        while (i + match < size - LZ4_LAST_LITERALS && source[reference + match] == source[i + match])
+            match += 1;
+
+        output = write_sequence(output, source + anchor, i - anchor, i - reference, match);
+        i     += match;
+        anchor = i;
+    }
+
+    output = write_sequence(output, source + anchor, size - anchor, 0, 0);
+    return (usize) (output - destination);
+}
+
+
+static u8* read_file(const char* path, usize* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *size = (usize) ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    u8* data = malloc(*size);
+    if (fread(data, 1, *size, file) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <kernel elf> <packed output>\n", argv[0]);
+        return 1;
+    }
+
+    usize size = 0;
+    u8*   elf  = read_file(argv[1], &size);
+    if (!elf || size < sizeof(Elf64Header) || memcmp(elf, "\x7F" "ELF", 4) != 0 || is_elf64(elf) != ELF_YES ||
+        ((const Elf64Header*) elf)->program_header_entry_size != sizeof(Elf64ProgramHeader))
+    {
+        fprintf(stderr, "Couldn't read a 64-bit ELF from '%s'\n", argv[1]);
+        return 1;
+    }
+
+    const Elf64Header*        header   = (const Elf64Header*) elf;
+    const Elf64ProgramHeader* programs = (const Elf64ProgramHeader*) (elf + header->program_header_offset);
+
+    KernelPackHeader pack = {
+        .magic=KERNEL_PACK_MAGIC,
+        .version=KERNEL_PACK_VERSION,
+        .block_size=KERNEL_PACK_BLOCK_SIZE,
+    };
+    for (int i = 0; i < header->program_header_entries; ++i)
+        pack.segment_count += programs[i].type == PT_LOAD;
+
+    // The parts of the ELF the bootloader reads besides the segments: the
+    // ELF and program headers, and for symbols, the section headers, the
+    // symbol table and its string table.
+    KernelPackExtent extents[4];
+    extents[pack.extent_count++] = (KernelPackExtent) { 0, header->program_header_offset + header->program_header_entries * sizeof(Elf64ProgramHeader), 0 };
+    if (header->section_header_offset && header->section_header_entries)
+    {
+        const Elf64SectionHeader* sections = (const Elf64SectionHeader*) (elf + header->section_header_offset);
+        extents[pack.extent_count++] = (KernelPackExtent) { header->section_header_offset, header->section_header_entries * sizeof(Elf64SectionHeader), 0 };
+
+        for (int i = 0; i < header->section_header_entries; ++i)
+        {
+            if (sections[i].type != SHT_SYMTAB || sections[i].link >= header->section_header_entries)
+                continue;
+            extents[pack.extent_count++] = (KernelPackExtent) { sections[i].offset, sections[i].size, 0 };
+            extents[pack.extent_count++] = (KernelPackExtent) { sections[sections[i].link].offset, sections[sections[i].link].size, 0 };
+            break;
+        }
+    }
+
+    usize extents_size = 0;
+    for (u32 i = 0; i < pack.extent_count; ++i)
+    {
+        if (extents[i].file_offset + extents[i].size > size)
+        {
+            fprintf(stderr, "Extent %u lies outside the file\n", i);
+            return 1;
+        }
+        extents_size += extents[i].size;
+    }
+
+    KernelPackSegment* segments = calloc(pack.segment_count, sizeof(KernelPackSegment));
+    usize capacity = KERNEL_PACK_TABLES_SIZE(&pack) + extents_size + LZ4_COMPRESS_BOUND(size) + size / KERNEL_PACK_BLOCK_SIZE * 64 + 64;
+    u8*   packed   = calloc(1, capacity);
+    u8*   check    = malloc(KERNEL_PACK_BLOCK_SIZE);
+
+    usize position = KERNEL_PACK_TABLES_SIZE(&pack);
+    for (u32 i = 0; i < pack.extent_count; ++i)
+    {
+        extents[i].packed_offset = position;
+        memcpy(packed + position, elf + extents[i].file_offset, extents[i].size);
+        position += extents[i].size;
+    }
+
+    usize segment = 0;
+    for (int i = 0; i < header->program_header_entries; ++i)
+    {
+        const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD)
+            continue;
+
+        if (program->file_offset + program->file_size > size)
+        {
+            fprintf(stderr, "Segment %d lies outside the file\n", i);
+            return 1;
+        }
+
+        usize blocks = KERNEL_PACK_BLOCKS(program->file_size, KERNEL_PACK_BLOCK_SIZE);
+        u32*  sizes  = (u32*) (packed + position);
+
+        segments[segment] = (KernelPackSegment) {
+            .file_offset=program->file_offset,
+            .file_size=program->file_size,
+            .packed_offset=position,
+        };
+        position += blocks * sizeof(u32);
+
+        for (usize j = 0; j < blocks; ++j)
+        {
+            const u8* block      = elf + program->file_offset + j * KERNEL_PACK_BLOCK_SIZE;
+            usize     block_size = program->file_size - j * KERNEL_PACK_BLOCK_SIZE;
+            if (block_size > KERNEL_PACK_BLOCK_SIZE)
+                block_size = KERNEL_PACK_BLOCK_SIZE;
+
+            usize compressed = lz4_compress_block(block, block_size, packed + position);
+            if (compressed >= block_size)
+            {
+                memcpy(packed + position, block, block_size);
+                sizes[j]  = (u32) block_size | KERNEL_PACK_BLOCK_STORED;
+                position += block_size;
+                continue;
+            }
+
+            i64 written = lz4_decompress_block(packed + position, compressed, check, KERNEL_PACK_BLOCK_SIZE);
+            if (written != (i64) block_size || memcmp(check, block, block_size) != 0)
+            {
+                fprintf(stderr, "Block %zu of segment %d didn't survive a round trip\n", j, i);
+                return 1;
+            }
+
+            sizes[j]  = (u32) compressed;
+            position += compressed;
+        }
+
+        segments[segment].packed_size = position - segments[segment].packed_offset;
+        printf("Segment %zu: %zu -> %zu bytes\n", segment, (usize) program->file_size, (usize) segments[segment].packed_size);
+        segment += 1;
+    }
+
+    memcpy(packed, &pack, sizeof(pack));
+    memcpy(packed + sizeof(pack), segments, pack.segment_count * sizeof(KernelPackSegment));
+    memcpy(packed + sizeof(pack) + pack.segment_count * sizeof(KernelPackSegment), extents, pack.extent_count * sizeof(KernelPackExtent));
+
+    FILE* output = fopen(argv[2], "wb");
+    if (!output || fwrite(packed, 1, position, output) != position)
+    {
+        fprintf(stderr, "Couldn't write '%s'\n", argv[2]);
+        return 1;
+    }
+    fclose(output);
+
+    printf("Packed %zu bytes into %zu\n", size, position);
+    return 0;
+}
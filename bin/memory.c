@@ -0,0 +1,445 @@
+// Checks the memory primitives in src/memory.c against the C library, and
+// times them next to it across sizes and alignments.
+//
+//     memory              Check, then time everything.
+//     memory --pages      Check, then only time the page primitives.
+//     memory --check      Only check.
+//
+// Times are the median of several runs, in nanoseconds per call, with the
+// throughput next to them. Every size is repeated until about 64 MiB has
+// gone through, so small sizes measure call overhead and large ones memory
+// bandwidth (past the last level cache).
+//
+// The page primitives are timed against memset and memcpy, along with how
+// long it takes afterwards to read a working set that was in cache before,
+// which is what the non-temporal stores are meant to leave alone.
+#define _POSIX_C_SOURCE 199309L  // clock_gettime under -std=c99.
+#define MEMORY_HOSTED
+#include "../src/memory.c"
+#include "../src/x86_64/cpu.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define BENCH_BYTES_PER_RUN (64ULL * 1024 * 1024)
+#define BENCH_RUNS          5
+#define BUFFER_SIZE         (8 * 1024 * 1024 + 4096)
+
+static const usize SIZES[] = { 8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536, 262144, 1048576, 8388608 };
+
+typedef struct Alignment
+{
+    usize destination;
+    usize source;
+} Alignment;
+
+static const Alignment ALIGNMENTS[] = { { 0, 0 }, { 1, 3 }, { 8, 0 } };
+
+#define ARRAY_COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+
+typedef struct Variant
+{
+    const char* name;
+    memcpy_fn   copy;
+    memset_fn   set;
+} Variant;
+
+static void* libc_memcpy(void* destination, const void* source, usize size)
+{
+    return memcpy(destination, source, size);
+}
+
+static void* libc_memset(void* destination, int value, usize size)
+{
+    return memset(destination, value, size);
+}
+
+static const Variant VARIANTS[] = {
+    { "libc",    libc_memcpy,    libc_memset    },
+    { "general", memcpy_general, memset_general },
+    { "sse2",    memcpy_sse2,    memset_sse2    },
+    { "erms",    memcpy_erms,    memset_erms    },
+};
+
+
+static u8* g_source;
+static u8* g_destination;
+static u8* g_expected;
+
+
+static u64 now_ns()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64) time.tv_sec * 1000000000ULL + (u64) time.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    u64 x = *(const u64 *) a;
+    u64 y = *(const u64 *) b;
+    return x < y ? -1 : x > y;
+}
+
+/// Page aligned, so the alignments below are the ones measured.
+static u8* allocate_buffer()
+{
+    u8* buffer = malloc(BUFFER_SIZE + 4096);
+    return (u8 *) (((usize) buffer + 4095) & ~(usize) 4095);
+}
+
+static void fill_random(u8* buffer, usize size)
+{
+    for (usize i = 0; i < size; ++i)
+        buffer[i] = (u8) rand();
+}
+
+
+/* ---- CHECK ---- */
+static int check_failed(const char* what, const char* variant, usize size, usize offset_a, usize offset_b)
+{
+    fprintf(stderr, "%s (%s) is wrong for %zu bytes at offsets %zu and %zu\n", what, variant, size, offset_a, offset_b);
+    return 1;
+}
+
+static int sign(int value)
+{
+    return (value > 0) - (value < 0);
+}
+
+/// Every size up to 300, then a spread up to 20000, at every pair of
+/// offsets in 0..15, against the C library. Including the bytes around the
+/// destination, which must be left alone.
+static int check()
+{
+    for (usize size = 0; size < 20000; size += size < 300 ? 1 : 331)
+    {
+        for (usize a = 0; a < 16; ++a)
+        {
+            for (usize b = 0; b < 16; b += (size < 300 ? 1 : 7))
+            {
+                for (usize v = 0; v < ARRAY_COUNT(VARIANTS); ++v)
+                {
+                    fill_random(g_source, size + 64);
+                    fill_random(g_destination, size + 64);
+                    memcpy(g_expected, g_destination, size + 64);
+
+                    memcpy(g_expected + a, g_source + b, size);
+                    VARIANTS[v].copy(g_destination + a, g_source + b, size);
+                    if (memcmp(g_expected, g_destination, size + 64) != 0)
+                        return check_failed("memcpy", VARIANTS[v].name, size, a, b);
+
+                    memset(g_expected + a, (int) b * 17, size);
+                    VARIANTS[v].set(g_destination + a, (int) b * 17, size);
+                    if (memcmp(g_expected, g_destination, size + 64) != 0)
+                        return check_failed("memset", VARIANTS[v].name, size, a, b);
+                }
+
+                // Overlapping both ways, in one buffer.
+                fill_random(g_destination, 2 * size + 64);
+                memcpy(g_expected, g_destination, 2 * size + 64);
+                usize from = a + (size / 2);
+                usize to   = b + (a & 1 ? 0 : size);
+                memmove(g_expected + to, g_expected + from, size);
+                memmove_general(g_destination + to, g_destination + from, size);
+                if (memcmp(g_expected, g_destination, 2 * size + 64) != 0)
+                    return check_failed("memmove", "general", size, from, to);
+
+                // Equal, then different at one byte in either direction.
+                fill_random(g_source + b, size);
+                memcpy(g_destination + a, g_source + b, size);
+                if (memcmp_general(g_destination + a, g_source + b, size) != 0)
+                    return check_failed("memcmp", "general", size, a, b);
+                if (size > 0)
+                {
+                    usize at = (usize) rand() % size;
+                    g_destination[a + at] = (u8) (g_source[b + at] + 1 + (u8) (rand() % 255));
+                    int expected = sign(memcmp(g_destination + a, g_source + b, size));
+                    if (sign(memcmp_general(g_destination + a, g_source + b, size)) != expected || sign(memcmp_general(g_source + b, g_destination + a, size)) != -expected)
+                        return check_failed("memcmp", "general", size, a, b);
+                }
+            }
+        }
+    }
+
+    for (usize count = 1; count <= 3; ++count)
+    {
+        usize size = count * PAGE_SIZE;
+        fill_random(g_source, size);
+        fill_random(g_destination, size + PAGE_SIZE);
+        memcpy(g_expected, g_destination, size + PAGE_SIZE);
+
+        memcpy(g_expected, g_source + count, size);
+        copy_pages(g_destination, g_source + count, count);
+        if (memcmp(g_expected, g_destination, size + PAGE_SIZE) != 0)
+            return check_failed("copy_pages", "movnti", size, 0, count);
+
+        memset(g_expected, 0, size);
+        clear_pages(g_destination, count);
+        if (memcmp(g_expected, g_destination, size + PAGE_SIZE) != 0)
+            return check_failed("clear_pages", "movnti", size, 0, 0);
+    }
+
+    printf("memcpy, memset, memmove, memcmp and the page primitives agree with the C library\n");
+    return 0;
+}
+
+
+/* ---- BENCHMARK ---- */
+typedef enum Operation
+{
+    OPERATION_MEMCPY,
+    OPERATION_MEMSET,
+    OPERATION_MEMMOVE,
+    OPERATION_MEMCMP,
+} Operation;
+
+// The volatile pointers keep the compiler from seeing through the calls.
+static void* (* volatile g_copy)(void*, const void*, usize);
+static void* (* volatile g_set)(void*, int, usize);
+static int   (* volatile g_compare)(const void*, const void*, usize);
+static volatile int g_sink;
+
+static void* libc_memmove(void* destination, const void* source, usize size)
+{
+    return memmove(destination, source, size);
+}
+
+static int libc_memcmp(const void* a, const void* b, usize size)
+{
+    return memcmp(a, b, size);
+}
+
+
+/// Median nanoseconds per call.
+static double time_operation(Operation operation, usize size, Alignment alignment)
+{
+    usize iterations = (usize) (BENCH_BYTES_PER_RUN / size);
+    if (iterations < 4)
+        iterations = 4;
+
+    u8*       destination = g_destination + alignment.destination;
+    const u8* source      = g_source + alignment.source;
+    if (operation == OPERATION_MEMMOVE)
+        source = destination + 64;  // Overlapping, copying downwards.
+    if (operation == OPERATION_MEMCMP)
+        memcpy(destination, source, size);  // Equal, so the whole size is compared.
+
+    u64 runs[BENCH_RUNS];
+    for (usize run = 0; run < BENCH_RUNS; ++run)
+    {
+        u64 start = now_ns();
+        for (usize i = 0; i < iterations; ++i)
+        {
+            switch (operation)
+            {
+                case OPERATION_MEMCPY:  g_copy(destination, source, size); break;
+                case OPERATION_MEMSET:  g_set(destination, (int) i, size); break;
+                case OPERATION_MEMMOVE: g_copy(destination, source, size); break;
+                case OPERATION_MEMCMP:  g_sink += g_compare(destination, source, size); break;
+            }
+        }
+        runs[run] = now_ns() - start;
+    }
+
+    qsort(runs, BENCH_RUNS, sizeof(u64), compare_u64);
+    return (double) runs[BENCH_RUNS / 2] / (double) iterations;
+}
+
+
+static void print_size(usize size)
+{
+    if (size >= 1024 * 1024)
+        printf("%6zu MiB", size / (1024 * 1024));
+    else if (size >= 1024)
+        printf("%6zu KiB", size / 1024);
+    else
+        printf("%6zu B  ", size);
+}
+
+static void print_time(double ns, usize size)
+{
+    printf(" %10.1f ns %6.2f GB/s", ns, (double) size / ns);
+}
+
+
+static void bench_table(const char* title, Operation operation, usize implementations, const char* const* names)
+{
+    printf("\n%s\n%-9s %-7s", title, "size", "align");
+    for (usize i = 0; i < implementations; ++i)
+        printf(" %25s", names[i]);
+    printf("\n");
+
+    for (usize s = 0; s < ARRAY_COUNT(SIZES); ++s)
+    {
+        for (usize a = 0; a < ARRAY_COUNT(ALIGNMENTS); ++a)
+        {
+            usize size = SIZES[s];
+            if (operation == OPERATION_MEMMOVE && size + 64 + ALIGNMENTS[a].destination > BUFFER_SIZE)
+                continue;
+
+            print_size(size);
+            printf(" %2zu/%-4zu", ALIGNMENTS[a].destination, ALIGNMENTS[a].source);
+            for (usize i = 0; i < implementations; ++i)
+            {
+                if (operation == OPERATION_MEMCPY)  g_copy    = VARIANTS[i].copy;
+                if (operation == OPERATION_MEMSET)  g_set     = VARIANTS[i].set;
+                if (operation == OPERATION_MEMMOVE) g_copy    = i == 0 ? libc_memmove : memmove_general;
+                if (operation == OPERATION_MEMCMP)  g_compare = i == 0 ? libc_memcmp : memcmp_general;
+                print_time(time_operation(operation, size, ALIGNMENTS[a]), size);
+            }
+            printf("\n");
+        }
+    }
+}
+
+
+/* ---- PAGES ---- */
+#define HOT_SET_SIZE (256 * 1024)
+
+static const usize PAGE_COUNTS[] = { 1, 16, 256, 2048 };
+
+static u8* g_hot_set;
+
+static u64 read_hot_set()
+{
+    u64 sum = 0;
+    for (usize i = 0; i < HOT_SET_SIZE; i += 64)
+        sum += *(volatile u64 *) (g_hot_set + i);
+    return sum;
+}
+
+static void clear_temporal(void* pages, usize count)
+{
+    g_set(pages, 0, count * PAGE_SIZE);
+}
+
+static void copy_temporal(void* destination, const void* source, usize count)
+{
+    g_copy(destination, source, count * PAGE_SIZE);
+}
+
+static void (* volatile g_clear_pages)(void*, usize);
+static void (* volatile g_copy_pages)(void*, const void*, usize);
+
+
+/// Median nanoseconds per call, and then to read the hot set once more.
+static void time_pages(bool copy, usize count, double* call_ns, double* hot_set_ns)
+{
+    usize iterations = (usize) (BENCH_BYTES_PER_RUN / (count * PAGE_SIZE));
+    if (iterations > 256)
+        iterations = 256;
+
+    u64 calls[BENCH_RUNS];
+    u64 rereads[BENCH_RUNS];
+    for (usize run = 0; run < BENCH_RUNS; ++run)
+    {
+        calls[run]   = 0;
+        rereads[run] = 0;
+        for (usize i = 0; i < iterations; ++i)
+        {
+            g_sink += (int) read_hot_set();
+
+            u64 start = now_ns();
+            if (copy)
+                g_copy_pages(g_destination, g_source, count);
+            else
+                g_clear_pages(g_destination, count);
+            u64 middle = now_ns();
+            g_sink += (int) read_hot_set();
+            u64 end = now_ns();
+
+            calls[run]   += middle - start;
+            rereads[run] += end - middle;
+        }
+    }
+
+    qsort(calls, BENCH_RUNS, sizeof(u64), compare_u64);
+    qsort(rereads, BENCH_RUNS, sizeof(u64), compare_u64);
+    *call_ns    = (double) calls[BENCH_RUNS / 2] / (double) iterations;
+    *hot_set_ns = (double) rereads[BENCH_RUNS / 2] / (double) iterations;
+}
+
+
+static void bench_pages()
+{
+    g_copy = g_memcpy;
+    g_set  = g_memset;
+
+    printf("\npages (the hot set is %d KiB, read before and after every call)\n", HOT_SET_SIZE / 1024);
+    printf("%-16s %25s %14s %25s %14s\n", "", "temporal", "hot set", "non-temporal", "hot set");
+    for (int copy = 0; copy <= 1; ++copy)
+    {
+        for (usize c = 0; c < ARRAY_COUNT(PAGE_COUNTS); ++c)
+        {
+            usize  count = PAGE_COUNTS[c];
+            double temporal, temporal_hot, nontemporal, nontemporal_hot;
+
+            g_clear_pages = clear_temporal;
+            g_copy_pages  = copy_temporal;
+            time_pages(copy, count, &temporal, &temporal_hot);
+
+            g_clear_pages = clear_pages;
+            g_copy_pages  = copy_pages;
+            time_pages(copy, count, &nontemporal, &nontemporal_hot);
+
+            printf("%-5s %4zu pages ", copy ? "copy" : "clear", count);
+            print_time(temporal, count * PAGE_SIZE);
+            printf(" %11.1f ns", temporal_hot);
+            print_time(nontemporal, count * PAGE_SIZE);
+            printf(" %11.1f ns\n", nontemporal_hot);
+        }
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    int check_only = argc == 2 && strcmp(argv[1], "--check") == 0;
+    int pages_only = argc == 2 && strcmp(argv[1], "--pages") == 0;
+    if (argc > 2 || (argc == 2 && !check_only && !pages_only))
+    {
+        fprintf(stderr, "Usage: %s [--check | --pages]\n", argv[0]);
+        return 1;
+    }
+
+    g_source      = allocate_buffer();
+    g_destination = allocate_buffer();
+    g_expected    = allocate_buffer();
+    g_hot_set     = allocate_buffer();
+    fill_random(g_source, BUFFER_SIZE);
+    fill_random(g_destination, BUFFER_SIZE);
+
+    printf("Bound variant: %s\n", memory_primitives_init());
+    usize             binding_count = 0;
+    const CpuBinding* bindings      = cpu_bindings(&binding_count);
+    for (usize i = 0; i < binding_count; ++i)
+        printf("    %-8s %s\n", bindings[i].primitive, bindings[i].variant);
+    if (binding_count != 2)
+        return 1;
+    if (check())
+        return 1;
+    if (check_only)
+        return 0;
+    if (pages_only)
+    {
+        bench_pages();
+        return 0;
+    }
+
+    const char* copy_names[ARRAY_COUNT(VARIANTS)];
+    for (usize i = 0; i < ARRAY_COUNT(VARIANTS); ++i)
+        copy_names[i] = VARIANTS[i].name;
+    const char* general_names[] = { "libc", "general" };
+
+    bench_table("memcpy", OPERATION_MEMCPY, ARRAY_COUNT(VARIANTS), copy_names);
+    bench_table("memset", OPERATION_MEMSET, ARRAY_COUNT(VARIANTS), copy_names);
+    bench_table("memmove (overlapping, downwards)", OPERATION_MEMMOVE, 2, general_names);
+    bench_table("memcmp (equal)", OPERATION_MEMCMP, 2, general_names);
+    bench_pages();
+    return 0;
+}
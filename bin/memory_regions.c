@@ -0,0 +1,141 @@
+// Checks how the bootloader boils a firmware memory map down to regions
+// (src/memory_regions.c): sorting, overlaps, merging, and carving out the
+// framebuffer both where it covers whole entries and where it splits one.
+//
+//     memory_regions
+#include "../src/memory_regions.c"
+
+#include <stdio.h>
+#include <string.h>
+
+
+#define MIB (1024ULL * 1024ULL)
+
+
+static int g_failed = 0;
+
+
+static EFI_MEMORY_DESCRIPTOR descriptor(u32 type, u64 start, u64 size)
+{
+    EFI_MEMORY_DESCRIPTOR result = { 0 };
+    result.Type          = type;
+    result.PhysicalStart = start;
+    result.NumberOfPages = size / PAGE_SIZE;
+    return result;
+}
+
+
+static void check(const char* name, const MemoryRegion* actual, usize count, const MemoryRegion* expected, usize expected_count)
+{
+    int failed = count != expected_count;
+    for (usize i = 0; !failed && i < count; ++i)
+        failed = actual[i].start != expected[i].start || actual[i].end != expected[i].end || actual[i].type != expected[i].type;
+
+    printf("%-28s %s\n", name, failed ? "FAILED" : "ok");
+    if (!failed)
+        return;
+
+    for (usize i = 0; i < count; ++i)
+        fprintf(stderr, "    got      [%#llx, %#llx) %u\n", (unsigned long long) actual[i].start, (unsigned long long) actual[i].end, actual[i].type);
+    for (usize i = 0; i < expected_count; ++i)
+        fprintf(stderr, "    expected [%#llx, %#llx) %u\n", (unsigned long long) expected[i].start, (unsigned long long) expected[i].end, expected[i].type);
+    g_failed = 1;
+}
+
+
+#define BUILD(name, map, framebuffer, framebuffer_size, ...) do {                                                        \
+    MemoryRegion regions[MEMORY_REGIONS_CAPACITY(sizeof(map) / sizeof((map)[0]))];                                       \
+    usize count = memory_regions_build(regions, sizeof(regions) / sizeof(regions[0]), map, sizeof(map),                  \
+                                       sizeof((map)[0]), framebuffer, framebuffer_size);                                \
+    const MemoryRegion expected[] = { __VA_ARGS__ };                                                                     \
+    check(name, regions, count, expected, sizeof(expected) / sizeof(expected[0]));                                       \
+} while (0)
+
+
+int main()
+{
+    // Out of order, with an overlap (the lower entry keeps it), an empty
+    // entry and neighbours of the same type to merge.
+    EFI_MEMORY_DESCRIPTOR unsorted[] = {
+        descriptor(EfiConventionalMemory, 4 * MIB, 4 * MIB),
+        descriptor(EfiBootServicesData,   1 * MIB, 1 * MIB),
+        descriptor(EfiConventionalMemory, 0,       1 * MIB),
+        descriptor(EfiLoaderData,         2 * MIB, 2 * MIB + 64 * 1024),
+        descriptor(EfiReservedMemoryType, 9 * MIB, 0),
+    };
+    BUILD("sorted, clipped and merged", unsorted, 0, 0,
+        { 0,                   1 * MIB,            MEMORY_REGION_USABLE },
+        { 1 * MIB,             4 * MIB + 64 * 1024, MEMORY_REGION_RECLAIMABLE },
+        { 4 * MIB + 64 * 1024, 8 * MIB,            MEMORY_REGION_USABLE },
+    );
+
+    // A framebuffer in the middle of one entry splits it in three.
+    EFI_MEMORY_DESCRIPTOR one[] = {
+        descriptor(EfiConventionalMemory, 0, 16 * MIB),
+    };
+    BUILD("carve splitting an entry", one, 4 * MIB + 100, 2 * MIB,
+        { 0,                   4 * MIB,            MEMORY_REGION_USABLE },
+        { 4 * MIB,             6 * MIB + PAGE_SIZE, MEMORY_REGION_FRAMEBUFFER },
+        { 6 * MIB + PAGE_SIZE, 16 * MIB,           MEMORY_REGION_USABLE },
+    );
+
+    // A framebuffer that covers entries whole removes them, and trims the
+    // ones it only partly covers.
+    EFI_MEMORY_DESCRIPTOR several[] = {
+        descriptor(EfiConventionalMemory,   0,        2 * MIB),
+        descriptor(EfiMemoryMappedIO,       2 * MIB,  1 * MIB),
+        descriptor(EfiReservedMemoryType,   3 * MIB,  1 * MIB),
+        descriptor(EfiConventionalMemory,   4 * MIB,  4 * MIB),
+    };
+    BUILD("carve covering entries", several, 1 * MIB, 4 * MIB,
+        { 0,       1 * MIB, MEMORY_REGION_USABLE },
+        { 1 * MIB, 5 * MIB, MEMORY_REGION_FRAMEBUFFER },
+        { 5 * MIB, 8 * MIB, MEMORY_REGION_USABLE },
+    );
+    BUILD("carve covering exactly one", several, 2 * MIB, 1 * MIB,
+        { 0,       2 * MIB, MEMORY_REGION_USABLE },
+        { 2 * MIB, 3 * MIB, MEMORY_REGION_FRAMEBUFFER },
+        { 3 * MIB, 4 * MIB, MEMORY_REGION_RESERVED },
+        { 4 * MIB, 8 * MIB, MEMORY_REGION_USABLE },
+    );
+
+    // A framebuffer the firmware didn't describe goes in the hole, or
+    // past the end.
+    EFI_MEMORY_DESCRIPTOR holes[] = {
+        descriptor(EfiConventionalMemory, 0,       1 * MIB),
+        descriptor(EfiConventionalMemory, 4 * MIB, 1 * MIB),
+    };
+    BUILD("carve in a hole", holes, 2 * MIB, 1 * MIB,
+        { 0,       1 * MIB, MEMORY_REGION_USABLE },
+        { 2 * MIB, 3 * MIB, MEMORY_REGION_FRAMEBUFFER },
+        { 4 * MIB, 5 * MIB, MEMORY_REGION_USABLE },
+    );
+    BUILD("carve past the end", holes, 8 * MIB, 1 * MIB,
+        { 0,       1 * MIB, MEMORY_REGION_USABLE },
+        { 4 * MIB, 5 * MIB, MEMORY_REGION_USABLE },
+        { 8 * MIB, 9 * MIB, MEMORY_REGION_FRAMEBUFFER },
+    );
+
+    // Too little room is refused rather than overrun.
+    MemoryRegion small[MEMORY_REGIONS_CAPACITY(2) - 1];
+    usize count = memory_regions_build(small, sizeof(small) / sizeof(small[0]), holes, sizeof(holes), sizeof(holes[0]), 0, 0);
+    check("too small a table", small, count, NULL, 0);
+
+    MemoryRegion  found[] = { { 0, 1 * MIB, MEMORY_REGION_USABLE }, { 4 * MIB, 5 * MIB, MEMORY_REGION_ACPI } };
+    MemoryRegions table   = { .regions=found, .count=2 };
+    int lookups = memory_regions_find(&table, 0) == &found[0] && memory_regions_find(&table, 1 * MIB - 1) == &found[0] &&
+                  memory_regions_find(&table, 1 * MIB) == NULL && memory_regions_find(&table, 4 * MIB + 5) == &found[1] &&
+                  memory_regions_find(&table, 5 * MIB) == NULL;
+    printf("%-28s %s\n", "lookups", lookups ? "ok" : "FAILED");
+    g_failed |= !lookups;
+
+    // MMIO and reserved ranges above the last of RAM don't count.
+    MemoryRegion  high[]   = { { 0, 1 * MIB, MEMORY_REGION_USABLE }, { 2 * MIB, 3 * MIB, MEMORY_REGION_ACPI }, { 4 * MIB, 5 * MIB, MEMORY_REGION_MMIO }, { 6 * MIB, 7 * MIB, MEMORY_REGION_RESERVED } };
+    MemoryRegions with_mmio = { .regions=high, .count=4 };
+    MemoryRegions no_ram    = { .regions=&high[2], .count=2 };
+    int ram_end = memory_regions_ram_end(&with_mmio) == 3 * MIB && memory_regions_ram_end(&no_ram) == 0;
+    printf("%-28s %s\n", "end of RAM", ram_end ? "ok" : "FAILED");
+    g_failed |= !ram_end;
+
+    return g_failed;
+}
@@ -0,0 +1,144 @@
+// Packs boot assets into one boot archive (see src/boot_archive.h).
+//
+//     mkarchive build/boot.arc kernel=build/kernel.lz4 drive/default-font.psf ...
+//
+// Each file is stored under its base name, or under the name before '=' if
+// one is given.
+#include "../src/boot_archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct Input
+{
+    const char* path;
+    char        name[BOOT_ARCHIVE_NAME_SIZE];
+    u8*         data;
+    u64         size;
+} Input;
+
+
+static int compare_inputs(const void* a, const void* b)
+{
+    return strncmp(((const Input *) a)->name, ((const Input *) b)->name, BOOT_ARCHIVE_NAME_SIZE);
+}
+
+static u64 align_up(u64 value)
+{
+    return (value + BOOT_ARCHIVE_ALIGNMENT - 1) & ~((u64) BOOT_ARCHIVE_ALIGNMENT - 1);
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <output> [name=]<file>...\n", argv[0]);
+        return 1;
+    }
+
+    usize count = (usize) argc - 2;
+    if (count > 0xFFFF)
+    {
+        fprintf(stderr, "Too many files\n");
+        return 1;
+    }
+    Input* inputs = calloc(count, sizeof(Input));
+
+    for (usize i = 0; i < count; ++i)
+    {
+        Input*      input    = &inputs[i];
+        const char* argument = argv[i + 2];
+        const char* equals   = strchr(argument, '=');
+        const char* name;
+        usize       length;
+        if (equals)
+        {
+            name   = argument;
+            length = (usize) (equals - argument);
+            input->path = equals + 1;
+        }
+        else
+        {
+            const char* slash = strrchr(argument, '/');
+            name   = slash ? slash + 1 : argument;
+            length = strlen(name);
+            input->path = argument;
+        }
+
+        if (length == 0 || length > BOOT_ARCHIVE_NAME_SIZE)
+        {
+            fprintf(stderr, "Name of '%s' must be 1 to %d characters\n", argument, BOOT_ARCHIVE_NAME_SIZE);
+            return 1;
+        }
+        memcpy(input->name, name, length);
+
+        FILE* file = fopen(input->path, "rb");
+        if (!file)
+        {
+            fprintf(stderr, "Couldn't open '%s'\n", input->path);
+            return 1;
+        }
+        fseek(file, 0, SEEK_END);
+        input->size = (u64) ftell(file);
+        fseek(file, 0, SEEK_SET);
+        input->data = malloc(input->size ? input->size : 1);
+        if (fread(input->data, 1, input->size, file) != input->size)
+        {
+            fprintf(stderr, "Couldn't read '%s'\n", input->path);
+            return 1;
+        }
+        fclose(file);
+    }
+
+    // The bootloader looks files up with a binary search over the index.
+    qsort(inputs, count, sizeof(Input), compare_inputs);
+    for (usize i = 1; i < count; ++i)
+    {
+        if (compare_inputs(&inputs[i - 1], &inputs[i]) == 0)
+        {
+            fprintf(stderr, "'%.*s' is given twice\n", BOOT_ARCHIVE_NAME_SIZE, inputs[i].name);
+            return 1;
+        }
+    }
+
+    BootArchiveEntry* entries = calloc(count ? count : 1, sizeof(BootArchiveEntry));
+    u64 offset = align_up(sizeof(BootArchiveHeader) + count * sizeof(BootArchiveEntry));
+    for (usize i = 0; i < count; ++i)
+    {
+        memcpy(entries[i].name, inputs[i].name, BOOT_ARCHIVE_NAME_SIZE);
+        entries[i].offset = offset;
+        entries[i].size   = inputs[i].size;
+        offset = align_up(offset + inputs[i].size);
+    }
+
+    // The last payload isn't padded out, so the archive ends with its data.
+    u64 size = count ? entries[count - 1].offset + entries[count - 1].size : offset;
+    BootArchiveHeader header = {
+        .magic=BOOT_ARCHIVE_MAGIC,
+        .version=BOOT_ARCHIVE_VERSION,
+        .entry_count=(u16) count,
+        .size=size,
+    };
+
+    u8* archive = calloc(1, size);
+    memcpy(archive, &header, sizeof(header));
+    memcpy(archive + sizeof(header), entries, count * sizeof(BootArchiveEntry));
+    for (usize i = 0; i < count; ++i)
+        memcpy(archive + entries[i].offset, inputs[i].data, inputs[i].size);
+
+    FILE* output = fopen(argv[1], "wb");
+    if (!output || fwrite(archive, 1, size, output) != size)
+    {
+        fprintf(stderr, "Couldn't write '%s'\n", argv[1]);
+        return 1;
+    }
+    fclose(output);
+
+    for (usize i = 0; i < count; ++i)
+        printf("%-*.*s %10llu bytes at %llx\n", 24, BOOT_ARCHIVE_NAME_SIZE, entries[i].name, (unsigned long long) entries[i].size, (unsigned long long) entries[i].offset);
+    printf("%s: %zu files, %llu bytes\n", argv[1], count, (unsigned long long) size);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include "../src/allocator.c"
+#include "../src/x86_64/cpu.c"
 
 
 void debug_break()
@@ -7,15 +8,70 @@ void debug_break()
 
 }
 
+u64 x86_64_cr4_get()
+{
+    return 0;
+}
+
+void* x86_64_cr3_get()
+{
+    return NULL;
+}
+
+void x86_64_cr3_set(void* table)
+{
+
+}
+
+void clear_page(void* page)
+{
+    memset(page, 0, PAGE_SIZE);
+}
+
+void* memset_general(void* destination, int value, usize size)
+{
+    return memset(destination, value, size);
+}
+
 typedef struct
 {
     int x;
 } Temp __attribute__((aligned(PAGE_SIZE)));
 
+
+/// Walk `map` by hand, the way the CPU does, and return the physical address
+/// `virtual_address` translates to (~0 if it doesn't). `leaf` is set to the
+/// entry the walk ended at.
+static u64 translate(const PageMap* map, u64 virtual_address, u64* leaf)
+{
+    const PageTable* table = map->root;
+    for (int level = map->levels - 1; level >= 0; --level)
+    {
+        u64 entry = table->entries[(virtual_address >> (12 + 9 * level)) & 0x1FF].data;
+        if (!PAGE_ENTRY_PRESENT_IS_SET(entry))
+            return ~0ULL;
+
+        if (level == 0 || PAGE_ENTRY_LARGER_PAGES_IS_SET(entry))
+        {
+            u64 size = PAGE_LEVEL_SIZE(level);
+            *leaf = entry;
+            return (PAGE_ENTRY_ADDRESS_GET(entry) & ~(size - 1)) + (virtual_address & (size - 1));
+        }
+        table = (const PageTable*) PAGE_ENTRY_ADDRESS_GET(entry);
+    }
+    return ~0ULL;
+}
+
+static int check(int condition, const char* name)
+{
+    printf("%-48s %s\n", name, condition ? "ok" : "FAILED");
+    return !condition;
+}
+
 int main()
 {
-    usize memory_size = PAGE_SIZE * 128;
-    Temp* temp        = (Temp*) malloc(memory_size);
+    usize memory_size = PAGE_SIZE * 1024;
+    Temp* temp        = (Temp*) (((usize) malloc(memory_size + PAGE_SIZE) + PAGE_SIZE - 1) & ~(usize) (PAGE_SIZE - 1));
     void* memory      = (void *) temp;
 
     PageAllocator allocator = page_allocator_new(memory, memory_size);
@@ -29,8 +85,9 @@ int main()
     );
 
 
-    PageTable* pml4 = page_allocator_request_page(&allocator);
-    page_table_identity_map(pml4, &allocator);
+    PageTablePool pool = page_table_pool_new(&allocator);
+    PageMap map = page_map_new(&pool, 4);
+    page_table_identity_map(&map);
 
     printf(
             "Total memory:    %zu Kib\n"
@@ -39,4 +96,79 @@ int main()
             "Used memory:     %zu Kib\n\n",
             (allocator.pages_total * PAGE_SIZE) / 1024, (allocator.pages_free * PAGE_SIZE) / 1024, (allocator.pages_reserved * PAGE_SIZE) / 1024, (allocator.pages_used * PAGE_SIZE) / 1024
     );
-}
\ No newline at end of file
+
+    printf(
+            "Page tables:     %zu\n"
+            "Page table pool: %zu Kib\n",
+            pool.tables_used, (pool.pages_reserved * PAGE_SIZE) / 1024
+    );
+
+    // The identity map was built a page at a time, but covers 4 MiB.
+    usize promoted = page_map_promote(&map);
+
+    printf(
+            "Promoted:        %zu\n"
+            "Page tables:     %zu\n",
+            promoted, pool.tables_used
+    );
+
+    // Pretend the CPU touched the first 2 MiB and wrote to the second.
+    DemandPager pager = { .map=&map, .allocator=&allocator };
+    LazyRegion* region = demand_pager_reserve(&pager, LAZY_REGION_HEAP, 0, memory_size);
+    PageTable* directory = (PageTable*) PAGE_ENTRY_ADDRESS_GET(((PageTable*) PAGE_ENTRY_ADDRESS_GET(map.root->entries[0].data))->entries[0].data);
+    PAGE_ENTRY_ACCESSED_SET(directory->entries[0].data);
+    PAGE_ENTRY_ACCESSED_SET(directory->entries[1].data);
+    PAGE_ENTRY_DIRTY_SET(directory->entries[1].data);
+
+    for (int scan = 0; scan < 3; ++scan)
+    {
+        demand_pager_scan(&pager);
+        printf("Scan %d:          %zu accessed, %zu dirty, age %d\n", scan, region->accessed, region->dirty, region->age);
+    }
+    printf("\n");
+
+    // A 5-level map. The direct map's base has a PML5 index of its own, so
+    // translations there go through all five tables.
+    int     failed = 0;
+    u64     leaf   = 0;
+    PageMap map5   = page_map_new(&pool, 5);
+    map5.nx = true;
+
+    u64 page = DIRECT_MAP_BASE(5) + 0x12345000;
+    u64 frame = (u64) memory + 7 * PAGE_SIZE;
+    map_memory(&map5, page, frame, PAGE_MAP_WRITE);
+    failed |= check(translate(&map5, page + 0x678, &leaf) == frame + 0x678, "PML5: 4 KiB page translates");
+    failed |= check(PAGE_ENTRY_NO_EXECUTE_IS_SET(leaf) && PAGE_ENTRY_READ_WRITE_IS_SET(leaf), "PML5: 4 KiB page is writable, not executable");
+    failed |= check(translate(&map5, page + PAGE_SIZE, &leaf) == ~0ULL, "PML5: next page isn't mapped");
+
+    // Faults are the pager's clock, each DEMAND_PAGER_TICK_FAULTS of them run a tick.
+    demand_pager_install(&pager);
+    LazyRegion* lazy = demand_pager_reserve(&pager, LAZY_REGION_BSS, 0x40000000, DEMAND_PAGER_TICK_FAULTS * PAGE_SIZE);
+    for (usize i = 0; i < DEMAND_PAGER_TICK_FAULTS; ++i)
+        demand_pager_handle_fault(lazy->start + i * PAGE_SIZE, 0);
+    failed |= check(lazy->faults == DEMAND_PAGER_TICK_FAULTS && translate(&map, lazy->start, &leaf) != ~0ULL, "Demand faults map pages");
+    failed |= check(pager.ticks == 1 && pager.faults_since_tick == 0, "Demand faults tick the pager");
+
+    // 64 MiB of RAM, with a page of MMIO in the middle of it and one above.
+    MemoryRegion  ram_and_mmio[] = {
+        { 0,           0x01000000,  MEMORY_REGION_USABLE },
+        { 0x01000000,  0x01001000,  MEMORY_REGION_MMIO },
+        { 0x01001000,  0x04000000,  MEMORY_REGION_RECLAIMABLE },
+        { 0xFEC00000,  0xFEC01000,  MEMORY_REGION_MMIO },
+    };
+    MemoryRegions regions = { .regions=ram_and_mmio, .count=4 };
+    u64 base = page_table_direct_map(&map5, &regions, 0x04000000);
+
+    failed |= check(base == DIRECT_MAP_BASE(5), "PML5: direct map base");
+    failed |= check(translate(&map5, base + 0x2345678, &leaf) == 0x2345678, "PML5: RAM translates");
+    failed |= check(PAGE_ENTRY_NO_EXECUTE_IS_SET(leaf) && !PAGE_ENTRY_CACHE_DISABLED_IS_SET(leaf), "PML5: RAM is cached, not executable");
+    failed |= check(translate(&map5, base + 0x01000010, &leaf) == 0x01000010 && PAGE_ENTRY_CACHE_DISABLED_IS_SET(leaf) && PAGE_ENTRY_WRITE_THROUGH_IS_SET(leaf), "PML5: MMIO in RAM is uncached");
+    failed |= check(translate(&map5, base + 0xFEC00020, &leaf) == 0xFEC00020 && PAGE_ENTRY_CACHE_DISABLED_IS_SET(leaf), "PML5: MMIO above RAM is uncached");
+    failed |= check(translate(&map5, base + 0x04000000, &leaf) == ~0ULL, "PML5: stops at the end of RAM");
+    failed |= check(translate(&map5, base + 0x80000000, &leaf) == ~0ULL, "PML5: holes past RAM aren't mapped");
+
+    failed |= check(page_map_allow_execute(&map5, base + 0x2345678) && translate(&map5, base + 0x2345678, &leaf) != ~0ULL && !PAGE_ENTRY_NO_EXECUTE_IS_SET(leaf), "PML5: execute can be allowed");
+    failed |= check(!page_map_allow_execute(&map5, base + 0x80000000), "PML5: not where nothing is mapped");
+
+    return failed;
+}
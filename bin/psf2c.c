@@ -0,0 +1,110 @@
+// Compiles a PSF1 font into a C header, so the kernel can carry its font
+// instead of the bootloader loading one (see KERNEL_BUILTIN_FONT).
+//
+//     psf2c [--masks] drive/default-font.psf build/builtin_font.h
+//
+// With --masks every glyph row is also expanded into a u64 with one byte per
+// pixel, 0xFF where it's set, counted from the left. Sign-extending a byte
+// gives a full pixel mask, so rows can be drawn without testing bits.
+#include "../src/types.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define PSF1_MAGIC_0     0x36
+#define PSF1_MAGIC_1     0x04
+#define PSF1_MODE_512    0x01
+
+
+static u64 expand_row(u8 bits)
+{
+    u64 lanes = 0;
+    for (int col = 0; col < 8; ++col)
+    {
+        if (bits & (0x80 >> col))
+            lanes |= (u64) 0xFF << (8 * col);
+    }
+    return lanes;
+}
+
+
+int main(int argc, char* argv[])
+{
+    int masks = argc == 4 && strcmp(argv[1], "--masks") == 0;
+    if (argc != 3 + masks)
+    {
+        fprintf(stderr, "Usage: %s [--masks] <font.psf> <output.h>\n", argv[0]);
+        return 1;
+    }
+    const char* input_path  = argv[1 + masks];
+    const char* output_path = argv[2 + masks];
+
+    FILE* file = fopen(input_path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Couldn't open '%s'\n", input_path);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    usize size = (usize) ftell(file);
+    fseek(file, 0, SEEK_SET);
+    u8* font = malloc(size);
+    if (fread(font, 1, size, file) != size || size < 4 || font[0] != PSF1_MAGIC_0 || font[1] != PSF1_MAGIC_1)
+    {
+        fprintf(stderr, "Couldn't read a PSF1 font from '%s'\n", input_path);
+        return 1;
+    }
+    fclose(file);
+
+    // The unicode table after the glyphs isn't used by the renderer.
+    u8    mode   = font[2];
+    u8    height = font[3];
+    usize count  = (mode & PSF1_MODE_512) ? 512 : 256;
+    const u8* glyphs = font + 4;
+    if (height == 0 || size < 4 + count * height)
+    {
+        fprintf(stderr, "'%s' is truncated\n", input_path);
+        return 1;
+    }
+
+    FILE* output = fopen(output_path, "w");
+    if (!output)
+    {
+        fprintf(stderr, "Couldn't write '%s'\n", output_path);
+        return 1;
+    }
+
+    fprintf(output, "// Generated by bin/psf2c from %s. Don't edit.\n", input_path);
+    fprintf(output, "#pragma once\n\n");
+    fprintf(output, "#define BUILTIN_FONT_HEIGHT      %d\n", height);
+    fprintf(output, "#define BUILTIN_FONT_GLYPH_COUNT %zu\n", count);
+    if (masks)
+        fprintf(output, "#define BUILTIN_FONT_MASKS       1\n");
+
+    fprintf(output, "\nstatic const PSF1_Header builtin_font_header = { { 0x%02x, 0x%02x }, 0x%02x, %d };\n", font[0], font[1], mode, height);
+
+    fprintf(output, "\nstatic const u8 builtin_font_glyphs[%zu] = {", count * height);
+    for (usize i = 0; i < count * height; ++i)
+        fprintf(output, "%s0x%02x,", i % 16 ? " " : "\n    ", glyphs[i]);
+    fprintf(output, "\n};\n");
+
+    if (masks)
+    {
+        fprintf(output, "\n// Byte i of a row is 0xFF if pixel i from the left is set.\n");
+        fprintf(output, "static const u64 builtin_font_masks[%zu] = {", count * height);
+        for (usize i = 0; i < count * height; ++i)
+            fprintf(output, "%s0x%016llxULL,", i % 4 ? " " : "\n    ", (unsigned long long) expand_row(glyphs[i]));
+        fprintf(output, "\n};\n");
+    }
+
+    if (fclose(output) != 0)
+    {
+        fprintf(stderr, "Couldn't write '%s'\n", output_path);
+        return 1;
+    }
+
+    printf("%s: %zu glyphs of height %d%s\n", output_path, count, height, masks ? ", with row masks" : "");
+    return 0;
+}
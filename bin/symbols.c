@@ -0,0 +1,118 @@
+// Checks the kernel symbol table (src/symbols.c): that sorting orders any
+// shuffle of symbols by address, that lookups by address land in the right
+// function and miss gaps, and that lookups by name find every symbol
+// through the collisions of the open addressing index.
+//
+//     symbols
+#include "../src/symbols.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define SYMBOL_COUNT 5000
+#define NAME_SIZE    16
+
+
+static int g_failed = 0;
+
+static void expect(int condition, const char* message, u64 value)
+{
+    if (condition)
+        return;
+    fprintf(stderr, "%s (%llu)\n", message, (unsigned long long) value);
+    g_failed = 1;
+}
+
+
+/// A table with symbol i at 0x1000 + 0x100 * i, 0x80 bytes long, except
+/// that every tenth has no size. Shuffled, so that sorting has work to do.
+static SymbolTable make_table(u32 count)
+{
+    SymbolTable table = { 0 };
+    table.symbols      = calloc(count, sizeof(Symbol));
+    table.names        = calloc(count, NAME_SIZE);
+    table.count        = count;
+    table.bucket_count = 1;
+    while (table.bucket_count < 2 * count)
+        table.bucket_count *= 2;
+    table.buckets = calloc(table.bucket_count, sizeof(u32));
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        snprintf(table.names + i * NAME_SIZE, NAME_SIZE, "function_%u", i);
+        table.symbols[i] = (Symbol) { .address=0x1000 + 0x100 * (u64) i, .size=(i % 10) ? 0x80 : 0, .name=i * NAME_SIZE };
+    }
+    for (u32 i = count - 1; i > 0; --i)
+    {
+        u32    j    = (u32) rand() % (i + 1);
+        Symbol swap = table.symbols[i];
+        table.symbols[i] = table.symbols[j];
+        table.symbols[j] = swap;
+    }
+    return table;
+}
+
+static void free_table(SymbolTable* table)
+{
+    free(table->symbols);
+    free(table->names);
+    free(table->buckets);
+}
+
+
+static void check_table(u32 count)
+{
+    SymbolTable table = make_table(count);
+    symbol_table_sort(&table);
+    symbol_table_index(&table);
+
+    for (u32 i = 1; i < count; ++i)
+        expect(table.symbols[i - 1].address < table.symbols[i].address, "Symbols aren't sorted by address", i);
+
+    expect(symbol_table_find_address(&table, 0xFFF) == NULL, "Found a symbol before the first", count);
+    for (u32 i = 0; i < count; ++i)
+    {
+        u64           address = 0x1000 + 0x100 * (u64) i;
+        const Symbol* symbol  = symbol_table_find_address(&table, address);
+        expect(symbol && symbol->address == address, "Start of a function not found", i);
+        symbol = symbol_table_find_address(&table, address + 0x7F);
+        expect(symbol && symbol->address == address, "End of a function not found", i);
+
+        // Past the end of a sized function is a gap. One without a size
+        // reaches up to the next.
+        symbol = symbol_table_find_address(&table, address + 0x80);
+        if (i % 10)
+            expect(symbol == NULL, "Found a function in a gap", i);
+        else
+            expect(symbol && symbol->address == address, "Function without a size not found", i);
+
+        char name[NAME_SIZE];
+        snprintf(name, sizeof(name), "function_%u", i);
+        symbol = symbol_table_find_name(&table, name);
+        expect(symbol && symbol->address == address, "Function not found by name", i);
+    }
+
+    expect(symbol_table_find_name(&table, "function_") == NULL, "Found a prefix of a name", count);
+    expect(symbol_table_find_name(&table, "function_00") == NULL, "Found a name that isn't there", count);
+    expect(symbol_table_find_name(&table, "") == NULL, "Found the empty name", count);
+
+    printf("%5u symbols: %s\n", count, g_failed ? "FAILED" : "ok");
+    free_table(&table);
+}
+
+
+int main()
+{
+    SymbolTable empty = { 0 };
+    expect(symbol_table_find_address(&empty, 0x1000) == NULL, "Found an address in an empty table", 0);
+    expect(symbol_table_find_name(&empty, "function_0") == NULL, "Found a name in an empty table", 0);
+    expect(symbol_table_find_address(NULL, 0x1000) == NULL, "Found an address without a table", 0);
+
+    check_table(1);
+    check_table(2);
+    check_table(100);
+    check_table(SYMBOL_COUNT);
+    return g_failed;
+}
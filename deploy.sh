@@ -24,7 +24,17 @@ mount -t msdos "${disk}" /tmp/mnt &> /dev/null
 cp build/BOOTX64.EFI /tmp/mnt/EFI/Boot/BOOTX64.EFI
 cp drive/text.txt /tmp/mnt/text.txt
 cp drive/default-font.psf /tmp/mnt/default-font.psf
-cp build/kernel /tmp/mnt/kernel
+if [ build/kernel.lz4 -nt build/kernel ]; then
+  cp build/kernel.lz4 /tmp/mnt/kernel
+else
+  cp build/kernel /tmp/mnt/kernel
+fi
+cp build/kernel.crc /tmp/mnt/kernel.crc
+if [ build/boot.arc -nt build/kernel ]; then
+  cp build/boot.arc /tmp/mnt/boot.arc
+else
+  rm -f /tmp/mnt/boot.arc
+fi
 
 
 # Unmount and detach the disk.
@@ -1,142 +1,546 @@
-#include "bit.h"
-#include "page_allocator.h"
-
-#define PAGE_ENTRY_PRESENT_SET(data)                BIT_SET(data, 0)
-#define PAGE_ENTRY_READ_WRITE_SET(data)             BIT_SET(data, 1)
-#define PAGE_ENTRY_SUPER_USER_SET(data)             BIT_SET(data, 2)
-#define PAGE_ENTRY_WRITE_THROUGH_SET(data)          BIT_SET(data, 3)
-#define PAGE_ENTRY_CACHE_DISABLED_SET(data)         BIT_SET(data, 4)
-#define PAGE_ENTRY_ACCESSED_SET(data)               BIT_SET(data, 5)
-#define PAGE_ENTRY_LARGER_PAGES_SET(data)           BIT_SET(data, 7)
-#define PAGE_ENTRY_AVAILABLE_SET(data, value)       ((data) |= ((((value) & 0b111) << 9)))
-#define PAGE_ENTRY_ADDRESS_SET(data, address)       ((data) |= (((u64) (address)) >> 12))
-
-#define PAGE_ENTRY_PRESENT_IS_SET(data)             BIT_CHECK(data, 0)
-#define PAGE_ENTRY_READ_WRITE_IS_SET(data)          BIT_CHECK(data, 1)
-#define PAGE_ENTRY_SUPER_USER_IS_SET(data)          BIT_CHECK(data, 2)
-#define PAGE_ENTRY_WRITE_THROUGH_IS_SET(data)       BIT_CHECK(data, 3)
-#define PAGE_ENTRY_CACHE_DISABLED_IS_SET(data)      BIT_CHECK(data, 4)
-#define PAGE_ENTRY_ACCESSED_IS_SET(data)            BIT_CHECK(data, 5)
-#define PAGE_ENTRY_LARGER_PAGES_IS_SET(data)        BIT_CHECK(data, 7)
-#define PAGE_ENTRY_ADDRESS_GET(data)                ((((u64) (data)) << 12) & 0x000FFFFFFFFFFFFF)
-
-
-typedef struct
-{
-    u16 level_0;
-    u16 level_1;
-    u16 level_2;
-    u16 level_3;
-} PageIndex;
+#include "allocator.h"
+#include "x86_64/x86_64.h"
+#include "x86_64/cpu.h"
+#include "memory.h"
 
 
 PageIndex map_virtual_address(u64 virtual_address)
 {
     PageIndex page_index = { 0 };
     virtual_address >>= 12;
-    page_index.level_0 = virtual_address & 0x1FF;
-    virtual_address >>= 9;
-    page_index.level_1 = virtual_address & 0x1FF;
-    virtual_address >>= 9;
-    page_index.level_2 = virtual_address & 0x1FF;
-    virtual_address >>= 9;
-    page_index.level_3 = virtual_address & 0x1FF;
+    for (usize level = 0; level < PAGE_LEVELS_MAX; ++level)
+    {
+        page_index.level[level] = virtual_address & 0x1FF;
+        virtual_address >>= 9;
+    }
     return page_index;
 }
 
 
-typedef struct
+void* memset(void* source, int value, size_t size);
+
+
+/* ---- PAGE TABLE POOL ---- */
+static inline void page_table_pool_zero(void* memory, usize size)
 {
-    u64 data;
-} PageEntry;
+    usize count = size / sizeof(u64);
+    __asm__ __volatile__("rep stosq" : "+D"(memory), "+c"(count) : "a"(0ULL) : "memory");
+}
+
 
-typedef struct PageTable
+PageTablePool page_table_pool_new(PageAllocator* allocator)
 {
-    PageEntry entries[512];
-} __attribute__((aligned(PAGE_SIZE))) PageTable;
+    PageTablePool pool = { .allocator=allocator };
+    return pool;
+}
 
-void* memset(void* source, int value, size_t size);
 
-void map_memory(PageTable* pml4, PageAllocator* allocator, u64 virtual_address, u64 physical_address)
+/// Hand out a zeroed page table. O(1) unless a new chunk has to be reserved.
+PageTable* page_table_pool_request(PageTablePool* pool)
 {
-    PageIndex index = map_virtual_address(virtual_address);
-    PageEntry entry = { 0 };
+    PageTable* table = pool->free_list;
+    if (table)
+    {
+        pool->free_list = (PageTable*) table->entries[0].data;
+        table->entries[0].data = 0;
+        pool->tables_used += 1;
+        return table;
+    }
+
+    if (pool->next == pool->end)
+    {
+        void* chunk = page_allocator_find_free_pages(pool->allocator, PAGE_TABLE_POOL_CHUNK_PAGES);
+        page_allocator_reserve_pages(pool->allocator, chunk, PAGE_TABLE_POOL_CHUNK_PAGES);
+        page_table_pool_zero(chunk, PAGE_TABLE_POOL_CHUNK_PAGES * PAGE_SIZE);
+
+        pool->next = (PageTable*) chunk;
+        pool->end  = pool->next + PAGE_TABLE_POOL_CHUNK_PAGES;
+        pool->pages_reserved += PAGE_TABLE_POOL_CHUNK_PAGES;
+    }
+
+    pool->tables_used += 1;
+    return pool->next++;
+}
+
+
+/// Give a table back to the pool. It must no longer be referenced by any entry.
+void page_table_pool_release(PageTablePool* pool, PageTable* table)
+{
+    page_table_pool_zero(table, sizeof(PageTable));
+    table->entries[0].data = (u64) pool->free_list;
+    pool->free_list   = table;
+    pool->tables_used -= 1;
+}
+
+
+/* ---- PAGING LEVELS ---- */
+/// Whether the CPU can do 5-level paging.
+bool paging_la57_supported()
+{
+    return cpu_has(CPU_FEATURE_LA57);
+}
+
+/// Number of levels the active page tables have. CR4.LA57 can't be toggled
+/// in long mode, so this is whatever the firmware chose to run with.
+u8 paging_levels_active()
+{
+    return BIT_CHECK(x86_64_cr4_get(), X86_64_CR4_LA57) ? 5 : 4;
+}
+
+
+/// Turn on EFER.NXE if the CPU has it. Returns whether pages can be marked
+/// no-execute.
+bool paging_nx_enable()
+{
+    if (!cpu_has(CPU_FEATURE_NX))
+        return false;
+
+    u64 efer = x86_64_rdmsr(X86_64_MSR_EFER);
+    if (!BIT_CHECK(efer, X86_64_EFER_NXE))
+        x86_64_wrmsr(X86_64_MSR_EFER, efer | (1ULL << X86_64_EFER_NXE));
+    return true;
+}
+
+
+PageMap page_map_new(PageTablePool* pool, u8 levels)
+{
+    ASSERTF(levels == 4 || levels == 5, "Only 4- and 5-level paging exist!");
+    PageMap map = { .root=page_table_pool_request(pool), .tables=pool, .levels=levels };
+    return map;
+}
 
-    LOGF("Mapping %x to %x with index %d - %d - %d - %d\r", virtual_address, physical_address, index.level_3, index.level_2, index.level_1, index.level_0);
 
-    PageTable* page_directory_pointer = 0;
-    entry = pml4->entries[index.level_3];
-    if (!entry.data)
+/// Whether `map` is the one the CPU is currently translating through.
+static bool page_map_is_live(PageMap* map)
+{
+    return PAGE_ENTRY_ADDRESS_GET(x86_64_cr3_get()) == (u64) map->root;
+}
+
+
+/// Find the entry that maps `virtual_address` without creating any tables.
+/// `level` is set to the level the walk stopped at: where a large page was
+/// found, or where the next table is missing, in which case NULL is returned.
+static PageEntry* page_map_lookup(PageMap* map, u64 virtual_address, usize* level)
+{
+    PageIndex  index = map_virtual_address(virtual_address);
+    PageTable* table = map->root;
+
+    for (*level = map->levels - 1; *level > 0; --*level)
+    {
+        PageEntry* entry = &table->entries[index.level[*level]];
+        if (!PAGE_ENTRY_PRESENT_IS_SET(entry->data))
+            return NULL;
+        if (PAGE_ENTRY_LARGER_PAGES_IS_SET(entry->data))
+            return entry;
+        table = (PageTable*) PAGE_ENTRY_ADDRESS_GET(entry->data);
+    }
+
+    return &table->entries[index.level[0]];
+}
+
+
+/// Walk down to the entry that maps `virtual_address` at `target_level`
+/// (0 = page table, 1 = page directory, ...), creating missing tables.
+static PageEntry* page_map_walk(PageMap* map, u64 virtual_address, usize target_level)
+{
+    PageIndex  index = map_virtual_address(virtual_address);
+    PageTable* table = map->root;
+
+    for (usize level = map->levels - 1; level > target_level; --level)
+    {
+        PageEntry entry = table->entries[index.level[level]];
+        if (!entry.data)
+        {
+            PageTable* next = page_table_pool_request(map->tables);
+
+            PAGE_ENTRY_PRESENT_SET(entry.data);
+            PAGE_ENTRY_READ_WRITE_SET(entry.data);
+            PAGE_ENTRY_ADDRESS_SET(entry.data, next);
+            table->entries[index.level[level]] = entry;
+        }
+
+        ASSERTF(!PAGE_ENTRY_LARGER_PAGES_IS_SET(entry.data), "Address is already covered by a large page!");
+        table = (PageTable*) PAGE_ENTRY_ADDRESS_GET(entry.data);
+    }
+
+    return &table->entries[index.level[target_level]];
+}
+
+
+/// Map a 4 KiB page, readable plus whatever PAGE_MAP_* `flags` allow. Pages
+/// are only kept from executing if the map has NX available.
+///
+/// Doesn't log, as demand_pager_handle_fault calls it from the page fault
+/// handler: the kernel's printf isn't reentrant, and the bootloader's goes
+/// to a console that's gone after ExitBootServices.
+void map_memory(PageMap* map, u64 virtual_address, u64 physical_address, u32 flags)
+{
+    PageEntry* entry = page_map_walk(map, virtual_address, 0);
+    ASSERTF(!PAGE_ENTRY_PRESENT_IS_SET(entry->data), "Page is already mapped!");
+
+    PAGE_ENTRY_PRESENT_SET(entry->data);
+    if (flags & PAGE_MAP_WRITE)
+        PAGE_ENTRY_READ_WRITE_SET(entry->data);
+    if (!(flags & PAGE_MAP_EXECUTE) && map->nx)
+        PAGE_ENTRY_NO_EXECUTE_SET(entry->data);
+    if (flags & PAGE_MAP_UNCACHED)
     {
-        page_directory_pointer = page_allocator_request_page(allocator);
+        PAGE_ENTRY_WRITE_THROUGH_SET(entry->data);
+        PAGE_ENTRY_CACHE_DISABLED_SET(entry->data);
+    }
+    PAGE_ENTRY_ADDRESS_SET(entry->data, physical_address);
+}
+
 
-        PAGE_ENTRY_PRESENT_SET(entry.data);
-        PAGE_ENTRY_READ_WRITE_SET(entry.data);
-        PAGE_ENTRY_ADDRESS_SET(entry.data, page_directory_pointer);
+/// Map a 2 MiB (level 1) or 1 GiB (level 2) page, with PAGE_MAP_* `flags`
+/// as for map_memory.
+void map_memory_large(PageMap* map, u64 virtual_address, u64 physical_address, usize level, u32 flags)
+{
+    ASSERTF(level == 1 || level == 2, "Large pages only exist at level 1 and 2!");
+    ASSERTF(((virtual_address | physical_address) & (PAGE_LEVEL_SIZE(level) - 1)) == 0, "Large page is misaligned!");
+
+    PageEntry* entry = page_map_walk(map, virtual_address, level);
+    ASSERTF(!PAGE_ENTRY_PRESENT_IS_SET(entry->data), "Large page is already mapped!");
 
-        LOGF("Level 3 address set %x - %x\r", (usize) page_directory_pointer, PAGE_ENTRY_ADDRESS_GET(entry.data));
-        pml4->entries[index.level_3] = entry;
+    PAGE_ENTRY_PRESENT_SET(entry->data);
+    PAGE_ENTRY_LARGER_PAGES_SET(entry->data);
+    if (flags & PAGE_MAP_WRITE)
+        PAGE_ENTRY_READ_WRITE_SET(entry->data);
+    if (!(flags & PAGE_MAP_EXECUTE) && map->nx)
+        PAGE_ENTRY_NO_EXECUTE_SET(entry->data);
+    if (flags & PAGE_MAP_UNCACHED)
+    {
+        PAGE_ENTRY_WRITE_THROUGH_SET(entry->data);
+        PAGE_ENTRY_CACHE_DISABLED_SET(entry->data);
     }
-    else
+    PAGE_ENTRY_ADDRESS_SET(entry->data, physical_address);
+}
+
+
+/// Let the page holding `virtual_address` be executed, whatever its size:
+/// a whole 2 MiB or 1 GiB page if that's what maps it. False if nothing does.
+bool page_map_allow_execute(PageMap* map, u64 virtual_address)
+{
+    usize      level = 0;
+    PageEntry* entry = page_map_lookup(map, virtual_address, &level);
+    if (!entry || !PAGE_ENTRY_PRESENT_IS_SET(entry->data))
+        return false;
+
+    // A TLB entry that still forbids execution would fault regardless.
+    BIT_CLEAR(entry->data, 63);
+    if (page_map_is_live(map))
+        x86_64_invlpg(virtual_address);
+    return true;
+}
+
+
+
+void page_table_identity_map(PageMap* map)
+{
+    for (usize i = 0; i < map->tables->allocator->pages_total; ++i)
     {
-        LOGF("Level 3 address got %x - %x\r", (usize) page_directory_pointer, PAGE_ENTRY_ADDRESS_GET(entry.data));
-        page_directory_pointer = (PageTable*) PAGE_ENTRY_ADDRESS_GET(entry.data);
+        map_memory(map, i * PAGE_SIZE, i * PAGE_SIZE, PAGE_MAP_WRITE);
     }
+}
 
 
-    PageTable* page_directory = 0;
-    entry = page_directory_pointer->entries[index.level_2];
-    if (!entry.data)
+/// Map the physical range [physical_start, physical_end), widened to 2 MiB
+/// boundaries, at `base + physical` using the largest pages available.
+/// Blocks that something else already maps are left as they are.
+void page_table_map_physical(PageMap* map, u64 base, u64 physical_start, u64 physical_end, u32 flags)
+{
+    bool has_1gib_pages = cpu_has(CPU_FEATURE_PAGES_1GIB);
+
+    u64 physical = physical_start & ~(PAGE_LEVEL_SIZE(1) - 1);
+    while (physical < physical_end)
     {
-        page_directory = page_allocator_request_page(allocator);
+        usize      level = 0;
+        PageEntry* entry = page_map_lookup(map, base + physical, &level);
+        if (entry)
+        {
+            // A large page, or a table of 4 KiB pages under the directory.
+            u64 size  = PAGE_LEVEL_SIZE(level > 0 ? level : 1);
+            physical += size - physical % size;
+        }
+        else if (has_1gib_pages && level >= 2 && physical % PAGE_LEVEL_SIZE(2) == 0 && physical_end - physical >= PAGE_LEVEL_SIZE(2))
+        {
+            map_memory_large(map, base + physical, physical, 2, flags);
+            physical += PAGE_LEVEL_SIZE(2);
+        }
+        else
+        {
+            map_memory_large(map, base + physical, physical, 1, flags);
+            physical += PAGE_LEVEL_SIZE(1);
+        }
+    }
+}
 
-        PAGE_ENTRY_PRESENT_SET(entry.data);
-        PAGE_ENTRY_READ_WRITE_SET(entry.data);
-        PAGE_ENTRY_ADDRESS_SET(entry.data, page_directory);
 
-        LOGF("Level 2 address set %x - %x\r", (usize) page_directory, PAGE_ENTRY_ADDRESS_GET(entry.data));
-        page_directory_pointer->entries[index.level_2] = entry;
+/// Map RAM below `ram_end` at `base + physical` with PAGE_MAP_* `flags`, and
+/// every MMIO region as uncached and non-executable. MMIO is mapped first,
+/// so the 2 MiB blocks it shares with RAM (or sits in, below `ram_end`)
+/// stay uncached. Holes between RAM regions are mapped along with them.
+void page_table_map_memory(PageMap* map, u64 base, const MemoryRegions* regions, u64 ram_end, u32 flags)
+{
+    for (usize i = 0; i < regions->count; ++i)
+    {
+        const MemoryRegion* region = &regions->regions[i];
+        if (region->type == MEMORY_REGION_MMIO)
+            page_table_map_physical(map, base, region->start, region->end, PAGE_MAP_WRITE | PAGE_MAP_UNCACHED);
     }
-    else
+    page_table_map_physical(map, base, 0, ram_end, flags);
+}
+
+
+/// Map RAM below `ram_end` and the MMIO in `regions` at DIRECT_MAP_BASE(levels),
+/// writable but never executable. Returns the base.
+u64 page_table_direct_map(PageMap* map, const MemoryRegions* regions, u64 ram_end)
+{
+    u64 base = DIRECT_MAP_BASE(map->levels);
+    u64 end  = ram_end;
+    for (usize i = 0; i < regions->count; ++i)
+        if (regions->regions[i].type == MEMORY_REGION_MMIO && regions->regions[i].end > end)
+            end = regions->regions[i].end;
+    ASSERTF(end <= DIRECT_MAP_SIZE(map->levels), "Physical memory doesn't fit in the direct map!");
+
+    page_table_map_memory(map, base, regions, ram_end, PAGE_MAP_WRITE);
+    return base;
+}
+
+
+
+/* ---- LARGE PAGE PROMOTION ---- */
+// Accessed and dirty are only bookkeeping, so entries that differ in them
+// can still be merged. The large page gets the union of them.
+#define PAGE_PROMOTE_IGNORED_BITS PAGE_ENTRY_ACCESSED_DIRTY_BITS
+
+
+/// Collapse the page table under the directory entry `entry` into a single
+/// 2 MiB page, if its 512 entries map physically contiguous frames (starting
+/// on a 2 MiB boundary) with identical attributes.
+static bool page_map_promote_table(PageMap* map, PageEntry* entry, bool live)
+{
+    PageTable* table = (PageTable*) PAGE_ENTRY_ADDRESS_GET(entry->data);
+
+    u64 first      = table->entries[0].data;
+    u64 physical   = PAGE_ENTRY_ADDRESS_GET(first);
+    u64 attributes = first & ~PAGE_ENTRY_ADDRESS_MASK & ~PAGE_PROMOTE_IGNORED_BITS;
+    u64 bookkeeping = 0;
+
+    if (!PAGE_ENTRY_PRESENT_IS_SET(first) || physical % PAGE_LEVEL_SIZE(1) != 0)
+        return false;
+
+    for (usize i = 0; i < 512; ++i)
     {
-        LOGF("Level 2 address got %x - %x\r", (usize) page_directory, PAGE_ENTRY_ADDRESS_GET(entry.data));
-        page_directory = (PageTable*) PAGE_ENTRY_ADDRESS_GET(entry.data);
+        u64 data = table->entries[i].data;
+        if (PAGE_ENTRY_ADDRESS_GET(data) != physical + i * PAGE_SIZE)
+            return false;
+        if ((data & ~PAGE_ENTRY_ADDRESS_MASK & ~PAGE_PROMOTE_IGNORED_BITS) != attributes)
+            return false;
+        bookkeeping |= data & PAGE_PROMOTE_IGNORED_BITS;
     }
 
+    u64 large = (attributes & ~(1ULL << PAGE_ENTRY_PAT_BIT)) | bookkeeping | physical;
+    if (BIT_CHECK(attributes, PAGE_ENTRY_PAT_BIT))
+        BIT_SET(large, PAGE_ENTRY_LARGE_PAT_BIT);
+    PAGE_ENTRY_LARGER_PAGES_SET(large);
+
+    // Access rights are the intersection of every level of the walk, so the
+    // directory entry's restrictions carry over to the large page.
+    if (!PAGE_ENTRY_READ_WRITE_IS_SET(entry->data))
+        BIT_CLEAR(large, 1);
+    if (!PAGE_ENTRY_SUPER_USER_IS_SET(entry->data))
+        BIT_CLEAR(large, 2);
+    large |= entry->data & (1ULL << 63);
+
+    entry->data = large;
 
-    PageTable* page_table = 0;
-    entry = page_directory->entries[index.level_1];
-    if (!entry.data)
+    // The TLB may still hold any of the 512 small translations, and the
+    // paging-structure caches the old table, which can't be reused until
+    // they've forgotten about it. An invlpg only drops one page, so reload
+    // CR3 (nothing is mapped global) to drop them all.
+    if (live)
+        x86_64_cr3_set(x86_64_cr3_get());
+    page_table_pool_release(map->tables, table);
+    return true;
+}
+
+
+static usize page_map_promote_level(PageMap* map, PageTable* table, usize level, bool live)
+{
+    usize promoted = 0;
+    for (usize i = 0; i < 512; ++i)
     {
-        page_table = page_allocator_request_page(allocator);
+        PageEntry* entry = &table->entries[i];
+        if (!PAGE_ENTRY_PRESENT_IS_SET(entry->data) || PAGE_ENTRY_LARGER_PAGES_IS_SET(entry->data))
+            continue;
+
+        if (level == 1)
+            promoted += page_map_promote_table(map, entry, live) ? 1 : 0;
+        else
+            promoted += page_map_promote_level(map, (PageTable*) PAGE_ENTRY_ADDRESS_GET(entry->data), level - 1, live);
+    }
+    return promoted;
+}
 
-        PAGE_ENTRY_PRESENT_SET(entry.data);
-        PAGE_ENTRY_READ_WRITE_SET(entry.data);
-        PAGE_ENTRY_ADDRESS_SET(entry.data, page_table);
 
-        LOGF("Level 1 address set %x - %x\r", (usize) page_table, PAGE_ENTRY_ADDRESS_GET(entry.data));
-        page_directory->entries[index.level_1] = entry;
+/// Replace every page table that maps a whole, contiguous 2 MiB region with
+/// one large page in its directory, and give the table back to the pool.
+/// Returns the number of 2 MiB pages promoted.
+usize page_map_promote(PageMap* map)
+{
+    bool live = page_map_is_live(map);
+    return page_map_promote_level(map, map->root, map->levels - 1, live);
+}
+
+
+
+/* ---- DEMAND PAGING ---- */
+static DemandPager* g_demand_pager = NULL;
+
+
+/// Make `pager` the one consulted by the page fault handler.
+void demand_pager_install(DemandPager* pager)
+{
+    g_demand_pager = pager;
+}
+
+
+/// Reserve `size` bytes of virtual memory at `start` without backing them.
+LazyRegion* demand_pager_reserve(DemandPager* pager, LazyRegionKind kind, u64 start, usize size)
+{
+    ASSERTF(pager->region_count < DEMAND_PAGER_MAX_REGIONS, "Too many lazy regions!");
+    ASSERTF(start % PAGE_SIZE == 0, "Lazy region must be page aligned!");
+
+    u64 end = start + ((size + PAGE_SIZE - 1) & ~((u64) PAGE_SIZE - 1));
+    for (usize i = 0; i < pager->region_count; ++i)
+    {
+        const LazyRegion* other = &pager->regions[i];
+        ASSERTF(end <= other->start || other->end <= start, "Lazy regions overlap!");
     }
-    else
+
+    LazyRegion* region = &pager->regions[pager->region_count++];
+    *region = (LazyRegion) { .start=start, .end=end, .kind=kind, .faults=0 };
+    return region;
+}
+
+
+/// Back the page containing `address` with a zeroed frame if it belongs to a
+/// lazy region. Returns false if the fault is not ours to handle.
+bool demand_pager_handle_fault(u64 address, usize error_code)
+{
+    DemandPager* pager = g_demand_pager;
+    if (!pager)
+        return false;
+
+    // A protection violation on a page that is already present is a real
+    // bug, not a first touch.
+    if (PAGE_FAULT_PRESENT_IS_SET(error_code) || PAGE_FAULT_RESERVED_IS_SET(error_code))
+        return false;
+
+    for (usize i = 0; i < pager->region_count; ++i)
     {
-        LOGF("Level 1 address got %x - %x\r", (usize) page_table, PAGE_ENTRY_ADDRESS_GET(entry.data));
-        page_table = (PageTable*) PAGE_ENTRY_ADDRESS_GET(entry.data);
+        LazyRegion* region = &pager->regions[i];
+        if (address < region->start || address >= region->end)
+            continue;
+
+        // The faulting access touches the frame as soon as this returns, so
+        // it's cleared through the cache (in general registers, as this is
+        // the fault handler) rather than around it.
+        // A non-present page is never cached in the TLB, so no flush is needed.
+        void* frame = page_allocator_take_page(pager->allocator);
+        memset_general(frame, 0, PAGE_SIZE);
+        map_memory(pager->map, address & ~((u64) PAGE_SIZE - 1), (u64) frame, PAGE_MAP_WRITE);
+        region->faults += 1;
+
+        if (++pager->faults_since_tick == DEMAND_PAGER_TICK_FAULTS)
+            demand_pager_tick(pager);
+        return true;
     }
 
-    entry = page_table->entries[index.level_0];
-    PAGE_ENTRY_PRESENT_SET(entry.data);
-    PAGE_ENTRY_READ_WRITE_SET(entry.data);
-    PAGE_ENTRY_ADDRESS_SET(entry.data, physical_address);
-    page_table->entries[index.level_0] = entry;
-    LOGF("Level 0 address got %x\r", PAGE_ENTRY_ADDRESS_GET(entry.data));
+    return false;
 }
 
 
+/* ---- WORKING SET ---- */
+/// The CPU only sets the accessed and dirty bits when it walks the tables,
+/// so a translation still cached in the TLB would keep hiding new accesses
+/// after the bits are cleared. Reloading CR3 drops all of them at once.
+static void demand_pager_scan_flush(bool live)
+{
+    if (live)
+        x86_64_cr3_set(x86_64_cr3_get());
+}
 
-void page_table_identity_map(PageTable* pml4, PageAllocator* allocator)
+
+/// Harvest and clear the accessed and dirty bits of every mapped page in the
+/// lazy regions, and age the regions that saw no access. Bits are cleared in
+/// batches of WORKING_SET_BATCH_PAGES entries with one TLB flush per batch,
+/// rather than an invlpg per page.
+///
+/// A page written between having its bits cleared and the end of its batch
+/// may not be reported as dirty by the next scan, as the CPU won't set the
+/// bit again through a cached translation. It was already counted by this one.
+void demand_pager_scan(DemandPager* pager)
 {
-    for (usize i = 0; i < allocator->pages_total; ++i)
+    PageMap* map  = pager->map;
+    bool     live = page_map_is_live(map);
+    usize    batch = 0;
+
+    for (usize i = 0; i < pager->region_count; ++i)
     {
-        map_memory(pml4, allocator, i * PAGE_SIZE, i * PAGE_SIZE);
+        LazyRegion* region = &pager->regions[i];
+        region->accessed = 0;
+        region->dirty    = 0;
+
+        u64 address = region->start;
+        while (address < region->end)
+        {
+            usize      level = 0;
+            PageEntry* entry = page_map_lookup(map, address, &level);
+            u64        size  = PAGE_LEVEL_SIZE(level);
+
+            if (entry && (entry->data & PAGE_ENTRY_ACCESSED_DIRTY_BITS) && PAGE_ENTRY_PRESENT_IS_SET(entry->data))
+            {
+                usize pages = size / PAGE_SIZE;
+                if (PAGE_ENTRY_ACCESSED_IS_SET(entry->data))
+                    region->accessed += pages;
+                if (PAGE_ENTRY_DIRTY_IS_SET(entry->data))
+                    region->dirty += pages;
+
+                entry->data &= ~PAGE_ENTRY_ACCESSED_DIRTY_BITS;
+                if (++batch == WORKING_SET_BATCH_PAGES)
+                {
+                    demand_pager_scan_flush(live);
+                    batch = 0;
+                }
+            }
+
+            u64 next = (address & ~(size - 1)) + size;
+            if (next <= address)
+                break;
+            address = next;
+        }
+
+        if (region->accessed)
+            region->age = 0;
+        else if (region->age < 0xFF)
+            region->age += 1;
     }
-}
\ No newline at end of file
+
+    if (batch)
+        demand_pager_scan_flush(live);
+}
+
+
+/// The periodic work of the pager: sample the working set, and promote the
+/// page tables that have filled up since the last tick to 2 MiB pages. Runs
+/// every DEMAND_PAGER_TICK_FAULTS faults from the fault handler, so like it,
+/// it must not log.
+void demand_pager_tick(DemandPager* pager)
+{
+    pager->faults_since_tick = 0;
+    pager->ticks += 1;
+    demand_pager_scan(pager);
+    pager->promoted += page_map_promote(pager->map);
+}
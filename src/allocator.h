@@ -0,0 +1,181 @@
+#pragma once
+
+#include "types.h"
+#include "bit.h"
+#include "page_allocator.h"
+#include "memory_regions.h"
+
+#define PAGE_ENTRY_ADDRESS_MASK                     0x000FFFFFFFFFF000ULL
+
+#define PAGE_ENTRY_PRESENT_SET(data)                BIT_SET(data, 0)
+#define PAGE_ENTRY_READ_WRITE_SET(data)             BIT_SET(data, 1)
+#define PAGE_ENTRY_SUPER_USER_SET(data)             BIT_SET(data, 2)
+#define PAGE_ENTRY_WRITE_THROUGH_SET(data)          BIT_SET(data, 3)
+#define PAGE_ENTRY_CACHE_DISABLED_SET(data)         BIT_SET(data, 4)
+#define PAGE_ENTRY_ACCESSED_SET(data)               BIT_SET(data, 5)
+#define PAGE_ENTRY_DIRTY_SET(data)                  BIT_SET(data, 6)
+#define PAGE_ENTRY_LARGER_PAGES_SET(data)           BIT_SET(data, 7)
+#define PAGE_ENTRY_NO_EXECUTE_SET(data)             BIT_SET(data, 63)
+#define PAGE_ENTRY_AVAILABLE_SET(data, value)       ((data) |= ((((value) & 0b111) << 9)))
+#define PAGE_ENTRY_ADDRESS_SET(data, address)       ((data) |= (((u64) (address)) & PAGE_ENTRY_ADDRESS_MASK))
+
+#define PAGE_ENTRY_PRESENT_IS_SET(data)             BIT_CHECK(data, 0)
+#define PAGE_ENTRY_READ_WRITE_IS_SET(data)          BIT_CHECK(data, 1)
+#define PAGE_ENTRY_SUPER_USER_IS_SET(data)          BIT_CHECK(data, 2)
+#define PAGE_ENTRY_WRITE_THROUGH_IS_SET(data)       BIT_CHECK(data, 3)
+#define PAGE_ENTRY_CACHE_DISABLED_IS_SET(data)      BIT_CHECK(data, 4)
+#define PAGE_ENTRY_ACCESSED_IS_SET(data)            BIT_CHECK(data, 5)
+#define PAGE_ENTRY_DIRTY_IS_SET(data)               BIT_CHECK(data, 6)
+#define PAGE_ENTRY_LARGER_PAGES_IS_SET(data)        BIT_CHECK(data, 7)
+#define PAGE_ENTRY_NO_EXECUTE_IS_SET(data)          BIT_CHECK(data, 63)
+#define PAGE_ENTRY_ADDRESS_GET(data)                (((u64) (data)) & PAGE_ENTRY_ADDRESS_MASK)
+
+// Set by the CPU on the first access and the first write through an entry.
+#define PAGE_ENTRY_ACCESSED_DIRTY_BITS              ((1ULL << 5) | (1ULL << 6))
+
+// The PAT memory-type bit is bit 7 in a 4 KiB entry, but bit 12 in a large
+// page, where bit 7 is the page size bit.
+#define PAGE_ENTRY_PAT_BIT                          7
+#define PAGE_ENTRY_LARGE_PAT_BIT                    12
+
+// Bits of the error code pushed by the CPU on a page fault (#PF).
+#define PAGE_FAULT_PRESENT_IS_SET(error)            BIT_CHECK(error, 0)  // 0 = non-present page, 1 = protection violation.
+#define PAGE_FAULT_WRITE_IS_SET(error)              BIT_CHECK(error, 1)  // 0 = read, 1 = write.
+#define PAGE_FAULT_USER_IS_SET(error)               BIT_CHECK(error, 2)  // 0 = supervisor, 1 = user.
+#define PAGE_FAULT_RESERVED_IS_SET(error)           BIT_CHECK(error, 3)  // Reserved bit set in a paging entry.
+#define PAGE_FAULT_INSTRUCTION_IS_SET(error)        BIT_CHECK(error, 4)  // Caused by an instruction fetch.
+
+
+#define PAGE_LEVELS_MAX 5
+
+// Bytes covered by one entry at `level` (0 = 4 KiB, 1 = 2 MiB, 2 = 1 GiB, ...).
+#define PAGE_LEVEL_SIZE(level)  (((u64) PAGE_SIZE) << (9 * (level)))
+
+// The direct map of all physical memory starts where Linux puts it: 64 TiB
+// of room with 4-level paging, 32 PiB with 5-level paging.
+#define DIRECT_MAP_BASE(levels) ((levels) == 5 ? 0xFF11000000000000ULL : 0xFFFF888000000000ULL)
+#define DIRECT_MAP_SIZE(levels) ((levels) == 5 ? (1ULL << 55) : (1ULL << 46))
+
+typedef struct
+{
+    u16 level[PAGE_LEVELS_MAX];  // Index into the table at each level, 0 being the page table.
+} PageIndex;
+
+typedef struct
+{
+    u64 data;
+} PageEntry;
+
+typedef struct PageTable
+{
+    PageEntry entries[512];
+} __attribute__((aligned(PAGE_SIZE))) PageTable;
+
+
+// ---- PAGE TABLE POOL ----
+// Page tables are carved out of chunks of physically contiguous frames that
+// are zeroed in one go. Tables created together (as in one walk) end up next
+// to each other, which is kinder to the paging-structure caches than frames
+// scattered over all of memory.
+#define PAGE_TABLE_POOL_CHUNK_PAGES 16
+
+typedef struct PageTablePool
+{
+    PageAllocator* allocator;
+    PageTable*     next;          // Next untouched table in the current chunk.
+    PageTable*     end;           // One past the last table in the current chunk.
+    PageTable*     free_list;     // Released tables, linked through their first entry.
+    usize          pages_reserved;
+    usize          tables_used;
+} PageTablePool;
+
+PageTablePool page_table_pool_new(PageAllocator* allocator);
+PageTable*    page_table_pool_request(PageTablePool* pool);
+void          page_table_pool_release(PageTablePool* pool, PageTable* table);
+
+
+// The walk depth is a runtime property: 4 levels normally, 5 when the
+// firmware handed over with CR4.LA57 set.
+typedef struct PageMap
+{
+    PageTable*     root;    // PML4, or PML5 with 5-level paging.
+    PageTablePool* tables;
+    u8             levels;
+    bool           nx;      // EFER.NXE is on, so pages can be made non-executable.
+} PageMap;
+
+// What a mapping allows on top of reading, and how it's cached.
+#define PAGE_MAP_WRITE    (1 << 0)
+#define PAGE_MAP_EXECUTE  (1 << 1)
+#define PAGE_MAP_UNCACHED (1 << 2)  // For MMIO: PCD and PWT, which select UC with the default PAT.
+
+bool paging_la57_supported();
+u8   paging_levels_active();
+bool paging_nx_enable();
+
+PageMap   page_map_new(PageTablePool* pool, u8 levels);
+PageIndex map_virtual_address(u64 virtual_address);
+void map_memory(PageMap* map, u64 virtual_address, u64 physical_address, u32 flags);
+void map_memory_large(PageMap* map, u64 virtual_address, u64 physical_address, usize level, u32 flags);
+bool page_map_allow_execute(PageMap* map, u64 virtual_address);
+void page_table_identity_map(PageMap* map);
+void page_table_map_physical(PageMap* map, u64 base, u64 physical_start, u64 physical_end, u32 flags);
+void page_table_map_memory(PageMap* map, u64 base, const MemoryRegions* regions, u64 ram_end, u32 flags);
+u64  page_table_direct_map(PageMap* map, const MemoryRegions* regions, u64 ram_end);
+usize page_map_promote(PageMap* map);
+
+
+// ---- DEMAND PAGING ----
+// A lazy region is a range of virtual memory that is reserved but not backed
+// by any frames. The first touch of each page traps into the page fault
+// handler, which allocates a zeroed frame and maps it in.
+typedef enum LazyRegionKind
+{
+    LAZY_REGION_HEAP,
+    LAZY_REGION_BSS,
+} LazyRegionKind;
+
+typedef struct LazyRegion
+{
+    u64            start;   // Inclusive, page aligned.
+    u64            end;     // Exclusive, page aligned.
+    LazyRegionKind kind;
+    usize          faults;  // Number of pages faulted in so far.
+
+    // Working set, as of the last demand_pager_scan.
+    usize          accessed;  // Pages accessed since the scan before.
+    usize          dirty;     // Pages written since the scan before.
+    u8             age;       // Scans in a row without any access, saturating.
+} LazyRegion;
+
+// A region that hasn't been touched for this many scans is cold, and a
+// candidate for reclaim. Anything younger is hot.
+#define LAZY_REGION_COLD_AGE 4
+#define LAZY_REGION_IS_COLD(region) ((region)->age >= LAZY_REGION_COLD_AGE)
+
+// Entries whose accessed/dirty bits are cleared before the TLB is flushed.
+#define WORKING_SET_BATCH_PAGES 512
+
+#define DEMAND_PAGER_MAX_REGIONS 16
+
+// Faults between two runs of demand_pager_tick. There's no timer yet, so the
+// pager's own faults are its clock.
+#define DEMAND_PAGER_TICK_FAULTS 64
+
+typedef struct DemandPager
+{
+    PageMap*       map;
+    PageAllocator* allocator;  // Frames backing the faulted-in pages.
+    LazyRegion     regions[DEMAND_PAGER_MAX_REGIONS];
+    usize          region_count;
+
+    usize          faults_since_tick;
+    usize          ticks;
+    usize          promoted;  // 2 MiB pages promoted by every tick so far.
+} DemandPager;
+
+void        demand_pager_install(DemandPager* pager);
+LazyRegion* demand_pager_reserve(DemandPager* pager, LazyRegionKind kind, u64 start, usize size);
+bool        demand_pager_handle_fault(u64 address, usize error_code);
+void        demand_pager_scan(DemandPager* pager);
+void        demand_pager_tick(DemandPager* pager);
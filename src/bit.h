@@ -1,9 +1,12 @@
 #pragma once
 
+// preamble.h has its own (uncast) versions of these.
+#ifndef BIT_SET
 #define BIT_SET(x, bit)    ((x) |= (typeof(x))  (1ULL << (bit)))
 #define BIT_CLEAR(x, bit)  ((x) &= (typeof(x)) ~(1ULL << (bit)))
 #define BIT_FLIP(x, bit)   ((x) ^= (typeof(x))  (1ULL << (bit)))
 #define BIT_CHECK(x, bit)  (!!((x) & (1ULL << (bit))))
+#endif
 
 #define BITMASK_SET(x, mask)        ((x) |=   (mask))
 #define BITMASK_CLEAR(x, mask)      ((x) &= (~(mask)))
@@ -0,0 +1,78 @@
+#include "boot_archive.h"
+
+
+/// Like strcmp, but over at most BOOT_ARCHIVE_NAME_SIZE bytes, as name
+/// fields may fill all of theirs.
+static int boot_archive_compare(const char* a, const char* b)
+{
+    for (usize i = 0; i < BOOT_ARCHIVE_NAME_SIZE; ++i)
+    {
+        if (a[i] != b[i])
+            return (u8) a[i] < (u8) b[i] ? -1 : 1;
+        if (a[i] == 0)
+            return 0;
+    }
+    return 0;
+}
+
+
+/// Check the header and index of the archive in `data`, and fill in
+/// `archive` if they hold up. Payloads aren't looked at.
+bool boot_archive_open(BootArchive* archive, const void* data, u64 size)
+{
+    const BootArchiveHeader* header = (const BootArchiveHeader *) data;
+    if (size < sizeof(BootArchiveHeader) || header->magic != BOOT_ARCHIVE_MAGIC || header->version != BOOT_ARCHIVE_VERSION)
+        return 0;
+    if (header->size > size || sizeof(BootArchiveHeader) + header->entry_count * sizeof(BootArchiveEntry) > header->size)
+        return 0;
+
+    const BootArchiveEntry* entries = (const BootArchiveEntry *) (header + 1);
+    for (u16 i = 0; i < header->entry_count; ++i)
+    {
+        const BootArchiveEntry* entry = &entries[i];
+        if (entry->offset % BOOT_ARCHIVE_ALIGNMENT != 0 || entry->offset > header->size || entry->size > header->size - entry->offset)
+            return 0;
+        if (i > 0 && boot_archive_compare(entries[i - 1].name, entry->name) >= 0)
+            return 0;
+    }
+
+    *archive = (BootArchive) {
+        .base=(const u8 *) data,
+        .size=header->size,
+        .entries=entries,
+        .count=header->entry_count,
+    };
+    return 1;
+}
+
+
+/// Binary search of the index. NULL if there's no file called `name`.
+const BootArchiveEntry* boot_archive_find(const BootArchive* archive, const char* name)
+{
+    usize length = 0;
+    while (name[length] && length <= BOOT_ARCHIVE_NAME_SIZE)
+        ++length;
+    if (length > BOOT_ARCHIVE_NAME_SIZE)
+        return NULL;
+
+    u16 low  = 0;
+    u16 high = archive->count;
+    while (low < high)
+    {
+        u16 middle = (u16) (low + (high - low) / 2);
+        int order  = boot_archive_compare(archive->entries[middle].name, name);
+        if (order == 0)
+            return &archive->entries[middle];
+        if (order < 0)
+            low  = (u16) (middle + 1);
+        else
+            high = middle;
+    }
+    return NULL;
+}
+
+
+const void* boot_archive_data(const BootArchive* archive, const BootArchiveEntry* entry)
+{
+    return archive->base + entry->offset;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "types.h"
+
+// ---- BOOT ARCHIVE ----
+// Every boot asset packed into one file by bin/mkarchive.c, so the
+// bootloader makes a single large read instead of an Open, SetPosition and
+// Read per file through the firmware's FAT driver. The file is laid out as
+//
+//   BootArchiveHeader
+//   BootArchiveEntry[entry_count]   Sorted by name, for binary search.
+//   Payloads                        Each at a BOOT_ARCHIVE_ALIGNMENT aligned offset.
+//
+// The bootloader keeps the whole archive in memory and hands it to the
+// kernel in Context, which reads each file in place.
+#define BOOT_ARCHIVE_MAGIC     0x43524142  // "BARC"
+#define BOOT_ARCHIVE_VERSION   1
+#define BOOT_ARCHIVE_ALIGNMENT 4096
+#define BOOT_ARCHIVE_NAME_SIZE 48
+#define BOOT_ARCHIVE_FILE_NAME "boot.arc"
+
+typedef struct BootArchiveHeader
+{
+    u32 magic;
+    u16 version;
+    u16 entry_count;
+    u64 size;          // Of the whole archive.
+} __attribute__((packed)) BootArchiveHeader;
+
+typedef struct BootArchiveEntry
+{
+    char name[BOOT_ARCHIVE_NAME_SIZE];  // Null padded; not terminated if it fills the field.
+    u64  offset;                        // From the start of the archive.
+    u64  size;
+} __attribute__((packed)) BootArchiveEntry;
+
+
+// An archive that's been checked by boot_archive_open. Zeroed if there's none.
+typedef struct BootArchive
+{
+    const u8*               base;
+    u64                     size;
+    const BootArchiveEntry* entries;
+    u16                     count;
+} BootArchive;
+
+bool                    boot_archive_open(BootArchive* archive, const void* data, u64 size);
+const BootArchiveEntry* boot_archive_find(const BootArchive* archive, const char* name);
+const void*             boot_archive_data(const BootArchive* archive, const BootArchiveEntry* entry);
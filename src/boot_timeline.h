@@ -0,0 +1,49 @@
+#pragma once
+
+#include "types.h"
+#include "x86_64/x86_64.h"
+
+// ---- BOOT TIMELINE ----
+// Where boot time goes: the bootloader and then the kernel mark the end of
+// each phase with the time stamp counter, in a fixed array carried through
+// Context. The kernel prints it once it's up, on the screen and the serial
+// port, one phase per line:
+//
+//   boot-timeline tsc-hz <frequency>
+//   boot-phase <index> <name> <cycles> <microseconds>
+//
+// Names have no spaces, so the lines can be split on whitespace and diffed
+// across builds by a host script. The first phase, "firmware", is
+// everything from reset until EfiMain.
+#define BOOT_TIMELINE_PHASES_MAX 32
+#define BOOT_TIMELINE_NAME_SIZE  24
+
+typedef struct BootPhase
+{
+    char name[BOOT_TIMELINE_NAME_SIZE];  // Null terminated.
+    u64  end;                            // TSC at the end of the phase.
+} BootPhase;
+
+typedef struct BootTimeline
+{
+    u64       tsc_hz;   // 0 if it couldn't be measured.
+    u32       count;
+    BootPhase phases[BOOT_TIMELINE_PHASES_MAX];
+} BootTimeline;
+
+
+/// End the current phase, which is called `name`. Phases past the end of
+/// the array are dropped.
+static inline void boot_timeline_mark(BootTimeline* timeline, const char* name)
+{
+    u64 now = x86_64_rdtsc();
+    if (timeline->count >= BOOT_TIMELINE_PHASES_MAX)
+        return;
+
+    BootPhase* phase = &timeline->phases[timeline->count++];
+    usize i = 0;
+    for (; name[i] && i + 1 < BOOT_TIMELINE_NAME_SIZE; ++i)
+        phase->name[i] = name[i];
+    phase->name[i] = 0;
+    phase->end = now;
+}
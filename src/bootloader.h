@@ -4,6 +4,16 @@
 #include "bootloader/efi.h"  // TODO(ted): Remove.
 
 #include "page_allocator.h"
+#include "allocator.h"
+#include "symbols.h"
+#include "boot_archive.h"
+#include "memory_regions.h"
+#include "boot_timeline.h"
+
+
+// The kernel is linked at -2 GiB (see kernel.ld), so that -mcmodel=kernel
+// can address all of it with sign-extended 32-bit immediates.
+#define KERNEL_VIRTUAL_BASE 0xFFFFFFFF80000000ULL
 
 
 typedef struct Pixel {
@@ -47,4 +57,14 @@ typedef struct Context
     Graphics  graphics;
     PSF1_Font font;
     PageAllocator allocator;
+    PageTablePool page_tables;
+    PageMap       page_map;
+    u64           direct_map_base;  // Virtual address of physical address 0.
+    DemandPager   pager;
+    SymbolTable   symbols;          // The kernel's functions, for symbolized panics.
+    BootArchive   archive;          // Zeroed if the bootloader didn't find one.
+    u64           physical_end;     // One past the last frame of RAM (see memory_regions_ram_end).
+    MemoryRegions regions;          // The final memory map, sorted and merged.
+    BootTimeline  timeline;         // Marked by the bootloader, then by the kernel.
+    u32           generation;       // 0 when started by the bootloader, then one more per kexec.
 } Context;
@@ -0,0 +1,41 @@
+// Reading a range a chunk at a time with the next chunk already in flight,
+// checksumming each one as it arrives, while it's still in cache.
+//
+// The reads go through callbacks, so that bin/chunked_read.c can run the
+// same sequence on the host against a simulated file.
+#include "../types.h"
+#include "../crc32c.h"
+
+
+typedef struct ChunkedRead
+{
+    void* context;
+    void  (*begin)(void* context, u64 offset, u8* destination, u64 size);  // At most one begun and not ended.
+    void  (*end)(void* context, u64 size);                                 // Waits for the read begun last.
+} ChunkedRead;
+
+
+/// Read `size` bytes at `offset` into `destination`, `chunk_size` at a time,
+/// and return `crc` continued over them.
+u32 chunked_read(const ChunkedRead* read, u64 offset, u8* destination, u64 size, u64 chunk_size, u32 crc)
+{
+    u64 position = 0;
+    u64 length   = size < chunk_size ? size : chunk_size;
+    if (length > 0)
+        read->begin(read->context, offset, destination, length);
+
+    while (length > 0)
+    {
+        read->end(read->context, length);
+
+        u64 next        = position + length;
+        u64 next_length = size - next < chunk_size ? size - next : chunk_size;
+        if (next_length > 0)
+            read->begin(read->context, offset + next, destination + next, next_length);
+
+        crc      = crc32c_update(crc, destination + position, length);
+        position = next;
+        length   = next_length;
+    }
+    return crc;
+}
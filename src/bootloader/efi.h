@@ -67,6 +67,17 @@ typedef UINT64              EFI_STATUS;
 typedef void*               EFI_EVENT;
 typedef UINT64              EFI_PHYSICAL_ADDRESS;
 typedef UINT64              EFI_VIRTUAL_ADDRESS;
+typedef UINT64              EFI_LBA;
+
+// UEFI 2.9 Specs PDF Page 172 - 176
+#define EVT_TIMER                           0x80000000
+#define EVT_RUNTIME                         0x40000000
+#define EVT_NOTIFY_WAIT                     0x00000100
+#define EVT_NOTIFY_SIGNAL                   0x00000200
+
+#define TPL_APPLICATION                     4
+#define TPL_CALLBACK                        8
+#define TPL_NOTIFY                          16
 
 
 extern const CHAR16* EFI_MEMORY_TYPE_STRINGS[];
@@ -90,6 +101,8 @@ extern struct EFI_GUID EFI_LOADED_IMAGE_PROTOCOL_GUID;
 extern struct EFI_GUID EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
 extern struct EFI_GUID EFI_DEVICE_PATH_PROTOCOL_GUID;
 extern struct EFI_GUID EFI_FILE_INFO_ID_GUI;
+extern struct EFI_GUID EFI_BLOCK_IO_PROTOCOL_GUID;
+extern struct EFI_GUID EFI_MP_SERVICES_PROTOCOL_GUID;
 
 // We are forward declaring these structs so that the function typedefs can operate.
 struct EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL;
@@ -459,6 +472,28 @@ typedef EFI_STATUS (*EFI_FILE_GET_POSITION)(struct EFI_FILE_PROTOCOL* This, UINT
 typedef EFI_STATUS (*EFI_FILE_SET_POSITION)(struct EFI_FILE_PROTOCOL* This, UINT64 Position);
 typedef EFI_STATUS (*EFI_FILE_GET_INFO) (struct EFI_FILE_PROTOCOL* This, EFI_GUID* InformationType, UINTN* BufferSize, void* Buffer);
 typedef EFI_STATUS (*EFI_FILE_SET_INFO) (struct EFI_FILE_PROTOCOL* This, EFI_GUID* InformationType, UINTN* BufferSize, void* Buffer);
+typedef EFI_STATUS (*EFI_FILE_FLUSH)(struct EFI_FILE_PROTOCOL* This);
+
+
+// UEFI 2.9 Specs PDF Page 525
+// Describes one asynchronous request. `Event` is signaled when it completes,
+// after `Status` and `BufferSize` have been filled in. A NULL `Event` makes the
+// request blocking.
+typedef struct EFI_FILE_IO_TOKEN
+{
+    EFI_EVENT   Event;
+    EFI_STATUS  Status;
+    UINTN       BufferSize;
+    void*       Buffer;
+} EFI_FILE_IO_TOKEN;
+
+typedef EFI_STATUS (*EFI_FILE_OPEN_EX)(struct EFI_FILE_PROTOCOL* This, struct EFI_FILE_PROTOCOL **NewHandle, CHAR16 *FileName, UINT64 OpenMode, UINT64 Attributes, EFI_FILE_IO_TOKEN *Token);
+typedef EFI_STATUS (*EFI_FILE_READ_EX)(struct EFI_FILE_PROTOCOL* This, EFI_FILE_IO_TOKEN *Token);
+typedef EFI_STATUS (*EFI_FILE_WRITE_EX)(struct EFI_FILE_PROTOCOL* This, EFI_FILE_IO_TOKEN *Token);
+typedef EFI_STATUS (*EFI_FILE_FLUSH_EX)(struct EFI_FILE_PROTOCOL* This, EFI_FILE_IO_TOKEN *Token);
+
+#define EFI_FILE_PROTOCOL_REVISION   0x00010000
+#define EFI_FILE_PROTOCOL_REVISION2  0x00020000
 
 
 // UEFI 2.9 Specs PDF Page 512
@@ -474,6 +509,12 @@ typedef struct EFI_FILE_PROTOCOL
     EFI_FILE_SET_POSITION   SetPosition;
     EFI_FILE_GET_INFO       GetInfo;
     EFI_FILE_SET_INFO       SetInfo;
+    EFI_FILE_FLUSH          Flush;
+    // Only present from EFI_FILE_PROTOCOL_REVISION2.
+    EFI_FILE_OPEN_EX        OpenEx;
+    EFI_FILE_READ_EX        ReadEx;
+    EFI_FILE_WRITE_EX       WriteEx;
+    EFI_FILE_FLUSH_EX       FlushEx;
 } EFI_FILE_PROTOCOL;
 
 
@@ -500,6 +541,79 @@ typedef struct EFI_SIMPLE_FILE_SYSTEM_PROTOCOL
     EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_OPEN_VOLUME  OpenVolume;
 } EFI_SIMPLE_FILE_SYSTEM_PROTOCOL;
 
+// UEFI 2.9 Specs PDF Page 622
+typedef struct EFI_BLOCK_IO_MEDIA
+{
+    UINT32   MediaId;
+    BOOLEAN  RemovableMedia;
+    BOOLEAN  MediaPresent;
+    BOOLEAN  LogicalPartition;  // Block 0 is the start of the partition, not the disk.
+    BOOLEAN  ReadOnly;
+    BOOLEAN  WriteCaching;
+    UINT32   BlockSize;
+    UINT32   IoAlign;           // Buffers must be aligned to this (0 and 1 mean any).
+    EFI_LBA  LastBlock;
+    // From EFI_BLOCK_IO_PROTOCOL_REVISION2.
+    EFI_LBA  LowestAlignedLba;
+    UINT32   LogicalBlocksPerPhysicalBlock;
+    // From EFI_BLOCK_IO_PROTOCOL_REVISION3.
+    UINT32   OptimalTransferLengthGranularity;  // In blocks, 0 if unknown.
+} EFI_BLOCK_IO_MEDIA;
+
+struct EFI_BLOCK_IO_PROTOCOL;
+typedef EFI_STATUS (*EFI_BLOCK_RESET)(struct EFI_BLOCK_IO_PROTOCOL* This, BOOLEAN ExtendedVerification);
+typedef EFI_STATUS (*EFI_BLOCK_READ)(struct EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId, EFI_LBA LBA, UINTN BufferSize, void* Buffer);
+typedef EFI_STATUS (*EFI_BLOCK_WRITE)(struct EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId, EFI_LBA LBA, UINTN BufferSize, void* Buffer);
+typedef EFI_STATUS (*EFI_BLOCK_FLUSH)(struct EFI_BLOCK_IO_PROTOCOL* This);
+
+#define EFI_BLOCK_IO_PROTOCOL_REVISION2  0x00020001
+#define EFI_BLOCK_IO_PROTOCOL_REVISION3  0x0002001F
+
+// UEFI 2.9 Specs PDF Page 621
+typedef struct EFI_BLOCK_IO_PROTOCOL
+{
+    UINT64               Revision;
+    EFI_BLOCK_IO_MEDIA*  Media;
+    EFI_BLOCK_RESET      Reset;
+    EFI_BLOCK_READ       ReadBlocks;
+    EFI_BLOCK_WRITE      WriteBlocks;
+    EFI_BLOCK_FLUSH      FlushBlocks;
+} EFI_BLOCK_IO_PROTOCOL;
+
+// PI 1.7 Specs Volume 2, Section 13.4
+// Procedures run on application processors can't use most boot services,
+// including the console.
+typedef void (*EFI_AP_PROCEDURE)(void* ProcedureArgument);
+
+typedef struct EFI_PROCESSOR_INFORMATION
+{
+    UINT64  ProcessorId;
+    UINT32  StatusFlag;
+    UINT32  Package;
+    UINT32  Core;
+    UINT32  Thread;
+} EFI_PROCESSOR_INFORMATION;
+
+struct EFI_MP_SERVICES_PROTOCOL;
+typedef EFI_STATUS (*EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS)(struct EFI_MP_SERVICES_PROTOCOL* This, UINTN* NumberOfProcessors, UINTN* NumberOfEnabledProcessors);
+typedef EFI_STATUS (*EFI_MP_SERVICES_GET_PROCESSOR_INFO)(struct EFI_MP_SERVICES_PROTOCOL* This, UINTN ProcessorNumber, EFI_PROCESSOR_INFORMATION* ProcessorInfoBuffer);
+typedef EFI_STATUS (*EFI_MP_SERVICES_STARTUP_ALL_APS)(struct EFI_MP_SERVICES_PROTOCOL* This, EFI_AP_PROCEDURE Procedure, BOOLEAN SingleThread, EFI_EVENT WaitEvent, UINTN TimeoutInMicroSeconds, void* ProcedureArgument, UINTN** FailedCpuList);
+typedef EFI_STATUS (*EFI_MP_SERVICES_STARTUP_THIS_AP)(struct EFI_MP_SERVICES_PROTOCOL* This, EFI_AP_PROCEDURE Procedure, UINTN ProcessorNumber, EFI_EVENT WaitEvent, UINTN TimeoutInMicroseconds, void* ProcedureArgument, BOOLEAN* Finished);
+typedef EFI_STATUS (*EFI_MP_SERVICES_SWITCH_BSP)(struct EFI_MP_SERVICES_PROTOCOL* This, UINTN ProcessorNumber, BOOLEAN EnableOldBSP);
+typedef EFI_STATUS (*EFI_MP_SERVICES_ENABLEDISABLEAP)(struct EFI_MP_SERVICES_PROTOCOL* This, UINTN ProcessorNumber, BOOLEAN EnableAP, UINT32* HealthFlag);
+typedef EFI_STATUS (*EFI_MP_SERVICES_WHOAMI)(struct EFI_MP_SERVICES_PROTOCOL* This, UINTN* ProcessorNumber);
+
+typedef struct EFI_MP_SERVICES_PROTOCOL
+{
+    EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS  GetNumberOfProcessors;
+    EFI_MP_SERVICES_GET_PROCESSOR_INFO        GetProcessorInfo;
+    EFI_MP_SERVICES_STARTUP_ALL_APS           StartupAllAPs;
+    EFI_MP_SERVICES_STARTUP_THIS_AP           StartupThisAP;
+    EFI_MP_SERVICES_SWITCH_BSP                SwitchBSP;
+    EFI_MP_SERVICES_ENABLEDISABLEAP           EnableDisableAP;
+    EFI_MP_SERVICES_WHOAMI                    WhoAmI;
+} EFI_MP_SERVICES_PROTOCOL;
+
 // EFI has a system and runtime. This system table is the first struct
 // called from the main section. Think of it as the entry point
 // to all of the EFI functions.
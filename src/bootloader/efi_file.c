@@ -0,0 +1,128 @@
+// Reads through EFI_FILE_PROTOCOL that can overlap with other work.
+//
+// From EFI_FILE_PROTOCOL_REVISION2 a file has ReadEx, which takes a token with
+// an event and returns as soon as the request is queued. Firmware without it,
+// or whose file system driver returns EFI_UNSUPPORTED, gets a plain blocking
+// Read in file_read_begin instead, so callers are written the same either way.
+#include "efi.h"
+#include "efi_lib.h"
+#include "efi_error.h"
+
+extern EFI_BOOT_SERVICES*     g_BootServices;
+
+
+// At most one request in flight. Requests on the same file handle complete in
+// the order they're issued, but the position is set with SetPosition, which
+// isn't queued, so a FileRead waits for its request before starting another.
+typedef struct FileRead
+{
+    EFI_FILE_PROTOCOL* file;
+    EFI_FILE_IO_TOKEN  token;    // token.Event is NULL when reads are blocking.
+    bool               started;  // From file_read_begin until its file_read_end.
+    bool               pending;  // Queued with ReadEx and not yet waited for.
+} FileRead;
+
+
+/// Size of the file in bytes, from its EFI_FILE_INFO.
+u64 file_get_size(EFI_FILE_PROTOCOL* file)
+{
+    /* Will fail with too small buffer, but return the size (the file name
+     * makes EFI_FILE_INFO variable length).
+     */
+    UINTN          InfoSize = 0;
+    EFI_FILE_INFO* Info     = NULL;
+    ASSERT(file->GetInfo(file, &EFI_FILE_INFO_ID_GUI, &InfoSize, NULL) == EFI_BUFFER_TOO_SMALL);
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, InfoSize, (void **) &Info));
+    EFI_ASSERT(file->GetInfo(file, &EFI_FILE_INFO_ID_GUI, &InfoSize, Info));
+    u64 size = Info->FileSize;
+    EFI_ASSERT(g_BootServices->FreePool(Info));
+    return size;
+}
+
+
+FileRead file_read_new(EFI_FILE_PROTOCOL* file)
+{
+    FileRead read = { .file=file };
+
+    if (file->Revision >= EFI_FILE_PROTOCOL_REVISION2)
+    {
+        // Plain wait event, without a notification function, so that it can
+        // be passed to WaitForEvent.
+        if (g_BootServices->CreateEvent(0, TPL_CALLBACK, NULL, NULL, NULL, &read.token.Event) != EFI_SUCCESS)
+            read.token.Event = NULL;
+    }
+
+    return read;
+}
+
+
+bool file_read_is_async(const FileRead* read)
+{
+    return read->token.Event != NULL;
+}
+
+
+/// Start reading `size` bytes at `offset` into `destination`, which must be
+/// left alone until file_read_end.
+void file_read_begin(FileRead* read, u64 offset, void* destination, u64 size)
+{
+    ASSERTF(!read->started, "File read started while another is in flight!");
+    read->started = 1;
+
+    EFI_ASSERT(read->file->SetPosition(read->file, offset));
+    read->token.Status     = EFI_SUCCESS;
+    read->token.BufferSize = size;
+    read->token.Buffer     = destination;
+
+    if (read->token.Event != NULL)
+    {
+        EFI_STATUS Status = read->file->ReadEx(read->file, &read->token);
+        if (Status == EFI_SUCCESS)
+        {
+            read->pending = 1;
+            return;
+        }
+
+        ASSERTF(Status == EFI_UNSUPPORTED, "Couldn't queue file read (%x)!", Status);
+        EFI_ASSERT(g_BootServices->CloseEvent(read->token.Event));
+        read->token.Event = NULL;
+    }
+
+    UINTN Size = size;
+    read->token.Status     = read->file->Read(read->file, &Size, destination);
+    read->token.BufferSize = Size;
+}
+
+
+/// Wait for the read started by file_read_begin, and return how many bytes
+/// it read.
+u64 file_read_end(FileRead* read)
+{
+    if (read->pending)
+    {
+        UINTN Index = 0;
+        EFI_ASSERT(g_BootServices->WaitForEvent(1, &read->token.Event, &Index));
+        read->pending = 0;
+    }
+
+    ASSERTF(read->started, "File read ended without one in flight!");
+    read->started = 0;
+
+    EFI_ASSERT(read->token.Status);
+    u64 size = read->token.BufferSize;
+    read->token.BufferSize = 0;
+    return size;
+}
+
+
+/// Wait for anything in flight, then close the event and the file.
+void file_read_close(FileRead* read)
+{
+    if (read->pending)
+        file_read_end(read);
+    if (read->token.Event != NULL)
+        EFI_ASSERT(g_BootServices->CloseEvent(read->token.Event));
+
+    EFI_ASSERT(read->file->Close(read->file));
+    *read = (FileRead) { 0 };
+}
@@ -4,10 +4,50 @@
 
 #include "../bootloader.h"
 #include "../allocator.c"
+#include "../symbols.c"
+#include "../boot_archive.c"
+#include "../memory_regions.c"
+#include "../x86_64/serial.c"
 #include "../x86_64/idt.c"
+#include "../x86_64/cpu.c"
 
 #include "elf.h"
 #include "memory.c"
+#include "efi_file.c"
+#include "efi_mp.c"
+#include "chunked_read.c"
+#include "fat32.c"
+#include "../lz4.c"
+#include "../crc32c.c"
+#include "../kernel_pack.h"
+
+// Read the kernel file with raw block I/O when the boot volume is FAT32 (see
+// fat32.c), falling back to EFI_FILE_PROTOCOL otherwise. With the comparison
+// on, it's also read through EFI_FILE_PROTOCOL, checked to be the same and
+// both are timed.
+#ifndef KERNEL_BLOCK_IO
+#define KERNEL_BLOCK_IO 1
+#endif
+#ifndef KERNEL_BLOCK_IO_COMPARE
+#define KERNEL_BLOCK_IO_COMPARE 0
+#endif
+
+// Decompress packed kernel segments on every processor (see efi_mp.c). With
+// the comparison on, each segment is also decompressed on the boot processor
+// alone, and both are timed.
+#ifndef PARALLEL_BOOT
+#define PARALLEL_BOOT 1
+#endif
+#ifndef PARALLEL_BOOT_COMPARE
+#define PARALLEL_BOOT_COMPARE 0
+#endif
+
+// Set (by the Makefile) when the kernel carries its font (see bin/psf2c.c),
+// so the bootloader doesn't load one.
+#ifndef KERNEL_BUILTIN_FONT
+#define KERNEL_BUILTIN_FONT 0
+#endif
+
 
 /* Used internally by GCC */
 void abort()
@@ -24,6 +64,552 @@ EFI_RUNTIME_SERVICES*  g_RuntimeServices;
 Graphics               g_Graphics;
 
 
+// A PT_LOAD segment whose file data has been read into physically
+// contiguous frames, waiting to be mapped.
+typedef struct KernelSegment
+{
+    u64 virtual_start;  // Page aligned.
+    u64 file_end;       // End of the pages backed by `physical`.
+    u64 segment_end;    // End of the pages including .bss.
+    u64 physical;
+    u32 flags;          // PAGE_MAP_*.
+} KernelSegment;
+
+#define KERNEL_SEGMENTS_MAX 16
+
+// Descriptors of room left in the memory map buffer for the two allocations
+// made before the snapshot, each of which can split a free area, and for
+// whatever the firmware allocates between the snapshot and ExitBootServices.
+#define MEMORY_MAP_SPARE_DESCRIPTORS 16
+
+
+// The kernel file, either a plain ELF or packed (see kernel_pack.h).
+typedef struct KernelImage
+{
+    const u8*          memory;      // The whole kernel file in memory, or NULL to go through `read`.
+    usize              pages;       // Of `memory`, if it's ours to free (not the boot archive's).
+    FileRead           read;
+    u64                size;
+    KernelPackHeader   pack;        // Zeroed for a plain ELF.
+    KernelPackSegment* segments;
+    KernelPackExtent*  extents;
+    u8*                staging[2];  // Room for one compressed block each; one is read while the other is decompressed.
+    u32                crc;         // Running CRC32C of what's been loaded (see KERNEL_DIGEST_FILE_NAME).
+    const Processors*  processors;  // To decompress packed segments on, or NULL for only this one.
+} KernelImage;
+
+
+/// Start reading `size` bytes at `offset` of the kernel file into
+/// `destination`. Finish with kernel_image_read_end.
+void kernel_image_read_begin(KernelImage* image, u64 offset, void* destination, u64 size)
+{
+    ASSERTF(offset + size <= image->size, "Read past the end of the kernel file!");
+    if (image->memory != NULL)
+        memcpy(destination, image->memory + offset, size);
+    else
+        file_read_begin(&image->read, offset, destination, size);
+}
+
+void kernel_image_read_end(KernelImage* image, u64 size)
+{
+    if (image->memory != NULL)
+        return;
+    ASSERTF(file_read_end(&image->read) == size, "Couldn't read all of the kernel file!");
+}
+
+static void kernel_image_chunk_begin(void* context, u64 offset, u8* destination, u64 size)
+{
+    kernel_image_read_begin((KernelImage *) context, offset, destination, size);
+}
+
+static void kernel_image_chunk_end(void* context, u64 size)
+{
+    kernel_image_read_end((KernelImage *) context, size);
+}
+
+/// Read `size` bytes at `offset` of the kernel file into `destination`.
+void kernel_image_read(KernelImage* image, u64 offset, void* destination, u64 size)
+{
+    kernel_image_read_begin(image, offset, destination, size);
+    kernel_image_read_end(image, size);
+}
+
+
+/// Read `size` bytes at `offset` of the kernel ELF, which for a packed kernel
+/// must be inside one of the extents it kept. Not for segment data.
+void kernel_image_read_elf(KernelImage* image, u64 offset, void* destination, u64 size)
+{
+    if (image->pack.magic != KERNEL_PACK_MAGIC)
+    {
+        kernel_image_read(image, offset, destination, size);
+        return;
+    }
+
+    for (u32 i = 0; i < image->pack.extent_count; ++i)
+    {
+        const KernelPackExtent* extent = &image->extents[i];
+        if (offset >= extent->file_offset && offset + size <= extent->file_offset + extent->size)
+        {
+            kernel_image_read(image, extent->packed_offset + (offset - extent->file_offset), destination, size);
+            return;
+        }
+    }
+
+    ERROR(INVALID, "Packed kernel doesn't have that part of the ELF!");
+}
+
+
+/// Time reading the whole kernel file through EFI_FILE_PROTOCOL, and check
+/// that it's what block I/O read.
+static void kernel_image_compare_file(const KernelImage* image, EFI_FILE_PROTOCOL* RootFolder, u64 block_io_cycles)
+{
+    EFI_FILE_PROTOCOL* File = NULL;
+    EFI_ASSERT(RootFolder->Open(RootFolder, &File, (CHAR16 *) L"kernel", 0x01, 0));
+
+    u8* Buffer = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, image->size, (void **) &Buffer));
+
+    u64   Start = x86_64_rdtsc();
+    UINTN Size  = image->size;
+    EFI_ASSERT(File->Read(File, &Size, Buffer));
+    u64   Cycles = x86_64_rdtsc() - Start;
+    EFI_ASSERT(File->Close(File));
+
+    ASSERTF(Size == image->size, "File protocol read %x bytes of the kernel, block I/O %x!", Size, image->size);
+    for (u64 i = 0; i < image->size; ++i)
+        ASSERTF(Buffer[i] == image->memory[i], "Block I/O read the kernel wrong at %x!", i);
+    EFI_ASSERT(g_BootServices->FreePool(Buffer));
+
+    EfiPrintF(L"Kernel read: block I/O %d Kcycles, file protocol %d Kcycles\n\r", (int) (block_io_cycles / 1000), (int) (Cycles / 1000));
+}
+
+
+/// Read the whole kernel file into frames of its own with block I/O. False if
+/// it isn't a plain file in the root of `volume` or couldn't be read.
+static bool kernel_image_read_blocks(KernelImage* image, Fat32Volume* volume, EFI_FILE_PROTOCOL* RootFolder)
+{
+    u32 Cluster = 0;
+    u32 Size    = 0;
+    Fat32Extent* Extents     = NULL;
+    usize        ExtentCount = 0;
+    if (!fat32_find(volume, "kernel", &Cluster, &Size) || Size == 0 || !fat32_extents(volume, Cluster, Size, &Extents, &ExtentCount))
+        return 0;
+
+    usize Pages = (Size + PAGE_SIZE - 1) / PAGE_SIZE;
+    EFI_PHYSICAL_ADDRESS Frames = 0;
+    EFI_ASSERT(g_BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, Pages, &Frames));
+
+    u64  Start  = x86_64_rdtsc();
+    bool Read   = fat32_read_extents(volume, Extents, ExtentCount, (u8 *) Frames, Size);
+    u64  Cycles = x86_64_rdtsc() - Start;
+    EFI_ASSERT(g_BootServices->FreePool(Extents));
+
+    if (!Read)
+    {
+        LOG("Couldn't read the kernel with block I/O\r");
+        EFI_ASSERT(g_BootServices->FreePages(Frames, Pages));
+        return 0;
+    }
+
+    image->memory = (const u8 *) Frames;
+    image->size   = Size;
+    image->pages  = Pages;
+    EfiPrintF(L"Kernel read with block I/O: %x bytes in %d extents, %d Kcycles\n\r", (u64) Size, (int) ExtentCount, (int) (Cycles / 1000));
+
+    if (KERNEL_BLOCK_IO_COMPARE)
+        kernel_image_compare_file(image, RootFolder, Cycles);
+    return 1;
+}
+
+
+/// Open the kernel in the boot archive, or else the kernel file, read with
+/// block I/O if there's a `volume` and through EFI_FILE_PROTOCOL otherwise.
+KernelImage kernel_image_open(EFI_FILE_PROTOCOL* RootFolder, const BootArchive* archive, Fat32Volume* volume)
+{
+    KernelImage image = { .crc=CRC32C_INITIAL };
+
+    const BootArchiveEntry* entry = boot_archive_find(archive, "kernel");
+    if (entry != NULL)
+    {
+        image.memory = boot_archive_data(archive, entry);
+        image.size   = entry->size;
+    }
+    else if (volume != NULL && kernel_image_read_blocks(&image, volume, RootFolder))
+    {
+    }
+    else
+    {
+        EFI_FILE_PROTOCOL* File = NULL;
+        EFI_ASSERT(RootFolder->Open(RootFolder, &File, (CHAR16 *) L"kernel", 0x01, 0));
+        ASSERTF(File != NULL, "Couldn't load kernel!");
+        image.read = file_read_new(File);
+        image.size = file_get_size(File);
+    }
+
+    KernelPackHeader pack;
+    kernel_image_read(&image, 0, &pack, sizeof(pack));
+    if (pack.magic != KERNEL_PACK_MAGIC)
+        return image;
+
+    ASSERTF(pack.version == KERNEL_PACK_VERSION, "Unknown packed kernel version %d!", (int) pack.version);
+    ASSERTF(pack.block_size > 0 && pack.block_size < KERNEL_PACK_BLOCK_STORED, "Bad packed kernel block size!");
+
+    image.pack = pack;
+
+    UINTN SegmentsSize = pack.segment_count * sizeof(KernelPackSegment);
+    UINTN ExtentsSize  = pack.extent_count  * sizeof(KernelPackExtent);
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, SegmentsSize, (void **) &image.segments));
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, ExtentsSize,  (void **) &image.extents));
+    kernel_image_read(&image, sizeof(pack), image.segments, SegmentsSize);
+    kernel_image_read(&image, sizeof(pack) + SegmentsSize, image.extents, ExtentsSize);
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, LZ4_COMPRESS_BOUND(pack.block_size), (void **) &image.staging[0]));
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, LZ4_COMPRESS_BOUND(pack.block_size), (void **) &image.staging[1]));
+
+    EfiPrintF(L"Kernel is packed: %d segments in %x bytes\n\r", (int) pack.segment_count, image.size);
+    return image;
+}
+
+
+/// Where the `index`th block of a packed segment is read to: stored blocks
+/// straight into place, compressed ones into alternating staging buffers.
+static void* kernel_image_block_target(KernelImage* image, u32 size, usize index, u8* destination)
+{
+    return (size & KERNEL_PACK_BLOCK_STORED) ? (void *) destination : (void *) image->staging[index & 1];
+}
+
+
+// The blocks of one packed segment, for decompressing in any order.
+typedef struct SegmentBlocks
+{
+    const u8*  source;       // The segment's packed data, after the block sizes.
+    const u64* offsets;      // Of each block in `source`.
+    const u32* sizes;
+    u8*        destination;
+    usize      block_size;
+    u64        file_size;
+    usize      failed;       // Set by any processor that finds a corrupt block.
+} SegmentBlocks;
+
+
+/// Run on any processor, so it only reports failure through `blocks`.
+static void segment_block_decompress(void* argument, usize index)
+{
+    SegmentBlocks* blocks = (SegmentBlocks *) argument;
+
+    u64   offset   = index * blocks->block_size;
+    usize expected = blocks->file_size - offset < blocks->block_size ? (usize) (blocks->file_size - offset) : blocks->block_size;
+    usize stored   = blocks->sizes[index] & ~KERNEL_PACK_BLOCK_STORED;
+    const u8* source = blocks->source + blocks->offsets[index];
+
+    if (blocks->sizes[index] & KERNEL_PACK_BLOCK_STORED)
+        memcpy(blocks->destination + offset, source, expected);
+    else if (lz4_decompress_block(source, stored, blocks->destination + offset, expected) != (i64) expected)
+        __atomic_store_n(&blocks->failed, 1, __ATOMIC_RELAXED);
+}
+
+
+/// Decompress a packed segment with all its blocks in memory at once, spread
+/// over every processor, then checksum it here. Blocks are independent, but
+/// the CRC has to run in order.
+static void kernel_image_decompress_segment(KernelImage* image, const KernelPackSegment* segment, const u32* sizes, usize count, u8* destination)
+{
+    u64 header  = count * sizeof(u32);
+    ASSERTF(segment->packed_size >= header, "Packed segment is truncated!");
+    u64 payload = segment->packed_size - header;
+
+    u8* Payload = NULL;
+    if (image->memory != NULL)
+    {
+        ASSERTF(segment->packed_offset + segment->packed_size <= image->size, "Packed segment is past the end of the kernel file!");
+        Payload = (u8 *) image->memory + segment->packed_offset + header;
+    }
+    else
+    {
+        EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, payload, (void **) &Payload));
+        kernel_image_read(image, segment->packed_offset + header, Payload, payload);
+    }
+
+    u64* Offsets = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, count * sizeof(u64), (void **) &Offsets));
+    u64 position = 0;
+    for (usize i = 0; i < count; ++i)
+    {
+        Offsets[i] = position;
+        position  += sizes[i] & ~KERNEL_PACK_BLOCK_STORED;
+    }
+    ASSERTF(position == payload, "Packed segment has trailing data!");
+
+    SegmentBlocks blocks = {
+        .source=Payload, .offsets=Offsets, .sizes=sizes, .destination=destination,
+        .block_size=image->pack.block_size, .file_size=segment->file_size,
+    };
+
+    u64 Start  = x86_64_rdtsc();
+    parallel_for(image->processors, count, segment_block_decompress, &blocks, 0);
+    u64 Cycles = x86_64_rdtsc() - Start;
+    ASSERTF(!blocks.failed, "Packed segment is corrupt!");
+
+    if (PARALLEL_BOOT_COMPARE)
+    {
+        // Same output again, so the destination is left as it was.
+        Start = x86_64_rdtsc();
+        parallel_for(image->processors, count, segment_block_decompress, &blocks, 1);
+        u64 SerialCycles = x86_64_rdtsc() - Start;
+        ASSERTF(!blocks.failed, "Packed segment is corrupt!");
+
+        EfiPrintF(L"Segment decompressed (%d blocks): %d processors %d Kcycles, serial %d Kcycles\n\r",
+                  (int) count, (int) image->processors->count, (int) (Cycles / 1000), (int) (SerialCycles / 1000));
+    }
+
+    image->crc = crc32c_update(image->crc, destination, segment->file_size);
+
+    EFI_ASSERT(g_BootServices->FreePool(Offsets));
+    if (image->memory == NULL)
+        EFI_ASSERT(g_BootServices->FreePool(Payload));
+}
+
+
+/// Put the file data of the `index`th PT_LOAD at `destination`. Packed
+/// segments are read a block at a time and decompressed in place, so the
+/// only staging is two compressed blocks. With more than one processor they
+/// are instead read whole and decompressed in parallel.
+///
+/// Either way the next chunk is already being read while the current one is
+/// checksummed (and decompressed), when the firmware can read asynchronously.
+void kernel_image_read_segment(KernelImage* image, usize index, const Elf64ProgramHeader* program, u8* destination)
+{
+    if (image->pack.magic != KERNEL_PACK_MAGIC)
+    {
+        // In chunks, so that each is checksummed while it's still in cache.
+        ChunkedRead read = { .context=image, .begin=kernel_image_chunk_begin, .end=kernel_image_chunk_end };
+        image->crc = chunked_read(&read, program->file_offset, destination, program->file_size, KERNEL_PACK_BLOCK_SIZE, image->crc);
+        return;
+    }
+
+    ASSERTF(index < image->pack.segment_count, "Packed kernel is missing segment %d!", (int) index);
+    const KernelPackSegment* segment = &image->segments[index];
+    ASSERTF(segment->file_offset == program->file_offset && segment->file_size == program->file_size, "Packed segment doesn't match its program header!");
+
+    usize block_size = image->pack.block_size;
+    usize blocks     = KERNEL_PACK_BLOCKS(segment->file_size, block_size);
+    u32*  sizes      = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, blocks * sizeof(u32), (void **) &sizes));
+    kernel_image_read(image, segment->packed_offset, sizes, blocks * sizeof(u32));
+
+    for (usize i = 0; i < blocks; ++i)
+    {
+        usize stored = sizes[i] & ~KERNEL_PACK_BLOCK_STORED;
+        if (sizes[i] & KERNEL_PACK_BLOCK_STORED)
+            ASSERTF(stored == (i + 1 < blocks ? block_size : segment->file_size - i * block_size), "Stored block %d has the wrong size!", (int) i);
+        else
+            ASSERTF(stored <= LZ4_COMPRESS_BOUND(block_size), "Compressed block %d is too large!", (int) i);
+    }
+
+    if (PARALLEL_BOOT && image->processors != NULL && image->processors->count > 1 && blocks > 1)
+    {
+        kernel_image_decompress_segment(image, segment, sizes, blocks, destination);
+        EFI_ASSERT(g_BootServices->FreePool(sizes));
+        return;
+    }
+
+    u64 position  = segment->packed_offset + blocks * sizeof(u32);
+    u64 remaining = segment->file_size;
+    if (blocks > 0)
+        kernel_image_read_begin(image, position, kernel_image_block_target(image, sizes[0], 0, destination), sizes[0] & ~KERNEL_PACK_BLOCK_STORED);
+
+    for (usize i = 0; i < blocks; ++i)
+    {
+        usize expected = remaining < block_size ? (usize) remaining : block_size;
+        usize stored   = sizes[i] & ~KERNEL_PACK_BLOCK_STORED;
+        kernel_image_read_end(image, stored);
+
+        if (i + 1 < blocks)
+            kernel_image_read_begin(image, position + stored, kernel_image_block_target(image, sizes[i + 1], i + 1, destination + expected), sizes[i + 1] & ~KERNEL_PACK_BLOCK_STORED);
+
+        if (!(sizes[i] & KERNEL_PACK_BLOCK_STORED))
+        {
+            i64 written = lz4_decompress_block(image->staging[i & 1], stored, destination, expected);
+            ASSERTF(written == (i64) expected, "Compressed block %d is corrupt!", (int) i);
+        }
+        image->crc = crc32c_update(image->crc, destination, expected);
+
+        position    += stored;
+        destination += expected;
+        remaining   -= expected;
+    }
+
+    ASSERTF(position == segment->packed_offset + segment->packed_size, "Packed segment has trailing data!");
+    EFI_ASSERT(g_BootServices->FreePool(sizes));
+}
+
+
+static usize c_string_length(const char* string)
+{
+    usize length = 0;
+    while (string[length])
+        ++length;
+    return length;
+}
+
+
+/// Collect the kernel's function symbols into a SymbolTable, which the
+/// kernel uses to print addresses as function+offset. The table lives in
+/// loader data, so it survives into the kernel. A kernel without .symtab
+/// gets an empty table.
+SymbolTable kernel_image_read_symbols(KernelImage* image, const Elf64Header* header)
+{
+    SymbolTable table = { 0 };
+    if (header->section_header_offset == 0 || header->section_header_entries == 0)
+        return table;
+
+    UINTN SectionsSize = header->section_header_entries * sizeof(Elf64SectionHeader);
+    Elf64SectionHeader* Sections = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, SectionsSize, (void **) &Sections));
+    kernel_image_read_elf(image, header->section_header_offset, Sections, SectionsSize);
+
+    const Elf64SectionHeader* SymbolSection = NULL;
+    for (u16 i = 0; i < header->section_header_entries && !SymbolSection; ++i)
+    {
+        if (Sections[i].type == SHT_SYMTAB)
+            SymbolSection = &Sections[i];
+    }
+
+    if (!SymbolSection)
+    {
+        LOG("Kernel has no symbol table\r");
+        EFI_ASSERT(g_BootServices->FreePool(Sections));
+        return table;
+    }
+
+    ASSERTF(SymbolSection->link < header->section_header_entries, "Symbol table links to a missing string table!");
+    const Elf64SectionHeader* StringSection = &Sections[SymbolSection->link];
+
+    Elf64Symbol* ElfSymbols = NULL;
+    char*        Strings    = NULL;
+    UINTN        ElfSymbolCount = SymbolSection->size / sizeof(Elf64Symbol);
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, SymbolSection->size, (void **) &ElfSymbols));
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, StringSection->size, (void **) &Strings));
+    kernel_image_read_elf(image, SymbolSection->offset, ElfSymbols, SymbolSection->size);
+    kernel_image_read_elf(image, StringSection->offset, Strings, StringSection->size);
+    ASSERTF(StringSection->size > 0 && Strings[StringSection->size - 1] == '\0', "String table isn't terminated!");
+
+    // One pass to size the table, one to fill it. Only functions are kept.
+    u32   Count     = 0;
+    UINTN NamesSize = 0;
+    for (UINTN i = 0; i < ElfSymbolCount; ++i)
+    {
+        const Elf64Symbol* ElfSymbol = &ElfSymbols[i];
+        if (ELF64_SYMBOL_TYPE(ElfSymbol->info) != STT_FUNC || ElfSymbol->value == 0 || ElfSymbol->name == 0)
+            continue;
+        ASSERTF(ElfSymbol->name < StringSection->size, "Symbol name is outside the string table!");
+
+        Count     += 1;
+        NamesSize += c_string_length(Strings + ElfSymbol->name) + 1;
+    }
+
+    if (Count == 0)
+    {
+        LOG("Kernel has no function symbols\r");
+        EFI_ASSERT(g_BootServices->FreePool(ElfSymbols));
+        EFI_ASSERT(g_BootServices->FreePool(Strings));
+        EFI_ASSERT(g_BootServices->FreePool(Sections));
+        return table;
+    }
+
+    table.count        = Count;
+    table.bucket_count = 1;
+    while (table.bucket_count < 2 * Count)
+        table.bucket_count *= 2;
+
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, Count * sizeof(Symbol), (void **) &table.symbols));
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, NamesSize, (void **) &table.names));
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, table.bucket_count * sizeof(u32), (void **) &table.buckets));
+    memset(table.buckets, 0, table.bucket_count * sizeof(u32));
+
+    u32 j    = 0;
+    u32 Name = 0;
+    for (UINTN i = 0; i < ElfSymbolCount; ++i)
+    {
+        const Elf64Symbol* ElfSymbol = &ElfSymbols[i];
+        if (ELF64_SYMBOL_TYPE(ElfSymbol->info) != STT_FUNC || ElfSymbol->value == 0 || ElfSymbol->name == 0)
+            continue;
+
+        usize Length = c_string_length(Strings + ElfSymbol->name) + 1;
+        memcpy(table.names + Name, Strings + ElfSymbol->name, Length);
+        table.symbols[j++] = (Symbol) { .address=ElfSymbol->value, .size=ElfSymbol->size, .name=Name };
+        Name += (u32) Length;
+    }
+
+    symbol_table_sort(&table);
+    symbol_table_index(&table);
+
+    EFI_ASSERT(g_BootServices->FreePool(ElfSymbols));
+    EFI_ASSERT(g_BootServices->FreePool(Strings));
+    EFI_ASSERT(g_BootServices->FreePool(Sections));
+
+    EfiPrintF(L"Kernel symbols: %d functions, %x bytes of names\n\r", (int) Count, (u64) NamesSize);
+    return table;
+}
+
+
+void kernel_image_close(KernelImage* image)
+{
+    if (image->memory == NULL)
+        file_read_close(&image->read);
+    else if (image->pages)
+        EFI_ASSERT(g_BootServices->FreePages((EFI_PHYSICAL_ADDRESS) image->memory, image->pages));
+}
+
+
+/// Compare what was loaded against the digest in the sidecar file (in the
+/// boot archive if it's there), and halt if they differ. A kernel without a
+/// digest is loaded with a warning.
+void kernel_image_verify(KernelImage* image, EFI_FILE_PROTOCOL* RootFolder, const BootArchive* archive)
+{
+    u32 actual = CRC32C_FINAL(image->crc);
+
+    u8    Digits[8];
+    UINTN Size = sizeof(Digits);
+    const BootArchiveEntry* entry = boot_archive_find(archive, KERNEL_DIGEST_FILE_NAME);
+    if (entry != NULL)
+    {
+        Size = entry->size < sizeof(Digits) ? (UINTN) entry->size : sizeof(Digits);
+        memcpy(Digits, boot_archive_data(archive, entry), Size);
+    }
+    else
+    {
+        EFI_FILE_PROTOCOL* DigestFile = NULL;
+        EFI_STATUS Status = RootFolder->Open(RootFolder, &DigestFile, (CHAR16 *) L"" KERNEL_DIGEST_FILE_NAME, 0x01, 0);
+        if (Status != EFI_SUCCESS || DigestFile == NULL)
+        {
+            EfiPrintF(L"No kernel digest, skipping verification (crc32c %x)\n\r", (u64) actual);
+            return;
+        }
+
+        EFI_ASSERT(DigestFile->Read(DigestFile, &Size, Digits));
+        EFI_ASSERT(DigestFile->Close(DigestFile));
+    }
+    ASSERTF(Size == sizeof(Digits), "Kernel digest is too short!");
+
+    u32 expected = 0;
+    for (usize i = 0; i < sizeof(Digits); ++i)
+    {
+        u8 c = Digits[i];
+        u32 digit = (c >= '0' && c <= '9') ? (u32) (c - '0') : (c >= 'a' && c <= 'f') ? (u32) (c - 'a' + 10) : (c >= 'A' && c <= 'F') ? (u32) (c - 'A' + 10) : 0xFF;
+        ASSERTF(digit != 0xFF, "Kernel digest isn't hexadecimal!");
+        expected = (expected << 4) | digit;
+    }
+
+    if (actual != expected)
+    {
+        EfiPrintF(L"Kernel is corrupt! crc32c is %x, but %x was expected.\n\r", (u64) actual, (u64) expected);
+        EfiHalt();
+    }
+
+    EfiPrintF(L"Kernel verified (crc32c %x, %s)\n\r", (u64) actual, crc32c_is_hardware() ? L"sse4.2" : L"table");
+}
+
+
 PageAllocator page_allocator_new_from_memory_map(const Memory* memory)
 {
     usize entries = memory->MemoryMapSize / memory->DescriptorSize;
@@ -57,15 +643,60 @@ PageAllocator page_allocator_new_from_memory_map(const Memory* memory)
 
 
 
+/// Size of the glyph data following `header`, which must be a PSF1 header.
+static usize psf1_glyphs_size(const PSF1_Header* header)
+{
+    ASSERTF(header->magic[0] == 0x36 && header->magic[1] == 0x04, "Wrong magic number for font!\r");
+    return header->font_height * (header->file_mode == 1 ? 512U : 256U);
+}
+
+
+/// Let the firmware's code and this bootloader run through the identity
+/// map, which is otherwise non-executable, until the kernel takes over.
+void memory_map_allow_execute(PageMap* map, const Memory* memory)
+{
+    usize entries = memory->MemoryMapSize / memory->DescriptorSize;
+    usize base    = (u64) memory->MemoryMap;
+
+    for (usize i = 0; i < entries; ++i)
+    {
+        EFI_MEMORY_DESCRIPTOR* descriptor = (EFI_MEMORY_DESCRIPTOR *)(base + memory->DescriptorSize * i);
+        if (descriptor->Type != EfiLoaderCode && descriptor->Type != EfiBootServicesCode && descriptor->Type != EfiRuntimeServicesCode)
+            continue;
+
+        u64 end = descriptor->PhysicalStart + descriptor->NumberOfPages * PAGE_SIZE;
+        for (u64 block = descriptor->PhysicalStart & ~(PAGE_LEVEL_SIZE(1) - 1); block < end; block += PAGE_LEVEL_SIZE(1))
+            page_map_allow_execute(map, block);
+    }
+}
+
+
+
+
 EFI_STATUS EfiMain(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
 {
     /* ---- INITIALIZE STATICS ----
      * The System Table contains pointers to other standard tables that a loaded
      * image may use if the associated pointers are initialized to nonzero values.
      */
+    BootTimeline Timeline = { 0 };
+    boot_timeline_mark(&Timeline, "firmware");
+
     g_SystemTable     = SystemTable;
     g_BootServices    = SystemTable->BootServices;
     g_RuntimeServices = SystemTable->RuntimeServices;
+    cpu_init();
+    memory_primitives_init();
+
+    /* The TSC ticks at a constant rate on anything with invariant TSC, which
+     * includes QEMU, so one stall is enough to convert cycles to time.
+     */
+    {
+        u64 Start = x86_64_rdtsc();
+        g_BootServices->Stall(1000);
+        Timeline.tsc_hz = (x86_64_rdtsc() - Start) * 1000;
+    }
+    boot_timeline_mark(&Timeline, "tsc-calibration");
 
 
     /* ---- INITIALIZE SCREEN ----
@@ -84,6 +715,7 @@ EFI_STATUS EfiMain(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
      * put the input stream in a known empty state.
      */
     EFI_ASSERT(g_SystemTable->ConIn->Reset(g_SystemTable->ConIn, EFI_TRUE));
+    boot_timeline_mark(&Timeline, "console");
 
 
     /* ---- INITIALIZE GRAPHICS ---- */
@@ -97,97 +729,222 @@ EFI_STATUS EfiMain(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
     g_Graphics.width  = GraphicsOutput->Mode->Info->HorizontalResolution;
     g_Graphics.height = GraphicsOutput->Mode->Info->VerticalResolution;
     g_Graphics.pixels_per_scanline = GraphicsOutput->Mode->Info->PixelsPerScanLine;
+    boot_timeline_mark(&Timeline, "graphics");
 
 
     /* ---- INITIALIZE FILE SYSTEM ---- */
     EFI_FILE_PROTOCOL* RootFolder = NULL;
+    Fat32Volume        BootVolume = { 0 };
+    bool               HasVolume  = 0;
     {
         EFI_LOADED_IMAGE_PROTOCOL* LoadedImage = NULL;
         EFI_ASSERT(g_BootServices->HandleProtocol(ImageHandle, &EFI_LOADED_IMAGE_PROTOCOL_GUID, (void **) &LoadedImage));
 
+        // Only used for the kernel, the rest goes through RootFolder.
+        if (KERNEL_BLOCK_IO)
+            HasVolume = fat32_open(&BootVolume, LoadedImage->DeviceHandle);
+
         EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume = NULL;
         EFI_ASSERT(g_BootServices->HandleProtocol(LoadedImage->DeviceHandle, &EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID, (void **) &Volume));
 
         EFI_ASSERT(Volume->OpenVolume(Volume, &RootFolder));
     }
+    boot_timeline_mark(&Timeline, "file-system");
+
+
+    /* ---- LOAD BOOT ARCHIVE ---- */
+    /* Optional. If it's there it's read whole, with one request, into pages
+     * the kernel keeps (see boot_archive.h), and files are looked up in it
+     * before the file system.
+     */
+    BootArchive Archive = { 0 };
+    {
+        EFI_FILE_PROTOCOL* ArchiveFile = NULL;
+        EFI_STATUS Status = RootFolder->Open(RootFolder, &ArchiveFile, (CHAR16 *) L"" BOOT_ARCHIVE_FILE_NAME, 0x01, 0);
+        if (Status == EFI_SUCCESS && ArchiveFile != NULL)
+        {
+            u64 Size = file_get_size(ArchiveFile);
+            ASSERTF(Size >= sizeof(BootArchiveHeader), "Boot archive is corrupt!\r");
+
+            EFI_PHYSICAL_ADDRESS Pages = 0;
+            EFI_ASSERT(g_BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, (Size + PAGE_SIZE - 1) / PAGE_SIZE, &Pages));
+
+            FileRead ArchiveRead = file_read_new(ArchiveFile);
+            file_read_begin(&ArchiveRead, 0, (void *) Pages, Size);
+            ASSERTF(file_read_end(&ArchiveRead) == Size, "Couldn't read all of the boot archive!\r");
+            file_read_close(&ArchiveRead);
+
+            ASSERTF(boot_archive_open(&Archive, (const void *) Pages, Size), "Boot archive is corrupt!\r");
+            EfiPrintF(L"Boot archive: %d files in %x bytes\n\r", (int) Archive.count, Size);
+        }
+    }
+    boot_timeline_mark(&Timeline, "boot-archive");
 
 
     /* ---- LOAD DEFAULT FONT ---- */
+    /* From the boot archive, the glyphs are used in place. Otherwise only the
+     * header is read here, and the glyphs are read while the kernel loads and
+     * waited for before the memory map is taken.
+     *
+     * A kernel built with KERNEL_BUILTIN_FONT has its own, so it's skipped
+     * and the kernel gets a zeroed font.
+     */
     PSF1_Font Font = { .scale=1 };
+    FileRead  FontRead = { 0 };
+    UINTN     FontDataSize = 0;
+    const BootArchiveEntry* FontEntry = boot_archive_find(&Archive, "default-font.psf");
+    if (KERNEL_BUILTIN_FONT)
+    {
+        LOG("Font is built into the kernel\r");
+    }
+    else if (FontEntry != NULL)
+    {
+        const u8* FontData = boot_archive_data(&Archive, FontEntry);
+        ASSERTF(FontEntry->size >= sizeof(PSF1_Header), "Font is truncated!\r");
+        memcpy(&Font.header, FontData, sizeof(PSF1_Header));
 
+        FontDataSize = psf1_glyphs_size(&Font.header);
+        ASSERTF(FontEntry->size >= sizeof(PSF1_Header) + FontDataSize, "Font is truncated!\r");
+        Font.glyphs = (u8 *) FontData + sizeof(PSF1_Header);
+    }
+    else
     {
         EFI_FILE_PROTOCOL* FontFile = NULL;
         EFI_ASSERT(RootFolder->Open(RootFolder, &FontFile, (CHAR16 *) L"default-font.psf", 0x01, 0));
 
         ASSERTF(FontFile != NULL, "Couldn't load font!\r");
 
-        UINTN FontDataSize = sizeof(PSF1_Header);
+        FontDataSize = sizeof(PSF1_Header);
         EFI_ASSERT(FontFile->Read(FontFile, &FontDataSize, &Font.header));
 
-        ASSERTF(Font.header.magic[0] == 0x36 && Font.header.magic[1] == 0x04, "Wrong magic number for font!\r");
-
-        FontDataSize = Font.header.font_height * 256;
-        if (Font.header.file_mode == 1)
-            FontDataSize = Font.header.font_height * 512;
-
-        EFI_ASSERT(FontFile->SetPosition(FontFile, sizeof(PSF1_Header)));
+        FontDataSize = psf1_glyphs_size(&Font.header);
         EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, FontDataSize, (void**)&Font.glyphs));
-        EFI_ASSERT(FontFile->Read(FontFile, &FontDataSize, Font.glyphs));
+        FontRead = file_read_new(FontFile);
+        file_read_begin(&FontRead, sizeof(PSF1_Header), Font.glyphs, FontDataSize);
+        EfiPrintF(L"File reads are %s\n\r", file_read_is_async(&FontRead) ? L"asynchronous" : L"blocking");
     }
+    boot_timeline_mark(&Timeline, "font");
 
     /* ---- LOAD KERNEL ---- */
+    /* Only the ELF and program headers are staged. Each segment's file data
+     * is read (or decompressed) straight into the frames it will be mapped
+     * from, which are allocated before the memory map is taken, so the page
+     * allocator never hands them out again.
+     */
     typedef __attribute__((sysv_abi)) int (*elf_main_fn)(Context*);
-    elf_main_fn EntryPoint = NULL;
-    Elf64ProgramHeader* Program = NULL;
-    u8* KernelSource = NULL;
+    elf_main_fn   EntryPoint = NULL;
+    KernelSegment Segments[KERNEL_SEGMENTS_MAX];
+    usize         SegmentCount = 0;
+    SymbolTable   Symbols      = { 0 };
     {
-        EFI_FILE_PROTOCOL* KernelFile = NULL;
-        EFI_ASSERT(RootFolder->Open(RootFolder, &KernelFile, (CHAR16 *) L"kernel", 0x01, 0));
-
-        UINTN Size = 0x10000;
-        KernelSource = NULL;
-        EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, Size, (void **) &KernelSource));
-        EFI_ASSERT(KernelFile->Read(KernelFile, &Size, KernelSource));
-
-        if (!KernelSource)
+        crc32c_init();
+#if PARALLEL_BOOT
+        Processors  Cpus  = processors_open();
+#else
+        // Only the boot processor, without touching the MP services.
+        Processors  Cpus  = { .count=1 };
+#endif
+        KernelImage Image = kernel_image_open(RootFolder, &Archive, HasVolume ? &BootVolume : NULL);
+        Image.processors  = &Cpus;
+        EfiPrintF(L"Processors: %d\n\r", (int) Cpus.count);
+
+        Elf64Header Header;
+        kernel_image_read_elf(&Image, 0, &Header, sizeof(Header));
+        ASSERTF(is_elf64((const u8 *) &Header) == ELF_YES, "Kernel isn't a 64-bit ELF!");
+        ASSERTF(Header.program_header_entry_size == sizeof(Elf64ProgramHeader), "Kernel program headers have an unexpected size!");
+        Image.crc = crc32c_update(Image.crc, &Header, sizeof(Header));
+
+        UINTN ProgramsSize = Header.program_header_entries * sizeof(Elf64ProgramHeader);
+        Elf64ProgramHeader* Programs = NULL;
+        EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, ProgramsSize, (void **) &Programs));
+        kernel_image_read_elf(&Image, Header.program_header_offset, Programs, ProgramsSize);
+        Image.crc = crc32c_update(Image.crc, Programs, ProgramsSize);
+
+        EfiPrintF(L"Entry: %x, size: %x\n\r", Header.entry_point, Image.size);
+        ASSERTF(Header.entry_point >= KERNEL_VIRTUAL_BASE, "Kernel isn't linked in the higher half (%x)!", Header.entry_point);
+
+        u64 PreviousEnd = 0;
+        for (u16 i = 0; i < Header.program_header_entries; ++i)
         {
-            EfiPrintF(L"Couldn't load kernel!\n\r");
-            EfiHalt();
+            const Elf64ProgramHeader* Program = &Programs[i];
+            if (Program->type != PT_LOAD)
+                continue;
+
+            u64 Destination = Program->virtual_address;
+            u64 FileEnd     = Destination + Program->file_size;
+            ASSERTF(SegmentCount < KERNEL_SEGMENTS_MAX, "Kernel has too many segments!");
+            ASSERTF(Destination >= KERNEL_VIRTUAL_BASE, "Kernel isn't linked in the higher half (%x)!", Destination);
+            ASSERTF(Program->memory_size >= Program->file_size, "Segment is smaller than its file data!");
+
+            KernelSegment* Segment = &Segments[SegmentCount++];
+            *Segment = (KernelSegment) {
+                .virtual_start=Destination & ~((u64) PAGE_SIZE - 1),
+                .file_end=(FileEnd + PAGE_SIZE - 1) & ~((u64) PAGE_SIZE - 1),
+                .segment_end=(Destination + Program->memory_size + PAGE_SIZE - 1) & ~((u64) PAGE_SIZE - 1),
+                .flags=((Program->flags & PF_W) ? PAGE_MAP_WRITE : 0) | ((Program->flags & PF_X) ? PAGE_MAP_EXECUTE : 0),
+            };
+            ASSERTF(Segment->virtual_start >= PreviousEnd, "Kernel segments share a page!");
+            PreviousEnd = Segment->segment_end;
+
+            EfiPrintF(L"Segment %x - %x (%x in file), flags %x\n\r", Destination, Destination + Program->memory_size, Program->file_size, (u64) Program->flags);
+
+            usize Pages = (usize) ((Segment->file_end - Segment->virtual_start) / PAGE_SIZE);
+            if (Pages == 0)
+                continue;
+
+            EFI_PHYSICAL_ADDRESS Frames = 0;
+            EFI_ASSERT(g_BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, Pages, &Frames));
+            Segment->physical = Frames;
+
+            /* Frames from the firmware aren't zeroed, so clear what's around the
+             * file data: the page offset before it, and the start of .bss after.
+             */
+            u8* Data = (u8 *) Frames + (Destination - Segment->virtual_start);
+            memset((void *) Frames, 0, Destination - Segment->virtual_start);
+            memset(Data + Program->file_size, 0, Segment->file_end - FileEnd);
+
+            kernel_image_read_segment(&Image, SegmentCount - 1, Program, Data);
         }
+        // Each segment's reads have ended by the time it returns.
+        boot_timeline_mark(&Timeline, "kernel-read");
 
-        if (!is_elf64(KernelSource))
-            return 1;
-
-        Elf64Header*        Header   = (Elf64Header*) KernelSource;
-        Elf64ProgramHeader* Programs = (Elf64ProgramHeader*) (KernelSource + Header->program_header_offset);
-        // const Elf64SectionHeader* section  = (Elf64SectionHeader*) (data + Header->section_Header_offset);
-
-        EfiPrintF(L"Entry: %x\n\r", Header->entry_point);
-
-        // https://wiki.osdev.org/ELF
-        for (int i = 0; i < Header->program_header_entries; ++i)
-        {
-            Program = &Programs[i];
+        EFI_ASSERT(g_BootServices->FreePool(Programs));
+        kernel_image_verify(&Image, RootFolder, &Archive);
+        Symbols = kernel_image_read_symbols(&Image, &Header);
+        kernel_image_close(&Image);
+        processors_close(&Cpus);
 
-            if (Program->type == PT_LOAD)
-                break;
-        }
+        EntryPoint = (elf_main_fn) Header.entry_point;
+    }
+    boot_timeline_mark(&Timeline, "kernel-segments");
 
-        ASSERT(Program->type == PT_LOAD);
+    if (HasVolume)
+        fat32_close(&BootVolume);
 
-        void* EntryPointAddress = (void *) Header->entry_point;
-        EntryPoint = (elf_main_fn) EntryPointAddress;
+    /* Firmware may allocate or free memory as a request completes, so
+     * everything in flight is finished before the memory map is taken.
+     */
+    if (FontRead.file != NULL)
+    {
+        ASSERTF(file_read_end(&FontRead) == FontDataSize, "Couldn't read all of the font!\r");
+        file_read_close(&FontRead);
     }
-
-    /* ----- EXIT BOOT SERVICES ---- */
-    Memory memory = { 0 };
+    boot_timeline_mark(&Timeline, "font-wait");
+
+    /* ----- MEMORY MAP ---- */
+    /* The page allocator hands out frames from this snapshot of the memory
+     * map, so anything the firmware allocates after it could land in frames
+     * the allocator gives away. The buffers for the final memory map and the
+     * region table are allocated first, and the snapshot is taken into the
+     * one the final map reuses.
+     */
+    Memory                 memory            = { 0 };
+    EFI_MEMORY_DESCRIPTOR* MemoryMap         = NULL;
+    UINTN                  MemoryMapCapacity = 0;
+    MemoryRegion*          Regions           = NULL;
+    usize                  RegionCapacity    = 0;
     {
-        /* The call between GetMemoryMap and ExitBootServices must be done
-         * without any additional UEFI-calls (including print, as it could
-         * potentially allocate resources and invalidate the memory map.
-         */
         UINTN  MemoryMapSize     = 0;
-        EFI_MEMORY_DESCRIPTOR* MemoryMap = NULL;
         UINTN  MapKey            = 0;
         UINTN  DescriptorSize    = 0;
         UINT32 DescriptorVersion = 0;
@@ -195,14 +952,13 @@ EFI_STATUS EfiMain(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
         /* Will fail with too small buffer, but return the size. */
         ASSERT(g_BootServices->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion) == EFI_BUFFER_TOO_SMALL);
 
-        /* Considering that a new allocation can split a free memory area into
-         * two, you should add space for 2 additional memory descriptors.
-         */
-        MemoryMapSize += 2 * DescriptorSize;
-        EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, MemoryMapSize, (void **) &MemoryMap));
-        EFI_ASSERT(g_BootServices->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion));
+        MemoryMapCapacity = MemoryMapSize + MEMORY_MAP_SPARE_DESCRIPTORS * DescriptorSize;
+        RegionCapacity    = MEMORY_REGIONS_CAPACITY(MemoryMapCapacity / DescriptorSize);
+        EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, MemoryMapCapacity, (void **) &MemoryMap));
+        EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, RegionCapacity * sizeof(MemoryRegion), (void **) &Regions));
 
-//        EFI_ASSERT(g_SystemTable->BootServices->ExitBootServices(ImageHandle, MapKey));
+        MemoryMapSize = MemoryMapCapacity;
+        EFI_ASSERT(g_BootServices->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion));
 
         memory = (Memory) {
             .MemoryMap=MemoryMap,
@@ -211,67 +967,104 @@ EFI_STATUS EfiMain(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
         };
     }
 
-    PageAllocator allocator = page_allocator_new_from_memory_map(&memory);
-    PageTable* pml4 = page_allocator_request_page(&allocator);
+    /* Regions of the snapshot, for the page tables. They're built again from
+     * the final memory map for the kernel.
+     */
+    MemoryRegions regions = {
+            .regions=Regions,
+            .count=memory_regions_build(Regions, RegionCapacity, memory.MemoryMap, memory.MemoryMapSize, memory.DescriptorSize, (u64) g_Graphics.base, g_Graphics.size),
+    };
 
-    idt_install();
+    Context context = {
+            .memory=memory,
+            .graphics=g_Graphics,
+            .services=g_RuntimeServices,
+            .font=Font,
+            .allocator=page_allocator_new_from_memory_map(&memory),
+            .symbols=Symbols,
+            .archive=Archive,
+            .physical_end=memory_regions_ram_end(&regions),
+            .timeline=Timeline,
+    };
+    boot_timeline_mark(&context.timeline, "memory-map");
 
-    LOG("Setting cr3\r");
-    LOGF("pml4 at %x\r", (usize) pml4);
-    x86_64_cr3_set(pml4);
-    LOG("Cr3 set!\r");
+    u8 levels = paging_levels_active();
+    EfiPrintF(L"5-level paging supported: %d, active: %d\n\r", (int) paging_la57_supported(), levels == 5);
 
-    uint64_t destination = Program->virtual_address;
-    uint64_t dest_size   = Program->memory_size;
+    context.page_tables = page_table_pool_new(&context.allocator);
+    context.page_map    = page_map_new(&context.page_tables, levels);
+    context.page_map.nx = paging_nx_enable();
+    context.pager       = (DemandPager) { .map=&context.page_map, .allocator=&context.allocator };
+    context.direct_map_base = page_table_direct_map(&context.page_map, &regions, context.physical_end);
 
-    const uint8_t* source = KernelSource + Program->file_offset;
-    uint64_t source_size  = Program->file_size;
-    EFI_ASSERT(dest_size >= source_size ? EFI_SUCCESS : EFI_ERROR);
+    /* The lower half is identity mapped as well, so that the bootloader keeps
+     * running across the CR3 switch and the kernel can still reach Context
+     * and the framebuffer through the physical addresses it's given. Only
+     * the blocks holding firmware or bootloader code are executable.
+     */
+    u64 physical_end     = context.physical_end;
+    u64 framebuffer      = (u64) g_Graphics.base;
+    u64 framebuffer_end  = framebuffer + g_Graphics.size;
+    page_table_map_memory(&context.page_map, 0, &regions, physical_end, PAGE_MAP_WRITE);
+    if (framebuffer_end > physical_end)
+        page_table_map_physical(&context.page_map, 0, framebuffer > physical_end ? framebuffer : physical_end, framebuffer_end, PAGE_MAP_WRITE);
+    memory_map_allow_execute(&context.page_map, &memory);
+    PageTable* pml4 = context.page_map.root;
+
+    serial_init();
+    idt_install();
+    demand_pager_install(&context.pager);
 
-    for (usize j = 0; j < (dest_size-1) / PAGE_SIZE + 1; ++j)
+    /* ---- MAP KERNEL SEGMENTS ---- */
+    /* Whole pages of .bss are left to the demand pager, which faults in
+     * zeroed frames on first touch.
+     */
+    for (usize i = 0; i < SegmentCount; ++i)
     {
-        void* address = page_allocator_request_page(&allocator);
-        LOGF("Mapping %x - %x\r", destination + j * PAGE_SIZE, (u64) address);
-        map_memory(pml4, &allocator, destination + j * PAGE_SIZE, (u64) address);
-        memcpy((void *)destination, source, source_size);
+        const KernelSegment* Segment = &Segments[i];
+        for (u64 page = Segment->virtual_start; page < Segment->file_end; page += PAGE_SIZE)
+            map_memory(&context.page_map, page, Segment->physical + (page - Segment->virtual_start), Segment->flags);
+
+        if (Segment->segment_end > Segment->file_end)
+            demand_pager_reserve(&context.pager, LAZY_REGION_BSS, Segment->file_end, Segment->segment_end - Segment->file_end);
     }
 
+    // Nothing after this may touch firmware memory that isn't described
+    // by the memory map, as only that (and the framebuffer) is mapped.
+    LOG("Setting cr3\r");
+    EfiPrintF(L"pml4 at %x\n\r", (usize) pml4);
+    x86_64_cr3_set(pml4);
+    LOG("Cr3 set!\r");
+    boot_timeline_mark(&context.timeline, "page-tables");
 
-    Context context = {
-            .memory=memory,
-            .graphics=g_Graphics,
-            .services=g_RuntimeServices,
-            .font=Font,
-            .allocator=allocator,
-    };
 
     LOG("Exiting bootservices\r");
 
+    /* ----- EXIT BOOT SERVICES ---- */
     {
         // The call between GetMemoryMap and ExitBootServices must be done
         // without any additional UEFI-calls (including print, as it could
         // potentially allocate resources and invalidate the memory map.
-        UINTN  MemoryMapSize     = 0;
-        EFI_MEMORY_DESCRIPTOR* MemoryMap = NULL;
+        // The snapshot's buffer is reused, so nothing is allocated here.
+        UINTN  MemoryMapSize     = MemoryMapCapacity;
         UINTN  MapKey            = 0;
         UINTN  DescriptorSize    = 0;
         UINT32 DescriptorVersion = 0;
 
-        // Will fail with too small buffer, but return the size.
-        g_BootServices->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion);
-
-        MemoryMapSize += 2 * DescriptorSize;
-        EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, MemoryMapSize, (void **) &MemoryMap));
         EFI_ASSERT(g_BootServices->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion));
-
         EFI_ASSERT(g_SystemTable->BootServices->ExitBootServices(ImageHandle, MapKey));
 
-        memory = (Memory) {
+        context.memory = (Memory) {
                 .MemoryMap=MemoryMap,
                 .MemoryMapSize=MemoryMapSize,
                 .DescriptorSize=DescriptorSize
         };
+        context.regions = (MemoryRegions) {
+                .regions=Regions,
+                .count=memory_regions_build(Regions, RegionCapacity, MemoryMap, MemoryMapSize, DescriptorSize, (u64) g_Graphics.base, g_Graphics.size),
+        };
     }
+    boot_timeline_mark(&context.timeline, "exit-boot-services");
 
 
     return (EFI_STATUS) EntryPoint(&context);
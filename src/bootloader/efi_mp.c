@@ -0,0 +1,105 @@
+// Spreading work over every processor while boot services are still up,
+// through the firmware's EFI_MP_SERVICES_PROTOCOL.
+//
+// The work is a range of independent items. The boot processor and every
+// application processor take items off a shared counter until it runs out,
+// so uneven items balance themselves. Application processors can't use the
+// console or allocate, so the work functions have to stick to memory that's
+// already theirs and report failures through their argument.
+#include "efi.h"
+#include "efi_lib.h"
+#include "efi_error.h"
+
+extern EFI_BOOT_SERVICES*     g_BootServices;
+
+
+typedef void (*parallel_fn)(void* argument, usize index);
+
+typedef struct Processors
+{
+    EFI_MP_SERVICES_PROTOCOL* mp;     // NULL if there's only the boot processor to use.
+    usize                     count;  // Enabled, including the boot processor.
+    EFI_EVENT                 done;   // Signaled when all application processors have returned.
+} Processors;
+
+typedef struct ParallelJob
+{
+    parallel_fn fn;
+    void*       argument;
+    usize       count;
+    usize       next;       // Taken with atomic increments.
+} ParallelJob;
+
+
+/// Find the MP services. Without them (or with a single enabled processor)
+/// `processors` is still usable, and parallel_for runs everything in place.
+Processors processors_open()
+{
+    Processors processors = { .count=1 };
+
+    EFI_MP_SERVICES_PROTOCOL* mp = NULL;
+    if (g_BootServices->LocateProtocol(&EFI_MP_SERVICES_PROTOCOL_GUID, NULL, (void **) &mp) != EFI_SUCCESS || mp == NULL)
+        return processors;
+
+    UINTN Total   = 0;
+    UINTN Enabled = 0;
+    if (mp->GetNumberOfProcessors(mp, &Total, &Enabled) != EFI_SUCCESS || Enabled < 2)
+        return processors;
+    if (g_BootServices->CreateEvent(0, TPL_CALLBACK, NULL, NULL, NULL, &processors.done) != EFI_SUCCESS)
+        return processors;
+
+    processors.mp    = mp;
+    processors.count = Enabled;
+    return processors;
+}
+
+
+static void parallel_work(ParallelJob* job)
+{
+    for (;;)
+    {
+        usize index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->count)
+            return;
+        job->fn(job->argument, index);
+    }
+}
+
+static void parallel_ap_procedure(void* argument)
+{
+    parallel_work((ParallelJob *) argument);
+}
+
+
+/// Call `fn(argument, i)` for every i in [0, count), spread over all
+/// processors, and return once every call has. With `serial` set (or a
+/// single processor) it's all done on the calling processor, for comparison.
+void parallel_for(const Processors* processors, usize count, parallel_fn fn, void* argument, bool serial)
+{
+    ParallelJob job = { .fn=fn, .argument=argument, .count=count };
+
+    /* Non-blocking, so that the boot processor works through items as well
+     * instead of waiting. Application processors that find the counter
+     * already past the end return straight away.
+     */
+    bool started = 0;
+    if (!serial && processors->mp != NULL && count > 1)
+        started = processors->mp->StartupAllAPs(processors->mp, parallel_ap_procedure, EFI_FALSE, processors->done, 0, &job, NULL) == EFI_SUCCESS;
+
+    parallel_work(&job);
+
+    if (started)
+    {
+        EFI_EVENT Done  = processors->done;
+        UINTN     Index = 0;
+        EFI_ASSERT(g_BootServices->WaitForEvent(1, &Done, &Index));
+    }
+}
+
+
+void processors_close(Processors* processors)
+{
+    if (processors->mp != NULL)
+        EFI_ASSERT(g_BootServices->CloseEvent(processors->done));
+    *processors = (Processors) { .count=1 };
+}
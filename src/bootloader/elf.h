@@ -70,6 +70,19 @@ typedef struct Elf64SectionHeader {
 } __attribute__((packed)) Elf64SectionHeader;
 
 
+typedef struct Elf64Symbol {
+    uint32_t name;              // Offset into the string table the symbol table section links to.
+    uint8_t  info;              // Type in the low 4 bits, binding in the high 4.
+    uint8_t  other;             // Visibility.
+    uint16_t section_index;     // 0 = undefined.
+    uint64_t value;             // Address, for symbols in an executable.
+    uint64_t size;
+} __attribute__((packed)) Elf64Symbol;
+
+#define ELF64_SYMBOL_TYPE(info)    ((info) & 0xF)
+#define ELF64_SYMBOL_BINDING(info) ((info) >> 4)
+
+
 
 
 
@@ -87,6 +100,18 @@ const uint32_t PT_HIOS    = 0x6FFFFFFF;  // Reserved inclusive range. Operating
 const uint32_t PT_LOPROC  = 0x70000000;  // Reserved inclusive range. Processor specific.
 const uint32_t PT_HIPROC  = 0x7FFFFFFF;  // Reserved inclusive range. Processor specific.
 
+// ---- SYMBOL TYPES ----
+const uint8_t STT_NOTYPE  = 0;  // Unspecified.
+const uint8_t STT_OBJECT  = 1;  // Data object.
+const uint8_t STT_FUNC    = 2;  // Function or other executable code.
+const uint8_t STT_SECTION = 3;  // Associated with a section.
+const uint8_t STT_FILE    = 4;  // Name of the source file.
+
+// ---- PROGRAM FLAGS ----
+const uint32_t PF_X = 0x1;  // Executable.
+const uint32_t PF_W = 0x2;  // Writable.
+const uint32_t PF_R = 0x4;  // Readable.
+
 
 // ---- SECTION TYPES ----
 // https://refspecs.linuxfoundation.org/LSB_3.0.0/LSB-PDA/LSB-PDA.junk/sections.html
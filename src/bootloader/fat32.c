@@ -0,0 +1,324 @@
+// A minimal, read-only FAT32 reader on top of EFI_BLOCK_IO_PROTOCOL.
+//
+// Firmware FAT drivers tend to read a cluster or so at a time, which is slow
+// for a kernel of several MiB. This resolves a file's cluster chain once into
+// extents of contiguous clusters, then reads each extent with as few
+// ReadBlocks calls as possible. It only finds files in the root directory by
+// their 8.3 name, which is all the bootloader needs; anything it doesn't
+// understand makes it give up, and the caller falls back to EFI_FILE_PROTOCOL.
+#include "efi.h"
+#include "efi_lib.h"
+#include "efi_error.h"
+
+extern EFI_BOOT_SERVICES*     g_BootServices;
+
+
+#define FAT32_CLUSTER_MASK     0x0FFFFFFF
+#define FAT32_FAT_WINDOW       64                 // Sectors of the FAT kept in memory at a time.
+#define FAT32_TRANSFER_MAX     (8 * 1024 * 1024)  // Bytes per ReadBlocks. Drivers split larger requests themselves, but not all do it well.
+
+#define FAT32_ATTRIBUTE_VOLUME_ID  0x08
+#define FAT32_ATTRIBUTE_DIRECTORY  0x10
+#define FAT32_ATTRIBUTE_LONG_NAME  0x0F
+
+
+// The parts of the BIOS parameter block that are used.
+typedef struct Fat32BootSector
+{
+    u8  jump[3];
+    u8  oem[8];
+    u16 bytes_per_sector;
+    u8  sectors_per_cluster;
+    u16 reserved_sectors;
+    u8  fat_count;
+    u16 root_entries;        // 0 on FAT32.
+    u16 total_sectors_16;
+    u8  media;
+    u16 fat_size_16;         // 0 on FAT32.
+    u16 sectors_per_track;
+    u16 heads;
+    u32 hidden_sectors;
+    u32 total_sectors_32;
+    u32 fat_size_32;
+    u16 flags;
+    u16 version;
+    u32 root_cluster;
+} __attribute__((packed)) Fat32BootSector;
+
+typedef struct Fat32DirectoryEntry
+{
+    u8  name[11];
+    u8  attributes;
+    u8  reserved[8];
+    u16 cluster_high;
+    u8  times[4];
+    u16 cluster_low;
+    u32 size;
+} __attribute__((packed)) Fat32DirectoryEntry;
+
+
+typedef struct Fat32Volume
+{
+    EFI_BLOCK_IO_PROTOCOL* io;
+    u32 media_id;
+    u32 sector_size;          // Same as the block size; other volumes aren't supported.
+    u32 sectors_per_cluster;
+    u64 fat_sector;           // First sector of the first FAT.
+    u32 fat_sectors;
+    u64 data_sector;          // Sector of cluster 2.
+    u32 root_cluster;
+    u32 cluster_count;
+    u64 transfer_sectors;     // Most sectors per ReadBlocks.
+    u8* fat_window;           // FAT32_FAT_WINDOW sectors of the FAT,
+    u64 fat_window_start;     // starting at this one (relative to fat_sector), or ~0.
+} Fat32Volume;
+
+// A run of contiguous clusters, in sectors.
+typedef struct Fat32Extent
+{
+    u64 sector;
+    u64 sectors;
+} Fat32Extent;
+
+
+static bool fat32_read_sectors(const Fat32Volume* volume, u64 sector, u64 count, void* destination)
+{
+    return volume->io->ReadBlocks(volume->io, volume->media_id, sector, count * volume->sector_size, destination) == EFI_SUCCESS;
+}
+
+
+/// Check that the volume on `device` is FAT32 this reader can handle, and
+/// fill in `volume` if it is.
+bool fat32_open(Fat32Volume* volume, EFI_HANDLE device)
+{
+    EFI_BLOCK_IO_PROTOCOL* io = NULL;
+    if (g_BootServices->HandleProtocol(device, &EFI_BLOCK_IO_PROTOCOL_GUID, (void **) &io) != EFI_SUCCESS || io == NULL)
+        return 0;
+
+    const EFI_BLOCK_IO_MEDIA* media = io->Media;
+    if (!media->MediaPresent || media->BlockSize < 512 || media->BlockSize > PAGE_SIZE || media->IoAlign > PAGE_SIZE)
+        return 0;
+
+    u8* sector = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, media->BlockSize, (void **) &sector));
+    bool read = io->ReadBlocks(io, media->MediaId, 0, media->BlockSize, sector) == EFI_SUCCESS;
+
+    Fat32BootSector boot;
+    memcpy(&boot, sector, sizeof(boot));
+    bool has_signature = sector[510] == 0x55 && sector[511] == 0xAA;
+    EFI_ASSERT(g_BootServices->FreePool(sector));
+
+    if (!read || !has_signature || boot.bytes_per_sector != media->BlockSize || boot.fat_size_16 != 0 || boot.root_entries != 0)
+        return 0;
+    if (boot.sectors_per_cluster == 0 || (boot.sectors_per_cluster & (boot.sectors_per_cluster - 1)) != 0 || boot.fat_count == 0 || boot.fat_size_32 == 0)
+        return 0;
+
+    u64 data_sector  = boot.reserved_sectors + (u64) boot.fat_count * boot.fat_size_32;
+    u64 total        = boot.total_sectors_32 ? boot.total_sectors_32 : boot.total_sectors_16;
+    if (total <= data_sector)
+        return 0;
+
+    u64 transfer = FAT32_TRANSFER_MAX / media->BlockSize;
+    if (io->Revision >= EFI_BLOCK_IO_PROTOCOL_REVISION3 && media->OptimalTransferLengthGranularity > 0 && transfer > media->OptimalTransferLengthGranularity)
+        transfer -= transfer % media->OptimalTransferLengthGranularity;
+
+    *volume = (Fat32Volume) {
+        .io=io,
+        .media_id=media->MediaId,
+        .sector_size=media->BlockSize,
+        .sectors_per_cluster=boot.sectors_per_cluster,
+        .fat_sector=boot.reserved_sectors,
+        .fat_sectors=boot.fat_size_32,
+        .data_sector=data_sector,
+        .root_cluster=boot.root_cluster,
+        .cluster_count=(u32) ((total - data_sector) / boot.sectors_per_cluster),
+        .transfer_sectors=transfer,
+        .fat_window_start=~0ULL,
+    };
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, FAT32_FAT_WINDOW * volume->sector_size, (void **) &volume->fat_window));
+    return 1;
+}
+
+
+void fat32_close(Fat32Volume* volume)
+{
+    if (volume->fat_window)
+        EFI_ASSERT(g_BootServices->FreePool(volume->fat_window));
+    *volume = (Fat32Volume) { 0 };
+}
+
+
+/// The cluster after `cluster` in its chain, or 0 if the FAT couldn't be read.
+static u32 fat32_next_cluster(Fat32Volume* volume, u32 cluster)
+{
+    u64 offset = (u64) cluster * 4;
+    u64 sector = offset / volume->sector_size;
+    if (sector >= volume->fat_sectors)
+        return 0;
+
+    if (sector < volume->fat_window_start || sector >= volume->fat_window_start + FAT32_FAT_WINDOW)
+    {
+        u64 count = volume->fat_sectors - sector < FAT32_FAT_WINDOW ? volume->fat_sectors - sector : FAT32_FAT_WINDOW;
+        if (!fat32_read_sectors(volume, volume->fat_sector + sector, count, volume->fat_window))
+            return 0;
+        volume->fat_window_start = sector;
+    }
+
+    u32 next;
+    memcpy(&next, volume->fat_window + (offset - volume->fat_window_start * volume->sector_size), sizeof(next));
+    return next & FAT32_CLUSTER_MASK;
+}
+
+static u64 fat32_cluster_sector(const Fat32Volume* volume, u32 cluster)
+{
+    return volume->data_sector + (u64) (cluster - 2) * volume->sectors_per_cluster;
+}
+
+static bool fat32_is_cluster(const Fat32Volume* volume, u32 cluster)
+{
+    return cluster >= 2 && cluster - 2 < volume->cluster_count;
+}
+
+
+/// Turn "kernel" into "KERNEL     " and "a.txt" into "A       TXT". False if
+/// `name` doesn't fit in 8.3.
+static bool fat32_short_name(const char* name, u8 short_name[11])
+{
+    memset(short_name, ' ', 11);
+
+    usize i = 0;
+    usize j = 0;
+    for (; name[i] && name[i] != '.'; ++i, ++j)
+    {
+        if (j == 8)
+            return 0;
+        short_name[j] = (u8) ((name[i] >= 'a' && name[i] <= 'z') ? name[i] - 'a' + 'A' : name[i]);
+    }
+    if (name[i] == '.')
+        ++i;
+    for (j = 8; name[i]; ++i, ++j)
+    {
+        if (j == 11 || name[i] == '.')
+            return 0;
+        short_name[j] = (u8) ((name[i] >= 'a' && name[i] <= 'z') ? name[i] - 'a' + 'A' : name[i]);
+    }
+    return short_name[0] != ' ';
+}
+
+
+/// Look `name` up in the root directory. False if it isn't there, isn't a
+/// plain file, or the directory couldn't be read.
+bool fat32_find(Fat32Volume* volume, const char* name, u32* first_cluster, u32* size)
+{
+    u8 short_name[11];
+    if (!fat32_short_name(name, short_name))
+        return 0;
+
+    usize cluster_size = volume->sectors_per_cluster * volume->sector_size;
+    u8*   directory    = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, cluster_size, (void **) &directory));
+
+    bool found = 0;
+    bool done  = 0;
+    u32  limit = volume->cluster_count;
+    for (u32 cluster = volume->root_cluster; !done && fat32_is_cluster(volume, cluster) && limit--; cluster = fat32_next_cluster(volume, cluster))
+    {
+        if (!fat32_read_sectors(volume, fat32_cluster_sector(volume, cluster), volume->sectors_per_cluster, directory))
+            break;
+
+        for (usize offset = 0; offset < cluster_size; offset += sizeof(Fat32DirectoryEntry))
+        {
+            const Fat32DirectoryEntry* entry = (const Fat32DirectoryEntry *) (directory + offset);
+            if (entry->name[0] == 0x00)
+            {
+                done = 1;
+                break;
+            }
+            if (entry->name[0] == 0xE5 || entry->attributes == FAT32_ATTRIBUTE_LONG_NAME)
+                continue;
+            if (entry->attributes & (FAT32_ATTRIBUTE_VOLUME_ID | FAT32_ATTRIBUTE_DIRECTORY))
+                continue;
+            usize matching = 0;
+            while (matching < sizeof(short_name) && entry->name[matching] == short_name[matching])
+                ++matching;
+            if (matching != sizeof(short_name))
+                continue;
+
+            *first_cluster = ((u32) entry->cluster_high << 16) | entry->cluster_low;
+            *size          = entry->size;
+            found = 1;
+            done  = 1;
+            break;
+        }
+    }
+
+    EFI_ASSERT(g_BootServices->FreePool(directory));
+    return found;
+}
+
+
+/// Walk the chain from `first_cluster` far enough to hold `size` bytes, and
+/// merge runs of consecutive clusters into extents. `extents` is allocated
+/// from the pool. False if the chain is broken or too short.
+bool fat32_extents(Fat32Volume* volume, u32 first_cluster, u64 size, Fat32Extent** extents, usize* count)
+{
+    u64 cluster_size = (u64) volume->sectors_per_cluster * volume->sector_size;
+    u64 clusters     = (size + cluster_size - 1) / cluster_size;
+    *extents = NULL;
+    *count   = 0;
+    if (clusters == 0)
+        return 1;
+
+    // At worst every cluster is its own extent.
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, clusters * sizeof(Fat32Extent), (void **) extents));
+
+    u32 cluster = first_cluster;
+    for (u64 i = 0; i < clusters; ++i)
+    {
+        if (!fat32_is_cluster(volume, cluster))
+        {
+            EFI_ASSERT(g_BootServices->FreePool(*extents));
+            *extents = NULL;
+            *count   = 0;
+            return 0;
+        }
+
+        u64 sector = fat32_cluster_sector(volume, cluster);
+        Fat32Extent* last = *count ? &(*extents)[*count - 1] : NULL;
+        if (last && last->sector + last->sectors == sector)
+            last->sectors += volume->sectors_per_cluster;
+        else
+            (*extents)[(*count)++] = (Fat32Extent) { .sector=sector, .sectors=volume->sectors_per_cluster };
+
+        if (i + 1 < clusters)
+            cluster = fat32_next_cluster(volume, cluster);
+    }
+
+    return 1;
+}
+
+
+/// Read the first `size` bytes described by `extents` into `destination`,
+/// which must have room for `size` rounded up to whole sectors and be
+/// aligned to the device's IoAlign (page aligned always is).
+bool fat32_read_extents(const Fat32Volume* volume, const Fat32Extent* extents, usize count, u8* destination, u64 size)
+{
+    u64 remaining = (size + volume->sector_size - 1) / volume->sector_size;
+    for (usize i = 0; i < count && remaining > 0; ++i)
+    {
+        u64 sector  = extents[i].sector;
+        u64 sectors = extents[i].sectors < remaining ? extents[i].sectors : remaining;
+        remaining -= sectors;
+
+        while (sectors > 0)
+        {
+            u64 transfer = sectors < volume->transfer_sectors ? sectors : volume->transfer_sectors;
+            if (!fat32_read_sectors(volume, sector, transfer, destination))
+                return 0;
+            sector      += transfer;
+            sectors     -= transfer;
+            destination += transfer * volume->sector_size;
+        }
+    }
+    return remaining == 0;
+}
@@ -0,0 +1,81 @@
+#include "crc32c.h"
+#include "bit.h"
+#include "x86_64/x86_64.h"
+#include "x86_64/cpu.h"
+
+
+typedef u32 (*crc32c_update_fn)(u32 crc, const u8* data, usize size);
+
+static u32 crc32c_update_software(u32 crc, const u8* data, usize size);
+static u32 crc32c_update_hardware(u32 crc, const u8* data, usize size);
+
+typedef struct Crc32cVariant
+{
+    CpuVariant       variant;
+    crc32c_update_fn update;
+} Crc32cVariant;
+
+static const Crc32cVariant CRC32C_VARIANTS[] = {
+    { { "sse4.2", CPU_FEATURE_BIT(SSE4_2) }, crc32c_update_hardware },
+    { { "table",  0                       }, crc32c_update_software },
+};
+
+static crc32c_update_fn g_crc32c_update = crc32c_update_software;
+static u32              g_crc32c_table[256];
+
+
+/// Pick the SSE4.2 instruction if the CPU has it, and build the table for
+/// the fallback either way.
+void crc32c_init()
+{
+    g_crc32c_update = CPU_DISPATCH("crc32c", CRC32C_VARIANTS)->update;
+
+    for (u32 i = 0; i < 256; ++i)
+    {
+        u32 crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+        g_crc32c_table[i] = crc;
+    }
+}
+
+
+bool crc32c_is_hardware()
+{
+    return g_crc32c_update == crc32c_update_hardware;
+}
+
+
+static u32 crc32c_update_software(u32 crc, const u8* data, usize size)
+{
+    while (size--)
+        crc = (crc >> 8) ^ g_crc32c_table[(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+
+/// The crc32 instruction works on general purpose registers, so it's fine
+/// to use with -mgeneral-regs-only. Eight bytes per instruction, with the
+/// unaligned head and tail done a byte at a time.
+static u32 crc32c_update_hardware(u32 crc, const u8* data, usize size)
+{
+    for (; size && ((usize) data & 7); --size)
+        __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(*data++));
+
+    u64 wide = crc;
+    for (; size >= sizeof(u64); size -= sizeof(u64), data += sizeof(u64))
+        __asm__("crc32q %1, %0" : "+r"(wide) : "rm"(*(const u64 *) data));
+    crc = (u32) wide;
+
+    while (size--)
+        __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(*data++));
+    return crc;
+}
+
+
+/// Continue a CRC over `size` more bytes. Chunks can be fed in as they
+/// arrive; the result is the same as over the whole message at once.
+u32 crc32c_update(u32 crc, const void* data, usize size)
+{
+    return g_crc32c_update(crc, (const u8 *) data, size);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "types.h"
+
+// CRC32C (Castagnoli), the polynomial SSE4.2 has an instruction for.
+#define CRC32C_POLYNOMIAL 0x82F63B78  // Reflected.
+#define CRC32C_INITIAL    0xFFFFFFFF
+
+void crc32c_init();
+u32  crc32c_update(u32 crc, const void* data, usize size);
+bool crc32c_is_hardware();
+
+// The CRC of a message is crc32c_update from CRC32C_INITIAL, inverted.
+#define CRC32C_FINAL(crc) ((crc) ^ 0xFFFFFFFF)
@@ -15,6 +15,11 @@ int load_elf64(const uint8_t* data)
     if (!is_elf64(data))
         return ELF_ERROR;
 
+    // Program headers are walked as an array of our struct, so a different
+    // stride would read them misaligned.
+    if (((const Elf64Header*) data)->program_header_entry_size != sizeof(Elf64ProgramHeader))
+        return ELF_ERROR;
+
     uint64_t page_size = getpagesize();
 
     const Elf64Header*        header   = (Elf64Header*) data;
@@ -9,13 +9,29 @@
 #include "renderer.c"
 #include "maths.c"
 #include "string.c"
-//#include "allocator.c"
-#define PAGE_SIZE 4096
+#include "allocator.c"
+#include "symbols.c"
+#include "boot_archive.c"
+#include "memory_regions.c"
+#include "kexec.c"
+#include "x86_64/serial.c"
+#include "x86_64/cpu.c"
+
+// Generated by `make font` (see bin/psf2c.c), which the kernel then uses
+// instead of the font from the bootloader.
+#if defined(KERNEL_BUILTIN_FONT) && KERNEL_BUILTIN_FONT == 1
+#include "builtin_font.h"
+#endif
+
 
 #define IN
 #define OUT
 #define OPTIONAL
 
+// Reserved up front, but only backed by frames as the pages are touched.
+#define KERNEL_HEAP_BASE 0xFFFFC90000000000ULL
+#define KERNEL_HEAP_SIZE (1ULL << 30)
+
 
 // ---- Bit hacks ----
 // https://www.youtube.com/watch?v=ZRNO-ewsNcQ
@@ -56,6 +72,9 @@ Pixel      g_text_color = { 0xFF, 0xFF, 0xFF, 0xFF };
 
 
 /* ---- RENDERER ---- */
+// printf reaches these from exception handlers (panics, backtraces), which
+// don't save vector registers, so they use the general register variants
+// rather than the dispatched memcpy and memset (see memory.h).
 inline void draw(Pixel pixel, int row, int col)
 {
     g_graphics->base[g_graphics->pixels_per_scanline * row + col] = pixel;
@@ -63,6 +82,13 @@ inline void draw(Pixel pixel, int row, int col)
 
 void fill(Pixel pixel)
 {
+    // Black, like any pixel of four equal bytes, is a plain memset.
+    if (pixel.blue == pixel.green && pixel.green == pixel.red && pixel.red == pixel.alpha)
+    {
+        memset_general(g_graphics->base, pixel.blue, g_graphics->size);
+        return;
+    }
+
     for (u64 i = 0; i < g_graphics->size / sizeof(Pixel); ++i)
         g_graphics->base[i] = pixel;
 }
@@ -85,20 +111,15 @@ void newline()
             {
                 int row_above_index   = (row+y)          * width;
                 int row_current_index = (row+y+row_step) * width;
-                for (int col = 0; col < width; ++col)
-                {
-                    g_graphics->base[row_above_index+col] = g_graphics->base[row_current_index+col];
-                }
+                memcpy_general(&g_graphics->base[row_above_index], &g_graphics->base[row_current_index], (usize) width * sizeof(Pixel));
             }
         }
 
+        // BLACK is all zero bytes.
         for (int y = 0; y < height-row; ++y)
         {
             int row_current_index = (row+y+row_step) * width;
-            for (int col = 0; col < width; ++col)
-            {
-                g_graphics->base[row_current_index+col] = BLACK;
-            }
+            memset_general(&g_graphics->base[row_current_index], 0, (usize) width * sizeof(Pixel));
         }
 
         g_cursor->row -= row_step;
@@ -117,8 +138,47 @@ void advance_cursor(int step)
 }
 
 
+#if defined(BUILTIN_FONT_MASKS)
+/// Draw a glyph of the built-in font at scale 1 a row of pixels at a time,
+/// background included, from its pre-expanded masks. Cells are exactly as
+/// wide as glyphs and newline() clears to black, so it looks the same as
+/// drawing only the set pixels.
+static void print_char_masked(char character)
+{
+    u32 foreground = 0;
+    u32 background = 0;
+    memcpy_general(&foreground, &g_text_color, sizeof(u32));
+    memcpy_general(&background, &BLACK, sizeof(u32));
+
+    const u64* rows = builtin_font_masks + (u8) character * BUILTIN_FONT_HEIGHT;
+    for (int row = 0; row < BUILTIN_FONT_HEIGHT; ++row)
+    {
+        u32* line  = (u32 *) (g_graphics->base + (u64) g_graphics->pixels_per_scanline * (u64) (g_cursor->row + row) + (u64) g_cursor->col);
+        u64  lanes = rows[row];
+        for (int col = 0; col < 8; ++col)
+        {
+            u32 mask = (u32) (i32) (i8) (u8) (lanes >> (8 * col));
+            line[col] = (foreground & mask) | (background & ~mask);
+        }
+    }
+
+    advance_cursor(1);
+}
+#endif
+
+
 void print_char(char character)
 {
+    serial_write_char(character);
+
+#if defined(BUILTIN_FONT_MASKS)
+    if (g_font->glyphs == builtin_font_glyphs && g_font->scale == 1)
+    {
+        print_char_masked(character);
+        return;
+    }
+#endif
+
     u8* glyph = g_font->glyphs + (character * g_font->header.font_height);
     for (int row = 0; row < 16; ++row)
     {
@@ -145,8 +205,8 @@ int printf(const char* format, ...)
     {
         switch (*character)
         {
-            case '\t': advance_cursor(4); break;
-            case '\n': newline(); break;
+            case '\t': serial_write_char('\t'); advance_cursor(4); break;
+            case '\n': serial_write_char('\n'); newline(); break;
             case '\\':
                 if (*(character+1) == 'e')
                 {
@@ -342,29 +402,148 @@ During boot services time the processor is in the following execution mode:
 • CR0.EM must be zero
 • CR0.TS must be zero
  */
-#include "idt.c"
-extern void x86_64_interrupt(int);
+#include "x86_64/idt.c"
+extern void  load_gdt(void* descriptor);
+extern void* get_descriptor();
+
+
+// QEMU exits with status (QEMU_DEBUG_EXIT_VALUE << 1) | 1 when it's written.
+#define QEMU_DEBUG_EXIT_PORT  0xF4
+#define QEMU_DEBUG_EXIT_VALUE 0x10
+
+
+/// Print the timeline in the format described in boot_timeline.h.
+static void boot_timeline_print(const BootTimeline* timeline)
+{
+    printf("boot-timeline tsc-hz %zu\n", (usize) timeline->tsc_hz);
+
+    u64 previous = 0;
+    for (u32 i = 0; i < timeline->count; ++i)
+    {
+        const BootPhase* phase = &timeline->phases[i];
+        u64 cycles       = phase->end - previous;
+        u64 microseconds = timeline->tsc_hz ? cycles * 1000000 / timeline->tsc_hz : 0;
+        printf("boot-phase %d %s %zu %zu\n", (int) i, phase->name, (usize) cycles, (usize) microseconds);
+        previous = phase->end;
+    }
+}
+
+
+/// Vendor, features, caches, and what the dispatched primitives are bound to.
+static void cpu_print(const Cpu* cpu)
+{
+    printf("CPU: %s family %x model %x stepping %d\n", cpu->vendor_name, (u64) cpu->family, (u64) cpu->model, (int) cpu->stepping);
+
+    printf("CPU features:");
+    for (int i = 0; i < CPU_FEATURE_COUNT; ++i)
+    {
+        if (cpu_has((CpuFeature) i))
+            printf(" %s", cpu_feature_name((CpuFeature) i));
+    }
+    printf("\n");
+
+    for (u32 i = 0; i < cpu->cache_count; ++i)
+    {
+        const CpuCache* cache = &cpu->caches[i];
+        printf("CPU cache: L%d%s %zu KiB, %d-way, %d byte lines, shared by %d\n", (int) cache->level, cpu_cache_type_name(cache->type), (usize) cache->size / 1024, (int) cache->ways, (int) cache->line_size, (int) cache->shared_by);
+    }
+
+    usize count;
+    const CpuBinding* bindings = cpu_bindings(&count);
+    for (usize i = 0; i < count; ++i)
+        printf("Dispatch: %s -> %s\n", bindings[i].primitive, bindings[i].variant);
+}
 
 
 int _start(Context* context)
 {
     // ---- INITIALIZATION START ---
+    boot_timeline_mark(&context->timeline, "kernel-entry");
+    serial_init();
+    cpu_init();
+    memory_primitives_init();
+
+    // Until idt_install() the bootloader's page fault handler serves the
+    // first touches of .bss, so hand ours the same pager before switching.
+    demand_pager_install(&context->pager);
+    symbol_table_install(&context->symbols);
+
     Cursor cursor = { 0, 0 };
 
     g_cursor   = &cursor;
     g_graphics = &context->graphics;
     g_font     = &context->font;
 
+    // Not put in the context, which kexec hands over to a kernel that would
+    // overwrite the glyphs when it's loaded.
+#if defined(KERNEL_BUILTIN_FONT) && KERNEL_BUILTIN_FONT == 1
+    PSF1_Font builtin_font = { .header=builtin_font_header, .scale=1, .glyphs=(u8 *) builtin_font_glyphs };
+    g_font = &builtin_font;
+#endif
+    // Nothing can be printed without a font, not even a panic.
+    while (g_font->glyphs == NULL)
+        __asm__ __volatile__("hlt");
+
     load_gdt(get_descriptor());
     idt_install();
+    demand_pager_reserve(&context->pager, LAZY_REGION_HEAP, KERNEL_HEAP_BASE, KERNEL_HEAP_SIZE);
 
-    x86_64_interrupt(3);
+    x86_64_interrupt_3();
+    boot_timeline_mark(&context->timeline, "kernel-interrupts");
 
     fill(BLACK);
+    boot_timeline_mark(&context->timeline, "kernel-clear-screen");
 //    PageAllocator allocator = memory_map(&context->memory);
 //    printf("Allocator: { base=%zx, size=%zx }\n", (usize) allocator.base, (usize) allocator.size);
 
-    printf("%s\n", test);
+    cpu_print(cpu_get());
+    printf("Paging: %d levels, direct map at %x\n", context->page_map.levels, context->direct_map_base);
+    usize promoted = page_map_promote(&context->page_map);
+    printf("Page tables: %zu used, %zu KiB reserved, %zu promoted to 2 MiB pages\n", context->page_tables.tables_used, (context->page_tables.pages_reserved * PAGE_SIZE) / 1024, promoted);
+
+    const Symbol* entry = symbol_table_find_name(&context->symbols, "_start");
+    printf("Symbols: %d functions, _start at %x\n", (int) context->symbols.count, entry ? entry->address : 0);
+
+    for (u16 i = 0; i < context->archive.count; ++i)
+    {
+        const BootArchiveEntry* file = &context->archive.entries[i];
+        char name[BOOT_ARCHIVE_NAME_SIZE + 1] = { 0 };
+        memcpy(name, file->name, BOOT_ARCHIVE_NAME_SIZE);
+        printf("Boot archive: %s, %zu bytes at %x\n", name, (usize) file->size, (u64) boot_archive_data(&context->archive, file));
+    }
+
+    static const char* MEMORY_REGION_NAMES[] = { "usable", "reclaimable", "reserved", "acpi", "mmio", "framebuffer" };
+    u64 region_bytes[MEMORY_REGION_TYPE_COUNT] = { 0 };
+    for (usize i = 0; i < context->regions.count; ++i)
+        region_bytes[context->regions.regions[i].type] += context->regions.regions[i].end - context->regions.regions[i].start;
+    printf("Memory regions: %zu, %zu KiB usable, %zu KiB reclaimable\n", context->regions.count, (usize) (region_bytes[MEMORY_REGION_USABLE] / 1024), (usize) (region_bytes[MEMORY_REGION_RECLAIMABLE] / 1024));
+
+    const MemoryRegion* framebuffer_region = memory_regions_find(&context->regions, (u64) context->graphics.base);
+    printf("Framebuffer at %x is %s\n", (u64) context->graphics.base, framebuffer_region ? MEMORY_REGION_NAMES[framebuffer_region->type] : "undescribed");
+
+    // Faults drive the pager's ticks, so force one for an up to date sample.
+    demand_pager_tick(&context->pager);
+    boot_timeline_mark(&context->timeline, "kernel-init");
+    boot_timeline_print(&context->timeline);
+
+    // Alongside the timeline, for bin/boot-bench.py to track.
+    usize faults = 0;
+    for (usize i = 0; i < context->pager.region_count; ++i)
+        faults += context->pager.regions[i].faults;
+    printf("boot-metric page-tables %zu\n", context->page_tables.tables_used);
+    printf("boot-metric promoted-pages %zu\n", promoted);
+    printf("boot-metric demand-faults %zu\n", faults);
+    printf("boot-metric pager-ticks %zu\n", context->pager.ticks);
+    printf("boot-metric usable-kib %zu\n", (usize) (region_bytes[MEMORY_REGION_USABLE] / 1024));
+
+    static const char* LAZY_REGION_NAMES[] = { "heap", "bss" };
+    for (usize i = 0; i < context->pager.region_count; ++i)
+    {
+        const LazyRegion* region = &context->pager.regions[i];
+        printf("Lazy region %s: %x - %x, %zu faults, %zu accessed, %zu dirty, %s\n",
+               LAZY_REGION_NAMES[region->kind], region->start, region->end, region->faults,
+               region->accessed, region->dirty, LAZY_REGION_IS_COLD(region) ? "cold" : "hot");
+    }
 
     printf(
         "Testing:\n\t" ANSI_COLOR_CODE_RED "c: %c" ANSI_COLOR_CODE_NORMAL "\n\td: %d\n\td: %d\n\ts: %s\n\tx: %x\n\tz: %d\n\tz: %d\n\tzu: %d\n",
@@ -387,6 +566,19 @@ int _start(Context* context)
     );
 
 
+    // A kernel.next in the boot archive is started once, instead of going
+    // through a reboot and the firmware again.
+    const BootArchiveEntry* next = boot_archive_find(&context->archive, KEXEC_NEXT_KERNEL_NAME);
+    if (next && context->generation == 0)
+        kexec(context, boot_archive_data(&context->archive, next), next->size);
+
+    // Ends a headless run. Only built in by `make bench`, since on anything
+    // but QEMU with -device isa-debug-exit,iobase=0xf4 the port is some
+    // other device's.
+#if defined(KERNEL_BENCH_EXIT) && KERNEL_BENCH_EXIT == 1
+    x86_64_out8(QEMU_DEBUG_EXIT_PORT, QEMU_DEBUG_EXIT_VALUE);
+#endif
+
 //    debug_break();
     for (usize i = 0; i < context->graphics.size / sizeof(Pixel); ++i)
     {
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.h"
+
+// ---- PACKED KERNEL ----
+// The bootloader loads either a plain ELF kernel, or one whose PT_LOAD
+// payloads are LZ4 compressed by bin/kpack.c, which is far less to read
+// from slow boot media. The packed file is laid out as
+//
+//   KernelPackHeader
+//   KernelPackSegment[segment_count]   One per PT_LOAD, in order.
+//   KernelPackExtent[extent_count]     Parts of the ELF kept as they are.
+//   Extents                            The ELF and program headers, the
+//                                      section headers and the symbol table.
+//   Payloads                           Per segment: a u32 size per block,
+//                                      followed by the blocks.
+//
+// Blocks are compressed independently, so that each can be decompressed
+// straight into its destination as soon as it's read. Every block but the
+// last of a segment holds block_size bytes of the segment's file data.
+#define KERNEL_PACK_MAGIC        0x345A4C4B  // "KLZ4"
+#define KERNEL_PACK_VERSION      2
+#define KERNEL_PACK_BLOCK_SIZE   (64 * 1024)
+#define KERNEL_PACK_BLOCK_STORED (1U << 31)  // The block didn't compress and is stored as is.
+
+typedef struct KernelPackHeader
+{
+    u32 magic;
+    u16 version;
+    u16 segment_count;
+    u32 block_size;
+    u32 extent_count;
+} __attribute__((packed)) KernelPackHeader;
+
+typedef struct KernelPackSegment
+{
+    u64 file_offset;    // Of the PT_LOAD in the original ELF.
+    u64 file_size;      // Uncompressed.
+    u64 packed_offset;  // Of the block size table, from the start of the packed file.
+    u64 packed_size;    // Block size table and blocks.
+} __attribute__((packed)) KernelPackSegment;
+
+// A range of the original ELF, stored uncompressed at `packed_offset`.
+typedef struct KernelPackExtent
+{
+    u64 file_offset;
+    u64 size;
+    u64 packed_offset;
+} __attribute__((packed)) KernelPackExtent;
+
+#define KERNEL_PACK_TABLES_SIZE(header) (sizeof(KernelPackHeader) + (header)->segment_count * sizeof(KernelPackSegment) + (header)->extent_count * sizeof(KernelPackExtent))
+#define KERNEL_PACK_BLOCKS(size, block_size) (((size) + (block_size) - 1) / (block_size))
+
+
+// ---- DIGEST ----
+// The sidecar file next to the kernel holds a CRC32C, as 8 hex digits, of
+// the ELF header, the program headers and the file data of every PT_LOAD,
+// in that order. That's what the bootloader reads whether the kernel is
+// packed or not, so it's checked as the kernel streams in rather than in a
+// pass of its own. bin/kcrc.c writes it.
+#define KERNEL_DIGEST_FILE_NAME "kernel.crc"
@@ -0,0 +1,242 @@
+#include "kexec.h"
+#include "elf.h"
+#include "kernel_pack.h"
+#include "lz4.c"
+
+
+/* Copied to an identity mapped page and called as
+ *     trampoline(Context* context, PageTable* root, u64 entry)
+ * so that it keeps running across the CR3 switch. If the new kernel returns,
+ * it's halted there.
+ */
+static const u8 KEXEC_TRAMPOLINE[] = {
+    0xFA,                    // cli
+    0x0F, 0x22, 0xDE,        // mov cr3, rsi
+    0x48, 0x83, 0xEC, 0x08,  // sub rsp, 8       (the entry expects a call's alignment)
+    0xFF, 0xD2,              // call rdx         (rdi still holds the context)
+    0xF4,                    // hlt
+    0xEB, 0xFD,              // jmp hlt
+};
+
+typedef void (*kexec_trampoline_fn)(Context* context, PageTable* root, u64 entry);
+
+
+typedef struct KexecImage
+{
+    const u8*                image;
+    u64                      size;
+    const KernelPackHeader*  pack;      // NULL for a plain ELF.
+    const KernelPackSegment* segments;
+    const KernelPackExtent*  extents;
+} KexecImage;
+
+
+/// `size` bytes of the ELF at `offset`, in place. NULL if they aren't in the
+/// image (or, when it's packed, in one of the extents it kept).
+static const void* kexec_image_elf(const KexecImage* image, u64 offset, u64 size)
+{
+    if (!image->pack)
+        return offset + size <= image->size ? image->image + offset : NULL;
+
+    for (u32 i = 0; i < image->pack->extent_count; ++i)
+    {
+        const KernelPackExtent* extent = &image->extents[i];
+        if (offset >= extent->file_offset && offset + size <= extent->file_offset + extent->size)
+            return image->image + extent->packed_offset + (offset - extent->file_offset);
+    }
+    return NULL;
+}
+
+
+/// Copy segment data that the new kernel, not this one, reads next: whole
+/// pages around the cache when `destination` is page aligned, then the rest.
+static void kexec_copy(u8* destination, const u8* source, usize size)
+{
+    usize pages = (usize) destination % PAGE_SIZE == 0 ? size / PAGE_SIZE : 0;
+    copy_pages(destination, source, pages);
+    memcpy(destination + pages * PAGE_SIZE, source + pages * PAGE_SIZE, size - pages * PAGE_SIZE);
+}
+
+
+/// Put the file data of the `index`th PT_LOAD at `destination`.
+static bool kexec_image_segment(const KexecImage* image, usize index, const Elf64ProgramHeader* program, u8* destination)
+{
+    if (!image->pack)
+    {
+        const u8* data = kexec_image_elf(image, program->file_offset, program->file_size);
+        if (!data)
+            return 0;
+        kexec_copy(destination, data, program->file_size);
+        return 1;
+    }
+
+    if (index >= image->pack->segment_count)
+        return 0;
+    const KernelPackSegment* segment = &image->segments[index];
+    if (segment->file_offset != program->file_offset || segment->file_size != program->file_size || segment->packed_offset + segment->packed_size > image->size)
+        return 0;
+
+    usize     block_size = image->pack->block_size;
+    usize     blocks     = KERNEL_PACK_BLOCKS(segment->file_size, block_size);
+    const u8* sizes      = image->image + segment->packed_offset;
+    const u8* block      = sizes + blocks * sizeof(u32);
+    const u8* end        = image->image + segment->packed_offset + segment->packed_size;
+    u64       remaining  = segment->file_size;
+    for (usize i = 0; i < blocks; ++i)
+    {
+        u32 packed;
+        memcpy(&packed, sizes + i * sizeof(u32), sizeof(packed));
+
+        usize expected = remaining < block_size ? (usize) remaining : block_size;
+        usize stored   = packed & ~KERNEL_PACK_BLOCK_STORED;
+        if (stored > (usize) (end - block))
+            return 0;
+
+        if (packed & KERNEL_PACK_BLOCK_STORED)
+        {
+            if (stored != expected)
+                return 0;
+            kexec_copy(destination, block, stored);
+        }
+        else if (lz4_decompress_block(block, stored, destination, expected) != (i64) expected)
+        {
+            return 0;
+        }
+
+        block       += stored;
+        destination += expected;
+        remaining   -= expected;
+    }
+    return block == end;
+}
+
+
+/// Contiguous, zeroed frames from the page allocator, or NULL (with the
+/// reason printed) if there's no run of `count` free frames.
+static u8* kexec_request_frames(PageAllocator* allocator, usize count)
+{
+    u8* frames = page_allocator_find_free_pages(allocator, count);
+    if (!frames)
+    {
+        printf("kexec: out of memory for %zu frames\n", count);
+        return NULL;
+    }
+    page_allocator_lock_pages(allocator, frames, count);
+    clear_pages(frames, count);
+    return frames;
+}
+
+
+/// Load the kernel in `image` and jump to it. Only returns, with the reason
+/// printed, if the image can't be used, in which case nothing has changed
+/// but some frames have been taken from the allocator.
+bool kexec(Context* context, const u8* image, u64 size)
+{
+    KexecImage kernel = { .image=image, .size=size };
+
+    const KernelPackHeader* pack = (const KernelPackHeader *) image;
+    if (size >= sizeof(KernelPackHeader) && pack->magic == KERNEL_PACK_MAGIC)
+    {
+        if (pack->version != KERNEL_PACK_VERSION || pack->block_size == 0 || pack->block_size >= KERNEL_PACK_BLOCK_STORED || KERNEL_PACK_TABLES_SIZE(pack) > size)
+        {
+            printf("kexec: unsupported packed kernel\n");
+            return 0;
+        }
+        kernel.pack     = pack;
+        kernel.segments = (const KernelPackSegment *) (pack + 1);
+        kernel.extents  = (const KernelPackExtent *) (kernel.segments + pack->segment_count);
+    }
+
+    const Elf64Header* header = kexec_image_elf(&kernel, 0, sizeof(Elf64Header));
+    if (!header || is_elf64((const u8 *) header) != ELF_YES || header->entry_point < KERNEL_VIRTUAL_BASE ||
+        header->program_header_entry_size != sizeof(Elf64ProgramHeader))
+    {
+        printf("kexec: not a higher half 64-bit ELF\n");
+        return 0;
+    }
+
+    const Elf64ProgramHeader* programs = kexec_image_elf(&kernel, header->program_header_offset, header->program_header_entries * sizeof(Elf64ProgramHeader));
+    if (!programs)
+    {
+        printf("kexec: program headers are missing\n");
+        return 0;
+    }
+
+    /* Everything from here on is allocated through the new context's copy of
+     * the allocator, so the new kernel starts out knowing about all of it.
+     */
+    Context* next = (Context *) kexec_request_frames(&context->allocator, (sizeof(Context) + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!next)
+        return 0;
+    *next = (Context) {
+        .services=context->services,
+        .memory=context->memory,
+        .graphics=context->graphics,
+        .font=context->font,
+        .allocator=context->allocator,
+        .archive=context->archive,
+        .physical_end=context->physical_end,
+        .regions=context->regions,
+        .timeline=context->timeline,
+        .generation=context->generation + 1,
+    };
+
+    u8* trampoline = kexec_request_frames(&next->allocator, 1);
+    if (!trampoline)
+        return 0;
+    memcpy(trampoline, KEXEC_TRAMPOLINE, sizeof(KEXEC_TRAMPOLINE));
+
+    next->page_tables = page_table_pool_new(&next->allocator);
+    next->page_map    = page_map_new(&next->page_tables, context->page_map.levels);
+    next->page_map.nx = context->page_map.nx;
+    next->pager       = (DemandPager) { .map=&next->page_map, .allocator=&next->allocator };
+    next->direct_map_base = page_table_direct_map(&next->page_map, &context->regions, context->physical_end);
+
+    // The same identity map the bootloader builds, which the trampoline, the
+    // stack and the new context are reached through. It's non-executable,
+    // but for the trampoline, which has to run from it in both maps.
+    u64 framebuffer     = (u64) context->graphics.base;
+    u64 framebuffer_end = framebuffer + context->graphics.size;
+    page_table_map_memory(&next->page_map, 0, &context->regions, context->physical_end, PAGE_MAP_WRITE);
+    if (framebuffer_end > context->physical_end)
+        page_table_map_physical(&next->page_map, 0, framebuffer > context->physical_end ? framebuffer : context->physical_end, framebuffer_end, PAGE_MAP_WRITE);
+
+    /* Unlike at boot, .bss is mapped up front: until the new kernel installs
+     * its own IDT, a page fault would land in the old kernel's handler, at an
+     * address that now holds the new kernel's code.
+     */
+    usize index = 0;
+    for (u16 i = 0; i < header->program_header_entries; ++i)
+    {
+        const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD)
+            continue;
+
+        u64 start = program->virtual_address & ~((u64) PAGE_SIZE - 1);
+        u64 end   = (program->virtual_address + program->memory_size + PAGE_SIZE - 1) & ~((u64) PAGE_SIZE - 1);
+        if (start < KERNEL_VIRTUAL_BASE || program->memory_size < program->file_size)
+        {
+            printf("kexec: segment %d isn't loadable\n", (int) index);
+            return 0;
+        }
+
+        u8* frames = kexec_request_frames(&next->allocator, (usize) ((end - start) / PAGE_SIZE));
+        if (!frames)
+            return 0;
+        if (!kexec_image_segment(&kernel, index++, program, frames + (program->virtual_address - start)))
+        {
+            printf("kexec: segment %d is corrupt\n", (int) index - 1);
+            return 0;
+        }
+
+        u32 flags = ((program->flags & PF_W) ? PAGE_MAP_WRITE : 0) | ((program->flags & PF_X) ? PAGE_MAP_EXECUTE : 0);
+        for (u64 page = start; page < end; page += PAGE_SIZE)
+            map_memory(&next->page_map, page, (u64) frames + (page - start), flags);
+    }
+
+    page_map_allow_execute(&next->page_map, (u64) trampoline);
+    page_map_allow_execute(&context->page_map, (u64) trampoline);
+    printf("kexec: entering generation %d at %x\n", (int) next->generation, header->entry_point);
+    ((kexec_trampoline_fn) trampoline)(next, next->page_map.root, header->entry_point);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "bootloader.h"
+
+// ---- KEXEC ----
+// Start another kernel straight from memory, without going back through the
+// firmware. The new kernel gets a Context of its own, with fresh page tables,
+// but the memory map, framebuffer, font and boot archive are handed over as
+// they are. Plain and packed (see kernel_pack.h) kernels are both accepted.
+//
+// The switch happens in a trampoline in identity mapped memory, as the new
+// kernel is linked at the same addresses as the running one.
+#define KEXEC_NEXT_KERNEL_NAME "kernel.next"
+
+bool kexec(Context* context, const u8* image, u64 size);
@@ -0,0 +1,84 @@
+#include "lz4.h"
+
+// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+// A block is a series of sequences: a token, literals and a match copied
+// from earlier output. The last sequence has literals only.
+
+
+/// Read a length that continues in extra bytes as long as they are 255.
+static inline bool lz4_read_length(const u8** source, const u8* end, usize* length)
+{
+    u8 byte;
+    do
+    {
+        if (*source >= end)
+            return false;
+        byte = *(*source)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+
+/// Decompress one LZ4 block into `destination`. Returns the number of bytes
+/// written, or -1 if the block is malformed or doesn't fit in `capacity`.
+/// Every read and write is bounds checked, as the input comes off the disk.
+i64 lz4_decompress_block(const u8* source, usize source_size, u8* destination, usize capacity)
+{
+    const u8* input      = source;
+    const u8* input_end  = source + source_size;
+    u8*       output     = destination;
+    u8*       output_end = destination + capacity;
+
+    while (input < input_end)
+    {
+        u8    token   = *input++;
+        usize literal = token >> 4;
+        if (literal == 15 && !lz4_read_length(&input, input_end, &literal))
+            return -1;
+        if (literal > (usize) (input_end - input) || literal > (usize) (output_end - output))
+            return -1;
+
+        for (usize i = 0; i < literal; ++i)
+            output[i] = input[i];
+        input  += literal;
+        output += literal;
+
+        if (input == input_end)
+            break;
+
+        if (input_end - input < 2)
+            return -1;
+        usize offset = (usize) input[0] | ((usize) input[1] << 8);
+        input += 2;
+        if (offset == 0 || offset > (usize) (output - destination))
+            return -1;
+
+        usize match = token & 15;
+        if (match == 15 && !lz4_read_length(&input, input_end, &match))
+            return -1;
+        match += LZ4_MIN_MATCH;
+        if (match > (usize) (output_end - output))
+            return -1;
+
+        // Eight bytes at a time when the source is far enough behind that
+        // the copy can't read what it's writing. Short offsets (runs) are
+        // meant to overlap, so those go a byte at a time.
+        const u8* from = output - offset;
+        if (offset >= sizeof(u64))
+        {
+            for (; match >= sizeof(u64); match -= sizeof(u64))
+            {
+                u64 chunk;
+                __builtin_memcpy(&chunk, from, sizeof(u64));
+                __builtin_memcpy(output, &chunk, sizeof(u64));
+                from   += sizeof(u64);
+                output += sizeof(u64);
+            }
+        }
+        while (match--)
+            *output++ = *from++;
+    }
+
+    return (i64) (output - destination);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "types.h"
+
+// Worst case size of a compressed block, for incompressible input.
+#define LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+// The smallest match, and how close to the end of a block a match may start
+// and end. Compressors must keep to these for decoders to stay in bounds.
+#define LZ4_MIN_MATCH     4
+#define LZ4_MF_LIMIT      12
+#define LZ4_LAST_LITERALS 5
+
+i64 lz4_decompress_block(const u8* source, usize source_size, u8* destination, usize capacity);
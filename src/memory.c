@@ -3,19 +3,486 @@
 // yourself as described in the C standard. You cannot and should not (if you
 // could) prevent the compiler from assuming these functions exist as the
 // compiler uses them for important optimizations.
+//
+// Both are split by size. Up to 32 bytes they're a few overlapping loads and
+// stores, picked by size class. Above that there are variants, and
+// memory_primitives_init binds memcpy and memset to the best one for the CPU:
+//
+//   general  8 bytes at a time in general registers.
+//   sse2     16 byte vector loops with aligned stores. Every x86-64 has SSE2.
+//   erms     `rep movsb`/`rep stosb`, which microcode runs a cache line at a
+//            time when the CPU has ERMS. With FSRM it's fast for short
+//            sizes too, otherwise the SSE2 loop covers those.
+//
+// The SSE2 and ERMS variants use vector registers for sizes above 32 bytes,
+// which interrupt handlers don't save, so handler code has to call the
+// general variants directly.
+//
+// memmove and memcmp only come in general registers, a word at a time.
+//
+// clear_pages and copy_pages are for whole pages that won't be read again
+// soon, like fresh frames and loaded segments. They store with `movnti`,
+// which writes around the cache instead of evicting what's in it, and fence
+// once at the end. General registers only, so the page fault handler can
+// use them too.
+//
+// Defining MEMORY_HOSTED leaves out the standard names, for programs that
+// link against a C library as well (see bin/memory.c).
 #include <stddef.h>
+#include "types.h"
+#include "x86_64/x86_64.h"
+#include "x86_64/cpu.h"
+#include "memory.h"
 
-void* memcpy(void* destination, const void* source, size_t size)
+
+typedef u64 __attribute__((may_alias, aligned(1))) unaligned_u64;
+typedef u32 __attribute__((may_alias, aligned(1))) unaligned_u32;
+typedef u16 __attribute__((may_alias, aligned(1))) unaligned_u16;
+
+// Sizes from this up use `rep movsb`/`rep stosb` without FSRM. Below it the
+// microcode's startup cost is more than the SSE2 loop takes.
+#define MEMORY_REP_THRESHOLD_ERMS 1024
+#define MEMORY_REP_THRESHOLD_FSRM 32
+
+// Lets the vector loops name xmm registers, in code otherwise built with
+// -mgeneral-regs-only.
+#define MEMORY_SSE2 __attribute__((target("sse2")))
+
+
+/* ---- SMALL SIZES ---- */
+/// At most 32 bytes, as two overlapping halves of the size class, so every
+/// size takes the same few loads and stores.
+static inline void memcpy_small(u8* destination, const u8* source, usize size)
+{
+    if (size >= 16)
+    {
+        u64 a = *(const unaligned_u64 *) source;
+        u64 b = *(const unaligned_u64 *) (source + 8);
+        u64 c = *(const unaligned_u64 *) (source + size - 16);
+        u64 d = *(const unaligned_u64 *) (source + size - 8);
+        *(unaligned_u64 *) destination               = a;
+        *(unaligned_u64 *) (destination + 8)         = b;
+        *(unaligned_u64 *) (destination + size - 16) = c;
+        *(unaligned_u64 *) (destination + size - 8)  = d;
+    }
+    else if (size >= 8)
+    {
+        u64 a = *(const unaligned_u64 *) source;
+        u64 b = *(const unaligned_u64 *) (source + size - 8);
+        *(unaligned_u64 *) destination              = a;
+        *(unaligned_u64 *) (destination + size - 8) = b;
+    }
+    else if (size >= 4)
+    {
+        u32 a = *(const unaligned_u32 *) source;
+        u32 b = *(const unaligned_u32 *) (source + size - 4);
+        *(unaligned_u32 *) destination              = a;
+        *(unaligned_u32 *) (destination + size - 4) = b;
+    }
+    else if (size >= 2)
+    {
+        u16 a = *(const unaligned_u16 *) source;
+        u16 b = *(const unaligned_u16 *) (source + size - 2);
+        *(unaligned_u16 *) destination              = a;
+        *(unaligned_u16 *) (destination + size - 2) = b;
+    }
+    else if (size == 1)
+    {
+        *destination = *source;
+    }
+}
+
+/// At most 32 bytes of `pattern`, which is the byte repeated eight times.
+static inline void memset_small(u8* destination, u64 pattern, usize size)
+{
+    if (size >= 16)
+    {
+        *(unaligned_u64 *) destination               = pattern;
+        *(unaligned_u64 *) (destination + 8)         = pattern;
+        *(unaligned_u64 *) (destination + size - 16) = pattern;
+        *(unaligned_u64 *) (destination + size - 8)  = pattern;
+    }
+    else if (size >= 8)
+    {
+        *(unaligned_u64 *) destination              = pattern;
+        *(unaligned_u64 *) (destination + size - 8) = pattern;
+    }
+    else if (size >= 4)
+    {
+        *(unaligned_u32 *) destination              = (u32) pattern;
+        *(unaligned_u32 *) (destination + size - 4) = (u32) pattern;
+    }
+    else if (size >= 2)
+    {
+        *(unaligned_u16 *) destination              = (u16) pattern;
+        *(unaligned_u16 *) (destination + size - 2) = (u16) pattern;
+    }
+    else if (size == 1)
+    {
+        *destination = (u8) pattern;
+    }
+}
+
+static inline u64 memset_pattern(int value)
+{
+    return (u64) (u8) value * 0x0101010101010101ULL;
+}
+
+
+/* ---- GENERAL REGISTERS ---- */
+void* memcpy_general(void* destination, const void* source, usize size)
+{
+    u8*       to   = (u8 *) destination;
+    const u8* from = (const u8 *) source;
+    if (size <= 32)
+    {
+        memcpy_small(to, from, size);
+        return destination;
+    }
+
+    // The last 8 bytes are copied up front, so the loop can stop short of
+    // them without a byte tail.
+    u64 last = *(const unaligned_u64 *) (from + size - 8);
+    for (usize i = 0; i + 8 <= size; i += 8)
+        *(unaligned_u64 *) (to + i) = *(const unaligned_u64 *) (from + i);
+    *(unaligned_u64 *) (to + size - 8) = last;
+    return destination;
+}
+
+void* memset_general(void* destination, int value, usize size)
+{
+    u8* to      = (u8 *) destination;
+    u64 pattern = memset_pattern(value);
+    if (size <= 32)
+    {
+        memset_small(to, pattern, size);
+        return destination;
+    }
+
+    for (usize i = 0; i + 8 <= size; i += 8)
+        *(unaligned_u64 *) (to + i) = pattern;
+    *(unaligned_u64 *) (to + size - 8) = pattern;
+    return destination;
+}
+
+
+void* memmove_general(void* destination, const void* source, usize size)
+{
+    u8*       to   = (u8 *) destination;
+    const u8* from = (const u8 *) source;
+    if (size <= 32)
+    {
+        // Everything is loaded before anything is stored.
+        memcpy_small(to, from, size);
+        return destination;
+    }
+    if (to == from)
+        return destination;
+
+    if ((usize) (to - from) >= size)
+    {
+        // The destination starts below the source or past its end, so
+        // copying upwards never overwrites bytes that are still to be read.
+        u64 last = *(const unaligned_u64 *) (from + size - 8);
+        for (usize i = 0; i + 8 <= size; i += 8)
+            *(unaligned_u64 *) (to + i) = *(const unaligned_u64 *) (from + i);
+        *(unaligned_u64 *) (to + size - 8) = last;
+    }
+    else
+    {
+        u64 first = *(const unaligned_u64 *) from;
+        for (usize i = size; i >= 8; i -= 8)
+            *(unaligned_u64 *) (to + i - 8) = *(const unaligned_u64 *) (from + i - 8);
+        *(unaligned_u64 *) to = first;
+    }
+    return destination;
+}
+
+int memcmp_general(const void* a, const void* b, usize size)
+{
+    const u8* left  = (const u8 *) a;
+    const u8* right = (const u8 *) b;
+    if (size < 8)
+    {
+        for (usize i = 0; i < size; ++i)
+        {
+            if (left[i] != right[i])
+                return left[i] < right[i] ? -1 : 1;
+        }
+        return 0;
+    }
+
+    // The last word overlaps the one before it, which was already equal, so
+    // its first difference is still the first one overall. Byte swapping
+    // makes the lowest address the most significant byte.
+    for (usize i = 0; ; i += 8)
+    {
+        if (i + 8 > size)
+            i = size - 8;
+
+        u64 x = *(const unaligned_u64 *) (left + i);
+        u64 y = *(const unaligned_u64 *) (right + i);
+        if (x != y)
+            return __builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1;
+        if (i + 8 == size)
+            return 0;
+    }
+}
+
+
+/* ---- SSE2 ---- */
+/// More than 32 bytes. The first 16 are stored unaligned, then the rest with
+/// aligned stores from the next 16 byte boundary, and the last 16 unaligned
+/// again, overlapping whatever the loop left.
+MEMORY_SSE2 static void memcpy_sse2_large(u8* to, const u8* from, usize size)
+{
+    u8*       end_to   = to + size - 16;
+    const u8* end_from = from + size - 16;
+    __asm__ __volatile__("movdqu (%0), %%xmm0\n\tmovdqu %%xmm0, (%1)" : : "r"(from), "r"(to) : "xmm0", "memory");
+
+    usize skew = 16 - ((usize) to & 15);
+    to   += skew;
+    from += skew;
+    size -= skew;
+
+    for (; size >= 64; size -= 64, to += 64, from += 64)
+    {
+        __asm__ __volatile__(
+            "movdqu   (%0), %%xmm0\n\t"
+            "movdqu 16(%0), %%xmm1\n\t"
+            "movdqu 32(%0), %%xmm2\n\t"
+            "movdqu 48(%0), %%xmm3\n\t"
+            "movdqa %%xmm0,   (%1)\n\t"
+            "movdqa %%xmm1, 16(%1)\n\t"
+            "movdqa %%xmm2, 32(%1)\n\t"
+            "movdqa %%xmm3, 48(%1)"
+            : : "r"(from), "r"(to) : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+    }
+    for (; size >= 16; size -= 16, to += 16, from += 16)
+        __asm__ __volatile__("movdqu (%0), %%xmm0\n\tmovdqa %%xmm0, (%1)" : : "r"(from), "r"(to) : "xmm0", "memory");
+
+    __asm__ __volatile__("movdqu (%0), %%xmm0\n\tmovdqu %%xmm0, (%1)" : : "r"(end_from), "r"(end_to) : "xmm0", "memory");
+}
+
+MEMORY_SSE2 static void memset_sse2_large(u8* to, u64 pattern, usize size)
+{
+    u8*   end     = to + size;
+    u8*   aligned = (u8 *) (((usize) to + 16) & ~(usize) 15);
+    usize blocks  = (usize) (end - aligned) / 64;
+    usize rest    = (usize) (end - aligned) % 64 / 16;
+
+    // One block of assembly, as the pattern has to stay in xmm0 throughout.
+    __asm__ __volatile__(
+        "movq %[pattern], %%xmm0\n\t"
+        "punpcklqdq %%xmm0, %%xmm0\n\t"
+        "movdqu %%xmm0, (%[to])\n\t"
+        "movdqu %%xmm0, -16(%[end])\n\t"
+        "test %[blocks], %[blocks]\n\t"
+        "jz 2f\n"
+        "1:\n\t"
+        "movdqa %%xmm0,   (%[aligned])\n\t"
+        "movdqa %%xmm0, 16(%[aligned])\n\t"
+        "movdqa %%xmm0, 32(%[aligned])\n\t"
+        "movdqa %%xmm0, 48(%[aligned])\n\t"
+        "add $64, %[aligned]\n\t"
+        "dec %[blocks]\n\t"
+        "jnz 1b\n"
+        "2:\n\t"
+        "test %[rest], %[rest]\n\t"
+        "jz 4f\n"
+        "3:\n\t"
+        "movdqa %%xmm0, (%[aligned])\n\t"
+        "add $16, %[aligned]\n\t"
+        "dec %[rest]\n\t"
+        "jnz 3b\n"
+        "4:"
+        : [aligned]"+r"(aligned), [blocks]"+r"(blocks), [rest]"+r"(rest)
+        : [pattern]"r"(pattern), [to]"r"(to), [end]"r"(end)
+        : "xmm0", "cc", "memory");
+}
+
+void* memcpy_sse2(void* destination, const void* source, usize size)
 {
-    for (size_t i = 0; i < size; ++i)
-        ((u8*) destination)[i] = ((const u8*) source)[i];
+    if (size <= 32)
+        memcpy_small((u8 *) destination, (const u8 *) source, size);
+    else
+        memcpy_sse2_large((u8 *) destination, (const u8 *) source, size);
     return destination;
 }
 
+void* memset_sse2(void* destination, int value, usize size)
+{
+    if (size <= 32)
+        memset_small((u8 *) destination, memset_pattern(value), size);
+    else
+        memset_sse2_large((u8 *) destination, memset_pattern(value), size);
+    return destination;
+}
+
+
+/* ---- ERMS ---- */
+static usize g_memory_rep_threshold = MEMORY_REP_THRESHOLD_ERMS;
+
+void* memcpy_erms(void* destination, const void* source, usize size)
+{
+    if (size <= 32)
+    {
+        memcpy_small((u8 *) destination, (const u8 *) source, size);
+    }
+    else if (size < g_memory_rep_threshold)
+    {
+        memcpy_sse2_large((u8 *) destination, (const u8 *) source, size);
+    }
+    else
+    {
+        void*       to   = destination;
+        const void* from = source;
+        __asm__ __volatile__("rep movsb" : "+D"(to), "+S"(from), "+c"(size) : : "memory");
+    }
+    return destination;
+}
+
+void* memset_erms(void* destination, int value, usize size)
+{
+    if (size <= 32)
+    {
+        memset_small((u8 *) destination, memset_pattern(value), size);
+    }
+    else if (size < g_memory_rep_threshold)
+    {
+        memset_sse2_large((u8 *) destination, memset_pattern(value), size);
+    }
+    else
+    {
+        void* to = destination;
+        __asm__ __volatile__("rep stosb" : "+D"(to), "+c"(size) : "a"((u8) value) : "memory");
+    }
+    return destination;
+}
+
+
+/* ---- PAGES ---- */
+/// Zero `count` pages, 64 bytes per iteration. The stores are weakly ordered
+/// until the `sfence`, which is after the last one rather than per page.
+void clear_pages(void* pages, usize count)
+{
+    if (count == 0)
+        return;
+
+    u8*   to     = (u8 *) pages;
+    usize blocks = count * PAGE_SIZE / 64;
+    __asm__ __volatile__(
+        "1:\n\t"
+        "movnti %[zero],   (%[to])\n\t"
+        "movnti %[zero],  8(%[to])\n\t"
+        "movnti %[zero], 16(%[to])\n\t"
+        "movnti %[zero], 24(%[to])\n\t"
+        "movnti %[zero], 32(%[to])\n\t"
+        "movnti %[zero], 40(%[to])\n\t"
+        "movnti %[zero], 48(%[to])\n\t"
+        "movnti %[zero], 56(%[to])\n\t"
+        "add $64, %[to]\n\t"
+        "dec %[blocks]\n\t"
+        "jnz 1b\n\t"
+        "sfence"
+        : [to]"+r"(to), [blocks]"+r"(blocks)
+        : [zero]"r"(0ULL)
+        : "cc", "memory");
+}
+
+/// Copy `count` pages to `destination`, which has to be page aligned. The
+/// source doesn't, as only the stores go around the cache.
+void copy_pages(void* destination, const void* source, usize count)
+{
+    if (count == 0)
+        return;
+
+    u8*       to     = (u8 *) destination;
+    const u8* from   = (const u8 *) source;
+    usize     blocks = count * PAGE_SIZE / 32;
+    u64 a, b, c, d;
+    __asm__ __volatile__(
+        "1:\n\t"
+        "mov   (%[from]), %[a]\n\t"
+        "mov  8(%[from]), %[b]\n\t"
+        "mov 16(%[from]), %[c]\n\t"
+        "mov 24(%[from]), %[d]\n\t"
+        "movnti %[a],   (%[to])\n\t"
+        "movnti %[b],  8(%[to])\n\t"
+        "movnti %[c], 16(%[to])\n\t"
+        "movnti %[d], 24(%[to])\n\t"
+        "add $32, %[from]\n\t"
+        "add $32, %[to]\n\t"
+        "dec %[blocks]\n\t"
+        "jnz 1b\n\t"
+        "sfence"
+        : [to]"+r"(to), [from]"+r"(from), [blocks]"+r"(blocks), [a]"=&r"(a), [b]"=&r"(b), [c]"=&r"(c), [d]"=&r"(d)
+        :
+        : "cc", "memory");
+}
+
+void clear_page(void* page)
+{
+    clear_pages(page, 1);
+}
+
+void copy_page(void* destination, const void* source)
+{
+    copy_pages(destination, source, 1);
+}
+
+
+/* ---- DISPATCH ---- */
+typedef struct MemoryVariant
+{
+    CpuVariant variant;
+    memcpy_fn  copy;
+    memset_fn  set;
+    usize      rep_threshold;
+} MemoryVariant;
+
+static const MemoryVariant MEMORY_VARIANTS[] = {
+    { { "erms+fsrm", CPU_FEATURE_BIT(ERMS) | CPU_FEATURE_BIT(FSRM) }, memcpy_erms, memset_erms, MEMORY_REP_THRESHOLD_FSRM },
+    { { "erms",      CPU_FEATURE_BIT(ERMS)                         }, memcpy_erms, memset_erms, MEMORY_REP_THRESHOLD_ERMS },
+    { { "sse2",      0                                             }, memcpy_sse2, memset_sse2, MEMORY_REP_THRESHOLD_ERMS },
+};
+
+static memcpy_fn g_memcpy = memcpy_general;
+static memset_fn g_memset = memset_general;
+
+/// Bind memcpy and memset to the best variant for this CPU, and return its
+/// name. Until it's called they use the general variants.
+///
+/// Both come from the same row, but each is dispatched (and so recorded in
+/// cpu_bindings) under its own name.
+const char* memory_primitives_init()
+{
+    const MemoryVariant* best = CPU_DISPATCH("memcpy", MEMORY_VARIANTS);
+    g_memory_rep_threshold = best->rep_threshold;
+    g_memcpy = best->copy;
+    g_memset = CPU_DISPATCH("memset", MEMORY_VARIANTS)->set;
+    return best->variant.name;
+}
+
+
+#if !defined(MEMORY_HOSTED)
+void* memcpy(void* destination, const void* source, size_t size)
+{
+    return g_memcpy(destination, source, size);
+}
+
 void* memset(void* source, int value, size_t size)
 {
-    u8* pointer = (u8 *) source;
-    while (size--)
-        *pointer++ = (unsigned char) value;
-    return source;
+    return g_memset(source, value, size);
+}
+
+void* memmove(void* destination, const void* source, size_t size)
+{
+    return memmove_general(destination, source, size);
+}
+
+int memcmp(const void* a, const void* b, size_t size)
+{
+    return memcmp_general(a, b, size);
 }
+#endif
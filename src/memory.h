@@ -3,7 +3,36 @@
 // yourself as described in the C standard. You cannot and should not (if you
 // could) prevent the compiler from assuming these functions exist as the
 // compiler uses them for important optimizations.
+#pragma once
 #include <stddef.h>
+#include "types.h"
 
 void* memcpy(void* destination, const void* source, size_t size);
 void* memset(void* source, int value, size_t size);
+void* memmove(void* destination, const void* source, size_t size);
+int   memcmp(const void* a, const void* b, size_t size);
+
+// The variants memcpy and memset are bound to (see memory.c). Interrupt
+// handlers must only use the general ones.
+typedef void* (*memcpy_fn)(void* destination, const void* source, usize size);
+typedef void* (*memset_fn)(void* destination, int value, usize size);
+
+void* memcpy_general(void* destination, const void* source, usize size);
+void* memset_general(void* destination, int value, usize size);
+void* memmove_general(void* destination, const void* source, usize size);
+int   memcmp_general(const void* a, const void* b, usize size);
+void* memcpy_sse2(void* destination, const void* source, usize size);
+void* memset_sse2(void* destination, int value, usize size);
+void* memcpy_erms(void* destination, const void* source, usize size);
+void* memset_erms(void* destination, int value, usize size);
+
+// Whole 4 KiB pages with non-temporal stores, for memory that isn't about
+// to be read (see memory.c). `destination` has to be page aligned.
+#define PAGE_SIZE 4096
+
+void clear_page(void* page);
+void copy_page(void* destination, const void* source);
+void clear_pages(void* pages, usize count);
+void copy_pages(void* destination, const void* source, usize count);
+
+const char* memory_primitives_init();
@@ -0,0 +1,185 @@
+#include "memory_regions.h"
+#include "bootloader/efi.h"
+#include "page_allocator.h"
+
+
+static u32 memory_region_type(u32 efi_type)
+{
+    switch (efi_type)
+    {
+        case EfiConventionalMemory:
+            return MEMORY_REGION_USABLE;
+        case EfiLoaderCode:
+        case EfiLoaderData:
+        case EfiBootServicesCode:
+        case EfiBootServicesData:
+            return MEMORY_REGION_RECLAIMABLE;
+        case EfiACPIReclaimMemory:
+        case EfiACPIMemoryNVS:
+            return MEMORY_REGION_ACPI;
+        case EfiMemoryMappedIO:
+        case EfiMemoryMappedIOPortSpace:
+            return MEMORY_REGION_MMIO;
+        default:
+            return MEMORY_REGION_RESERVED;
+    }
+}
+
+
+/// Make room at `index` by moving everything from there up one entry.
+static void memory_regions_open_gap(MemoryRegion* regions, usize count, usize index)
+{
+    for (usize i = count; i > index; --i)
+        regions[i] = regions[i - 1];
+}
+
+
+/// Give [start, end) to a region of its own, cutting it out of the sorted
+/// regions it overlaps. Needs room for two more entries.
+static usize memory_regions_carve(MemoryRegion* regions, usize count, u64 start, u64 end, u32 type)
+{
+    usize insert = count;
+    for (usize i = 0; i < count; ++i)
+    {
+        MemoryRegion* region = &regions[i];
+        if (region->end <= start)
+            continue;
+        if (insert == count)
+            insert = i;
+        if (region->start >= end)
+            break;
+
+        if (region->start < start && region->end > end)
+        {
+            memory_regions_open_gap(regions, count++, i + 1);
+            regions[i + 1] = (MemoryRegion) { .start=end, .end=region->end, .type=region->type };
+            region->end = start;
+            insert = i + 1;
+            break;
+        }
+        if (region->start < start)
+        {
+            region->end = start;
+            insert = i + 1;
+        }
+        else if (region->end > end)
+        {
+            region->start = end;
+        }
+        else
+        {
+            for (usize j = i; j + 1 < count; ++j)
+                regions[j] = regions[j + 1];
+            --count;
+            --i;
+        }
+    }
+
+    memory_regions_open_gap(regions, count++, insert);
+    regions[insert] = (MemoryRegion) { .start=start, .end=end, .type=type };
+    return count;
+}
+
+
+/// Fill `regions` from a firmware memory map of `map_size` bytes, with the
+/// framebuffer put in a region of its own, and return how many there are.
+/// `capacity` should be MEMORY_REGIONS_CAPACITY of the descriptor count.
+///
+/// Doesn't allocate or call the firmware, so it can run between the final
+/// GetMemoryMap and the kernel.
+usize memory_regions_build(MemoryRegion* regions, usize capacity, const void* descriptors, usize map_size, usize descriptor_size, u64 framebuffer, u64 framebuffer_size)
+{
+    usize entries = map_size / descriptor_size;
+    if (capacity < MEMORY_REGIONS_CAPACITY(entries))
+        return 0;
+
+    usize count = 0;
+    for (usize i = 0; i < entries; ++i)
+    {
+        const EFI_MEMORY_DESCRIPTOR* descriptor = (const EFI_MEMORY_DESCRIPTOR *) ((const u8 *) descriptors + descriptor_size * i);
+        if (descriptor->NumberOfPages == 0)
+            continue;
+
+        MemoryRegion region = {
+            .start=descriptor->PhysicalStart,
+            .end=descriptor->PhysicalStart + descriptor->NumberOfPages * PAGE_SIZE,
+            .type=memory_region_type(descriptor->Type),
+        };
+
+        // Insertion sort, as firmware maps are mostly in order already.
+        usize at = count++;
+        while (at > 0 && regions[at - 1].start > region.start)
+        {
+            regions[at] = regions[at - 1];
+            --at;
+        }
+        regions[at] = region;
+    }
+
+    // The firmware shouldn't hand out overlapping descriptors, but if it
+    // does the lower one keeps the overlap.
+    usize kept = 0;
+    for (usize i = 0; i < count; ++i)
+    {
+        MemoryRegion region = regions[i];
+        if (kept > 0 && region.start < regions[kept - 1].end)
+            region.start = regions[kept - 1].end;
+        if (region.start < region.end)
+            regions[kept++] = region;
+    }
+    count = kept;
+
+    if (framebuffer_size > 0)
+    {
+        u64 start = framebuffer & ~((u64) PAGE_SIZE - 1);
+        u64 end   = (framebuffer + framebuffer_size + PAGE_SIZE - 1) & ~((u64) PAGE_SIZE - 1);
+        count = memory_regions_carve(regions, count, start, end, MEMORY_REGION_FRAMEBUFFER);
+    }
+
+    kept = 0;
+    for (usize i = 0; i < count; ++i)
+    {
+        if (kept > 0 && regions[kept - 1].end == regions[i].start && regions[kept - 1].type == regions[i].type)
+            regions[kept - 1].end = regions[i].end;
+        else
+            regions[kept++] = regions[i];
+    }
+
+    return kept;
+}
+
+
+/// Binary search for the region holding `address`. NULL if the firmware
+/// didn't describe it.
+const MemoryRegion* memory_regions_find(const MemoryRegions* regions, u64 address)
+{
+    usize low  = 0;
+    usize high = regions->count;
+    while (low < high)
+    {
+        usize middle = low + (high - low) / 2;
+        const MemoryRegion* region = &regions->regions[middle];
+        if (address < region->start)
+            high = middle;
+        else if (address >= region->end)
+            low = middle + 1;
+        else
+            return region;
+    }
+    return NULL;
+}
+
+
+/// One past the last frame of RAM: usable, reclaimable or ACPI memory.
+/// Reserved ranges and MMIO above it (which can reach far past the end of
+/// RAM) don't count.
+u64 memory_regions_ram_end(const MemoryRegions* regions)
+{
+    for (usize i = regions->count; i > 0; --i)
+    {
+        const MemoryRegion* region = &regions->regions[i - 1];
+        if (region->type == MEMORY_REGION_USABLE || region->type == MEMORY_REGION_RECLAIMABLE || region->type == MEMORY_REGION_ACPI)
+            return region->end;
+    }
+    return 0;
+}
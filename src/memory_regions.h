@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.h"
+
+// ---- MEMORY REGIONS ----
+// The firmware memory map, boiled down by the bootloader after the final
+// GetMemoryMap: fixed size entries with a handful of types, sorted by
+// address, without overlaps, and with neighbours of the same type merged.
+// A lookup is a binary search, instead of a walk over descriptors of
+// DescriptorSize stride.
+//
+// Addresses that aren't in any region aren't described by the firmware at
+// all, and should be treated as reserved.
+typedef enum MemoryRegionType
+{
+    MEMORY_REGION_USABLE,       // Free once the kernel has started.
+    MEMORY_REGION_RECLAIMABLE,  // Boot services and loader memory. Holds the kernel, Context and page tables.
+    MEMORY_REGION_RESERVED,     // Runtime services, unusable and anything unknown.
+    MEMORY_REGION_ACPI,         // ACPI tables and NVS.
+    MEMORY_REGION_MMIO,
+    MEMORY_REGION_FRAMEBUFFER,
+    MEMORY_REGION_TYPE_COUNT
+} MemoryRegionType;
+
+typedef struct MemoryRegion
+{
+    u64 start;  // Page aligned.
+    u64 end;    // Exclusive.
+    u32 type;   // MemoryRegionType.
+} MemoryRegion;
+
+typedef struct MemoryRegions
+{
+    MemoryRegion* regions;
+    usize         count;
+} MemoryRegions;
+
+// Room for every descriptor of a memory map, plus the split the
+// framebuffer can make.
+#define MEMORY_REGIONS_CAPACITY(descriptors) ((descriptors) + 2)
+
+usize               memory_regions_build(MemoryRegion* regions, usize capacity, const void* descriptors, usize map_size, usize descriptor_size, u64 framebuffer, u64 framebuffer_size);
+const MemoryRegion* memory_regions_find(const MemoryRegions* regions, u64 address);
+u64                 memory_regions_ram_end(const MemoryRegions* regions);
@@ -49,7 +49,7 @@ PageAllocator page_allocator_new(void* memory, usize size)
 }
 
 
-void* page_allocator_request_page(PageAllocator* allocator)
+void* page_allocator_take_page(PageAllocator* allocator)
 {
     for (u64 i = 0; i < allocator->pages_total; ++i)
     {
@@ -58,7 +58,6 @@ void* page_allocator_request_page(PageAllocator* allocator)
 
         void* memory = (void*) (allocator->base + i * PAGE_SIZE);
         page_allocator_lock_page(allocator, memory);
-        memset(memory, 0, PAGE_SIZE);
         return memory;
     }
 
@@ -66,6 +65,30 @@ void* page_allocator_request_page(PageAllocator* allocator)
     return 0; // Page Frame Swap to file
 }
 
+void* page_allocator_request_page(PageAllocator* allocator)
+{
+    // The caller usually writes little of the frame right away. Clearing it
+    // through the cache would evict a page of hot data.
+    void* memory = page_allocator_take_page(allocator);
+    if (memory)
+        clear_page(memory);
+    return memory;
+}
+
+void* page_allocator_find_free_pages(PageAllocator* allocator, usize count)
+{
+    usize run = 0;
+    for (u64 i = 0; i < allocator->pages_total; ++i)
+    {
+        run = bitmask_is_set(allocator->base, i) ? 0 : run + 1;
+        if (run == count)
+            return (void*) (allocator->base + (i + 1 - count) * PAGE_SIZE);
+    }
+
+    ERROR(INVALID, "Allocator exhausted!");
+    return 0;
+}
+
 static inline usize page_allocator_bitmask_index(PageAllocator* allocator, void* address)
 {
     ASSERTF(((usize) address) % PAGE_SIZE == 0 && ((usize) allocator->base) % PAGE_SIZE == 0, "Invalid!");
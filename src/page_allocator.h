@@ -24,6 +24,13 @@ PageAllocator page_allocator_new(void* memory, usize size);
 
 void* page_allocator_request_page(PageAllocator* allocator);
 
+/// Like page_allocator_request_page, but leaves the page as it was, for
+/// callers that clear it themselves.
+void* page_allocator_take_page(PageAllocator* allocator);
+
+/// Find `count` consecutive free pages without taking them.
+void* page_allocator_find_free_pages(PageAllocator* allocator, usize count);
+
 
 /// Make page marked as used for conventional usage.
 void page_allocator_lock_page(PageAllocator* allocator, void* address);
@@ -0,0 +1,111 @@
+#include "symbols.h"
+
+
+static const SymbolTable* g_symbol_table = NULL;
+
+
+/// Make `table` the one used to symbolize addresses in panics.
+void symbol_table_install(const SymbolTable* table)
+{
+    g_symbol_table = table;
+}
+
+const SymbolTable* symbol_table_installed()
+{
+    return g_symbol_table;
+}
+
+
+/// FNV-1a.
+u32 symbol_hash(const char* name)
+{
+    u32 hash = 2166136261U;
+    while (*name)
+    {
+        hash ^= (u8) *name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+/// Shell sort by address. It's done once per boot over a few thousand
+/// symbols at most, so it only has to stay clear of quadratic time.
+void symbol_table_sort(SymbolTable* table)
+{
+    static const u32 GAPS[] = { 1750, 701, 301, 132, 57, 23, 10, 4, 1 };
+
+    Symbol* symbols = table->symbols;
+    for (usize g = 0; g < sizeof(GAPS) / sizeof(GAPS[0]); ++g)
+    {
+        u32 gap = GAPS[g];
+        for (u32 i = gap; i < table->count; ++i)
+        {
+            Symbol symbol = symbols[i];
+            u32    j      = i;
+            for (; j >= gap && symbols[j - gap].address > symbol.address; j -= gap)
+                symbols[j] = symbols[j - gap];
+            symbols[j] = symbol;
+        }
+    }
+}
+
+
+/// Fill in the name index. `buckets` must already point to `bucket_count`
+/// zeroed entries. Must be redone whenever the symbols are reordered.
+void symbol_table_index(SymbolTable* table)
+{
+    u32 mask = table->bucket_count - 1;
+    for (u32 i = 0; i < table->count; ++i)
+    {
+        u32 bucket = symbol_hash(SYMBOL_NAME(table, &table->symbols[i])) & mask;
+        while (table->buckets[bucket])
+            bucket = (bucket + 1) & mask;
+        table->buckets[bucket] = i + 1;
+    }
+}
+
+
+/// The function containing `address`, or NULL if it's outside all of them.
+const Symbol* symbol_table_find_address(const SymbolTable* table, u64 address)
+{
+    if (!table || table->count == 0 || address < table->symbols[0].address)
+        return NULL;
+
+    // Last symbol starting at or below the address.
+    u32 low  = 0;
+    u32 high = table->count;
+    while (high - low > 1)
+    {
+        u32 middle = low + (high - low) / 2;
+        if (table->symbols[middle].address <= address)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    const Symbol* symbol = &table->symbols[low];
+    if (symbol->size != 0 && address - symbol->address >= symbol->size)
+        return NULL;
+    return symbol;
+}
+
+
+const Symbol* symbol_table_find_name(const SymbolTable* table, const char* name)
+{
+    if (!table || table->bucket_count == 0)
+        return NULL;
+
+    u32 mask = table->bucket_count - 1;
+    for (u32 bucket = symbol_hash(name) & mask; table->buckets[bucket]; bucket = (bucket + 1) & mask)
+    {
+        const Symbol* symbol = &table->symbols[table->buckets[bucket] - 1];
+        const char*   a      = SYMBOL_NAME(table, symbol);
+        const char*   b      = name;
+        while (*a && *a == *b)
+            ++a, ++b;
+        if (*a == *b)
+            return symbol;
+    }
+    return NULL;
+}
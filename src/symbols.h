@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+
+// ---- SYMBOLS ----
+// The kernel's function symbols, taken out of its ELF by the bootloader, so
+// that addresses can be printed as function+offset with no tools on the
+// host. Symbols are sorted by address for lookups by address, and have an
+// open addressing hash index for lookups by name.
+typedef struct Symbol
+{
+    u64 address;
+    u64 size;   // 0 if unknown (as for labels in assembly).
+    u32 name;   // Offset into SymbolTable.names.
+} Symbol;
+
+typedef struct SymbolTable
+{
+    Symbol* symbols;
+    u32     count;
+    char*   names;         // Null terminated, back to back.
+    u32*    buckets;       // Index + 1 into symbols, 0 being empty.
+    u32     bucket_count;  // A power of two, at least twice count.
+} SymbolTable;
+
+#define SYMBOL_NAME(table, symbol) ((table)->names + (symbol)->name)
+
+u32           symbol_hash(const char* name);
+void          symbol_table_sort(SymbolTable* table);
+void          symbol_table_index(SymbolTable* table);
+const Symbol* symbol_table_find_address(const SymbolTable* table, u64 address);
+const Symbol* symbol_table_find_name(const SymbolTable* table, const char* name);
+
+void               symbol_table_install(const SymbolTable* table);
+const SymbolTable* symbol_table_installed();
@@ -0,0 +1,177 @@
+#include "cpu.h"
+#include "x86_64.h"
+#include "../bit.h"
+
+
+static Cpu        g_cpu;
+static bool       g_cpu_initialized = false;
+static CpuBinding g_cpu_bindings[CPU_BINDINGS_MAX];
+static usize      g_cpu_binding_count = 0;
+
+
+static const char* CPU_FEATURE_NAMES[CPU_FEATURE_COUNT] = {
+    "sse4.2", "x2apic", "tsc-deadline", "pcid", "avx2", "erms", "invpcid", "avx512f", "la57", "fsrm", "nx", "1gib-pages",
+};
+
+
+/// Leaf 4 on Intel and 8000001DH on AMD describe one cache per subleaf, in
+/// the same format, until one with type 0.
+static void cpu_read_caches(Cpu* cpu, u32 leaf)
+{
+    for (u32 subleaf = 0; cpu->cache_count < CPU_CACHES_MAX; ++subleaf)
+    {
+        CpuidResult result = x86_64_cpuid(leaf, subleaf);
+        u8 type = (u8) (result.eax & 0x1F);
+        if (type == 0)
+            break;
+
+        u32 line_size  = (result.ebx & 0xFFF) + 1;
+        u32 partitions = ((result.ebx >> 12) & 0x3FF) + 1;
+        u32 ways       = ((result.ebx >> 22) & 0x3FF) + 1;
+        u32 sets       = result.ecx + 1;
+
+        cpu->caches[cpu->cache_count++] = (CpuCache) {
+            .level=(u8) ((result.eax >> 5) & 0x7),
+            .type=type,
+            .line_size=(u16) line_size,
+            .ways=(u16) ways,
+            .shared_by=(u16) (((result.eax >> 14) & 0xFFF) + 1),
+            .size=ways * partitions * line_size * sets,
+        };
+    }
+}
+
+
+/// Read everything once. Cheap enough to call again, but CPUID exits to the
+/// hypervisor under virtualization, so hot paths go through cpu_has.
+void cpu_init()
+{
+    Cpu cpu = { 0 };
+
+    CpuidResult basic = x86_64_cpuid(0, 0);
+    u32 max_leaf = basic.eax;
+    u32 vendor[3] = { basic.ebx, basic.edx, basic.ecx };
+    for (usize i = 0; i < 12; ++i)
+        cpu.vendor_name[i] = (char) (vendor[i / 4] >> (8 * (i % 4)));
+    cpu.vendor_name[12] = '\0';
+
+    if (vendor[0] == 0x756E6547 && vendor[1] == 0x49656E69 && vendor[2] == 0x6C65746E)       // GenuineIntel
+        cpu.vendor = CPU_VENDOR_INTEL;
+    else if (vendor[0] == 0x68747541 && vendor[1] == 0x69746E65 && vendor[2] == 0x444D4163)  // AuthenticAMD
+        cpu.vendor = CPU_VENDOR_AMD;
+
+    if (max_leaf >= 1)
+    {
+        CpuidResult version = x86_64_cpuid(1, 0);
+        u32 family = (version.eax >> 8) & 0xF;
+        u32 model  = (version.eax >> 4) & 0xF;
+        if (family == 0xF)
+            family += (version.eax >> 20) & 0xFF;
+        if (family == 0x6 || family >= 0xF)
+            model |= ((version.eax >> 16) & 0xF) << 4;
+        cpu.family   = (u16) family;
+        cpu.model    = (u8) model;
+        cpu.stepping = (u8) (version.eax & 0xF);
+
+        if (BIT_CHECK(version.ecx, 20)) cpu.features |= CPU_FEATURE_BIT(SSE4_2);
+        if (BIT_CHECK(version.ecx, 21)) cpu.features |= CPU_FEATURE_BIT(X2APIC);
+        if (BIT_CHECK(version.ecx, 24)) cpu.features |= CPU_FEATURE_BIT(TSC_DEADLINE);
+        if (BIT_CHECK(version.ecx, 17)) cpu.features |= CPU_FEATURE_BIT(PCID);
+    }
+
+    if (max_leaf >= 7)
+    {
+        CpuidResult extended = x86_64_cpuid(7, 0);
+        if (BIT_CHECK(extended.ebx, 5))  cpu.features |= CPU_FEATURE_BIT(AVX2);
+        if (BIT_CHECK(extended.ebx, 9))  cpu.features |= CPU_FEATURE_BIT(ERMS);
+        if (BIT_CHECK(extended.ebx, 10)) cpu.features |= CPU_FEATURE_BIT(INVPCID);
+        if (BIT_CHECK(extended.ebx, 16)) cpu.features |= CPU_FEATURE_BIT(AVX512F);
+        if (BIT_CHECK(extended.ecx, 16)) cpu.features |= CPU_FEATURE_BIT(LA57);
+        if (BIT_CHECK(extended.edx, 4))  cpu.features |= CPU_FEATURE_BIT(FSRM);
+    }
+
+    u32 max_extended_leaf = x86_64_cpuid(0x80000000, 0).eax;
+    bool amd_topology = false;
+    if (max_extended_leaf >= 0x80000001)
+    {
+        CpuidResult extended = x86_64_cpuid(0x80000001, 0);
+        if (BIT_CHECK(extended.edx, 20)) cpu.features |= CPU_FEATURE_BIT(NX);
+        if (BIT_CHECK(extended.edx, 26)) cpu.features |= CPU_FEATURE_BIT(PAGES_1GIB);
+        amd_topology = BIT_CHECK(extended.ecx, 22);
+    }
+
+    if (cpu.vendor == CPU_VENDOR_INTEL && max_leaf >= 4)
+        cpu_read_caches(&cpu, 4);
+    else if (cpu.vendor == CPU_VENDOR_AMD && amd_topology && max_extended_leaf >= 0x8000001D)
+        cpu_read_caches(&cpu, 0x8000001D);
+
+    g_cpu = cpu;
+    g_cpu_initialized = true;
+}
+
+
+const Cpu* cpu_get()
+{
+    if (!g_cpu_initialized)
+        cpu_init();
+    return &g_cpu;
+}
+
+bool cpu_has(CpuFeature feature)
+{
+    return (cpu_get()->features >> feature) & 1;
+}
+
+const char* cpu_feature_name(CpuFeature feature)
+{
+    return feature < CPU_FEATURE_COUNT ? CPU_FEATURE_NAMES[feature] : "?";
+}
+
+const char* cpu_cache_type_name(u8 type)
+{
+    switch (type)
+    {
+        case CPU_CACHE_DATA:        return "d";
+        case CPU_CACHE_INSTRUCTION: return "i";
+        case CPU_CACHE_UNIFIED:     return "";
+        default:                    return "?";
+    }
+}
+
+
+/* ---- DISPATCH ---- */
+/// Index of the first of `count` variants, `stride` bytes apart, whose
+/// requirements this CPU meets. See CPU_DISPATCH.
+usize cpu_dispatch_select(const char* primitive, const CpuVariant* first, usize stride, usize count)
+{
+    u64   features = cpu_get()->features;
+    usize index    = count - 1;
+    for (usize i = 0; i < count; ++i)
+    {
+        const CpuVariant* variant = (const CpuVariant *) ((const u8 *) first + i * stride);
+        if ((variant->requires & features) == variant->requires)
+        {
+            index = i;
+            break;
+        }
+    }
+    const char* name = ((const CpuVariant *) ((const u8 *) first + index * stride))->name;
+
+    // Binding again replaces the record, so each primitive shows up once.
+    usize slot = 0;
+    while (slot < g_cpu_binding_count && g_cpu_bindings[slot].primitive != primitive)
+        ++slot;
+    if (slot < CPU_BINDINGS_MAX)
+    {
+        g_cpu_bindings[slot] = (CpuBinding) { .primitive=primitive, .variant=name };
+        if (slot == g_cpu_binding_count)
+            g_cpu_binding_count += 1;
+    }
+    return index;
+}
+
+const CpuBinding* cpu_bindings(usize* count)
+{
+    *count = g_cpu_binding_count;
+    return g_cpu_bindings;
+}
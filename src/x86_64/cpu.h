@@ -0,0 +1,111 @@
+#pragma once
+
+#include "../types.h"
+
+// What the processor reports through CPUID, read once by cpu_init, and the
+// dispatch that binds hot primitives to the best variant for it. Everything
+// is still compiled for plain x86-64; a variant that needs more is only
+// called after CPUID says it's there.
+
+
+typedef enum CpuVendor
+{
+    CPU_VENDOR_OTHER,
+    CPU_VENDOR_INTEL,
+    CPU_VENDOR_AMD,
+} CpuVendor;
+
+/// Bit numbers in Cpu.features. Only what the CPU reports: the AVX ones are
+/// also unusable until XCR0 enables their state, which nothing here does.
+typedef enum CpuFeature
+{
+    CPU_FEATURE_SSE4_2,        // CPUID.01H:ECX[20]
+    CPU_FEATURE_X2APIC,        // CPUID.01H:ECX[21]
+    CPU_FEATURE_TSC_DEADLINE,  // CPUID.01H:ECX[24]
+    CPU_FEATURE_PCID,          // CPUID.01H:ECX[17]
+    CPU_FEATURE_AVX2,          // CPUID.(EAX=07H,ECX=0):EBX[5]
+    CPU_FEATURE_ERMS,          // CPUID.(EAX=07H,ECX=0):EBX[9]
+    CPU_FEATURE_INVPCID,       // CPUID.(EAX=07H,ECX=0):EBX[10]
+    CPU_FEATURE_AVX512F,       // CPUID.(EAX=07H,ECX=0):EBX[16]
+    CPU_FEATURE_LA57,          // CPUID.(EAX=07H,ECX=0):ECX[16]
+    CPU_FEATURE_FSRM,          // CPUID.(EAX=07H,ECX=0):EDX[4]
+    CPU_FEATURE_NX,            // CPUID.80000001H:EDX[20]
+    CPU_FEATURE_PAGES_1GIB,    // CPUID.80000001H:EDX[26]
+    CPU_FEATURE_COUNT,
+} CpuFeature;
+
+#define CPU_FEATURE_BIT(name) (1ULL << CPU_FEATURE_##name)
+
+
+typedef enum CpuCacheType
+{
+    CPU_CACHE_DATA        = 1,
+    CPU_CACHE_INSTRUCTION = 2,
+    CPU_CACHE_UNIFIED     = 3,
+} CpuCacheType;
+
+typedef struct CpuCache
+{
+    u8  level;
+    u8  type;       // CpuCacheType.
+    u16 line_size;
+    u16 ways;
+    u16 shared_by;  // At most this many logical processors.
+    u32 size;
+} CpuCache;
+
+#define CPU_CACHES_MAX 8
+
+typedef struct Cpu
+{
+    CpuVendor vendor;
+    char      vendor_name[13];
+    u16       family;    // With the extended family added in.
+    u8        model;     // With the extended model added in.
+    u8        stepping;
+    u64       features;  // CPU_FEATURE_BIT()s.
+    u32       cache_count;
+    CpuCache  caches[CPU_CACHES_MAX];
+} Cpu;
+
+
+void        cpu_init();
+const Cpu*  cpu_get();
+bool        cpu_has(CpuFeature feature);
+const char* cpu_feature_name(CpuFeature feature);
+const char* cpu_cache_type_name(u8 type);
+
+
+/* ---- DISPATCH ----
+ * Like an ifunc resolver, but run once at boot by whoever owns the
+ * primitive. A primitive has a table of variants, best first, each a struct
+ * that starts with a CpuVariant and goes on with its function pointers:
+ *
+ *     static const MemoryVariant MEMORY_VARIANTS[] = {
+ *         { { "erms", CPU_FEATURE_BIT(ERMS) }, memcpy_erms, memset_erms },
+ *         { { "sse2", 0                     }, memcpy_sse2, memset_sse2 },
+ *     };
+ *     const MemoryVariant* best = CPU_DISPATCH("memcpy", MEMORY_VARIANTS);
+ *
+ * The last variant must require nothing. Which one was bound is recorded,
+ * so it can be reported with cpu_bindings.
+ */
+typedef struct CpuVariant
+{
+    const char* name;
+    u64         requires;  // CPU_FEATURE_BIT()s that must all be present.
+} CpuVariant;
+
+typedef struct CpuBinding
+{
+    const char* primitive;
+    const char* variant;
+} CpuBinding;
+
+#define CPU_BINDINGS_MAX 8
+
+usize             cpu_dispatch_select(const char* primitive, const CpuVariant* first, usize stride, usize count);
+const CpuBinding* cpu_bindings(usize* count);
+
+#define CPU_DISPATCH(primitive, variants) \
+    (&(variants)[cpu_dispatch_select((primitive), &(variants)[0].variant, sizeof((variants)[0]), sizeof(variants) / sizeof((variants)[0]))])
@@ -1,4 +1,6 @@
 #include "x86_64.h"
+#include "../allocator.h"
+#include "../symbols.h"
 
 // Each define here is for a specific flag in the descriptor.
 // Refer to the intel documentation for a description of what each one does.
@@ -92,18 +94,119 @@ typedef struct
 } __attribute__((packed)) InterruptFrame;
 
 
+/* ---- HANDLER OUTPUT ---- */
+/* Exception handlers don't save vector registers and can't count on a
+ * console being there. In the bootloader, printf goes through the firmware,
+ * drops its arguments and is gone after ExitBootServices, so handlers write
+ * straight to COM1. The kernel's printf only uses general registers (and
+ * mirrors to COM1), so the kernel goes through it.
+ */
+#if defined(USE_WIDE_CHARACTER) && USE_WIDE_CHARACTER == 1
+static void handler_write(const char* string)
+{
+    while (*string != '\0')
+        serial_write_char(*string++);
+}
+#else
+static void handler_write(const char* string)
+{
+    printf("%s", string);
+}
+#endif
+
+static void handler_write_number(u64 value, u64 base)
+{
+    char  buffer[24];
+    char* digit = buffer + sizeof(buffer);
+    *--digit = '\0';
+    do
+    {
+        *--digit = "0123456789ABCDEF"[value % base];
+        value /= base;
+    } while (value != 0);
+
+    if (base == 16)
+        handler_write("0x");
+    handler_write(digit);
+}
+
+/// Write `name` followed by `value` in hexadecimal and a newline.
+static void handler_write_field(const char* name, u64 value)
+{
+    handler_write(name);
+    handler_write_number(value, 16);
+    handler_write("\n\r");
+}
+
+
+#define BACKTRACE_MAX_DEPTH 32
+
+/// Print `ip` and then the return addresses up the frame pointer chain that
+/// starts at `frame_pointer`, as function+offset. Stops at the first address
+/// that isn't in a known function, which is also where the kernel ends.
+static void print_backtrace(u64 ip, const u64* frame_pointer)
+{
+    const SymbolTable* table = symbol_table_installed();
+    for (u64 depth = 0; table && depth < BACKTRACE_MAX_DEPTH; ++depth)
+    {
+        const Symbol* symbol = symbol_table_find_address(table, ip);
+        if (!symbol)
+            break;
+
+        handler_write("    #");
+        handler_write_number(depth, 10);
+        handler_write(" ");
+        handler_write_number(ip, 16);
+        handler_write(" <");
+        handler_write(SYMBOL_NAME(table, symbol));
+        handler_write("+");
+        handler_write_number(ip - symbol->address, 16);
+        handler_write(">\n\r");
+
+        // [rbp] is the caller's rbp and [rbp + 8] the return address. Frames
+        // only ever go up the stack, so anything else is the end of the chain.
+        if (!frame_pointer || ((u64) frame_pointer & 7))
+            break;
+        const u64* caller = (const u64 *) frame_pointer[0];
+        ip = frame_pointer[1];
+        if (caller <= frame_pointer)
+            break;
+        frame_pointer = caller;
+    }
+}
+
+/// The interrupted code's frame pointer, as pushed by a handler's prologue.
+#define INTERRUPTED_FRAME_POINTER() ((const u64 *) *(const u64 *) __builtin_frame_address(0))
+
+
 __attribute__ ((interrupt))
 static void panic_interrupt_handler(InterruptFrame* frame)
 {
-    ERROR_LOGGER(
-        "[Interrupt]: Unhandled exception!\n\r"
-        "    ip:    %zu\n\r"
-        "    cs:    %zu\n\r"
-        "    flags: %zu\n\r"
-        "    sp:    %zu\n\r"
-        "    ss:    %zu\n\r",
-        frame->ip, frame->cs, frame->flags, frame->sp, frame->ss
-    );
+    handler_write("[Interrupt]: Unhandled exception!\n\r");
+    handler_write_field("    ip:    ", frame->ip);
+    handler_write_field("    cs:    ", frame->cs);
+    handler_write_field("    flags: ", frame->flags);
+    handler_write_field("    sp:    ", frame->sp);
+    handler_write_field("    ss:    ", frame->ss);
+    print_backtrace(frame->ip, INTERRUPTED_FRAME_POINTER());
+
+    debug_break();
+}
+
+
+__attribute__ ((interrupt))
+static void page_fault_interrupt_handler(InterruptFrame* frame, usize error_code)
+{
+    u64 address = (u64) x86_64_cr2_get();
+    if (demand_pager_handle_fault(address, error_code))
+        return;
+
+    handler_write("[Interrupt]: Unhandled page fault!\n\r");
+    handler_write_field("    address: ", address);
+    handler_write_field("    error:   ", error_code);
+    handler_write_field("    ip:      ", frame->ip);
+    handler_write_field("    sp:      ", frame->sp);
+    print_backtrace(frame->ip, INTERRUPTED_FRAME_POINTER());
 
     debug_break();
 }
@@ -127,7 +230,7 @@ typedef struct
     .ist=0,                                                                    \
     .type_attributes=(flags),                                                  \
     .offset_2=(u16)(((u64)(handler) >> 16) & 0xFFFF),                          \
-    .offset_3=(u16)(((u64)(handler) >> 32) & 0xFFFF),                          \
+    .offset_3=(u32)(((u64)(handler) >> 32) & 0xFFFFFFFF),                      \
     .reserved=0,                                                               \
 }
 
@@ -177,6 +280,12 @@ void set_interrupt_handler(int id, __attribute__ ((interrupt)) void (*handler)(I
 }
 
 
+void set_exception_handler(int id, __attribute__ ((interrupt)) void (*handler)(InterruptFrame*, usize))
+{
+    idt[id] = IDT_ENTRY(handler, 0x8, IDT_INTERRUPT_GATE | IDT_RING0 | IDT_PRESENT);
+}
+
+
 //static u8 temp_stack[5 * 4096] = {};
 
 
@@ -209,6 +318,8 @@ void idt_install()
         set_interrupt_handler(i, panic_interrupt_handler);
     }
 
+    set_exception_handler(PageFault, page_fault_interrupt_handler);
+
     /* Points the processor's internal register to the new IDT */
     struct __attribute__((packed)) { u16 size; u64 idt; } description  = { limit, base };
     __asm__ __volatile__ ("lidt %0" : : "m"(description));
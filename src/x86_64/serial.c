@@ -0,0 +1,52 @@
+// Output on the first serial port (COM1), which QEMU connects to stdio with
+// -serial stdio. It's polled, transmit only, and doesn't need interrupts,
+// so it works as soon as the kernel starts.
+#include "x86_64.h"
+
+#define SERIAL_COM1 0x3F8
+
+#define SERIAL_DATA          0  // With DLAB set: divisor low byte.
+#define SERIAL_INTERRUPTS    1  // With DLAB set: divisor high byte.
+#define SERIAL_FIFO_CONTROL  2
+#define SERIAL_LINE_CONTROL  3
+#define SERIAL_MODEM_CONTROL 4
+#define SERIAL_LINE_STATUS   5
+
+#define SERIAL_LINE_DLAB           0x80
+#define SERIAL_LINE_8N1            0x03
+#define SERIAL_STATUS_TRANSMIT_EMPTY 0x20
+
+
+static bool g_serial_ready = 0;
+
+
+/// 115200 baud, 8 data bits, no parity, one stop bit. Without a UART at
+/// COM1 (the scratch register doesn't hold a value) nothing is written.
+void serial_init()
+{
+    x86_64_out8(SERIAL_COM1 + 7, 0xAE);
+    if (x86_64_in8(SERIAL_COM1 + 7) != 0xAE)
+        return;
+
+    x86_64_out8(SERIAL_COM1 + SERIAL_INTERRUPTS,    0x00);
+    x86_64_out8(SERIAL_COM1 + SERIAL_LINE_CONTROL,  SERIAL_LINE_DLAB);
+    x86_64_out8(SERIAL_COM1 + SERIAL_DATA,          0x01);  // 115200 / 1.
+    x86_64_out8(SERIAL_COM1 + SERIAL_INTERRUPTS,    0x00);
+    x86_64_out8(SERIAL_COM1 + SERIAL_LINE_CONTROL,  SERIAL_LINE_8N1);
+    x86_64_out8(SERIAL_COM1 + SERIAL_FIFO_CONTROL,  0xC7);  // Enabled and cleared, 14 byte threshold.
+    x86_64_out8(SERIAL_COM1 + SERIAL_MODEM_CONTROL, 0x03);  // DTR and RTS.
+    g_serial_ready = 1;
+}
+
+
+void serial_write_char(char character)
+{
+    if (!g_serial_ready)
+        return;
+    if (character == '\n')
+        serial_write_char('\r');
+
+    while (!(x86_64_in8(SERIAL_COM1 + SERIAL_LINE_STATUS) & SERIAL_STATUS_TRANSMIT_EMPTY))
+        __asm__ __volatile__("pause");
+    x86_64_out8(SERIAL_COM1 + SERIAL_DATA, (u8) character);
+}
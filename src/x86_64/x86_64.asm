@@ -7,6 +7,7 @@ global x86_64_cr2_set
 global x86_64_cr2_get
 global x86_64_cr3_set
 global x86_64_cr3_get
+global x86_64_cr4_get
 global x86_64_load_gdt
 
 
@@ -38,6 +39,10 @@ x86_64_cr3_get:
    mov rax, cr3
    ret
 
+x86_64_cr4_get:
+   mov rax, cr4
+   ret
+
 
 
 x86_64_load_gdt:
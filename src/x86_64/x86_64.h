@@ -1,12 +1,82 @@
-extern void  x86_64_interrupt_3();
+#pragma once
 
-extern void  x86_64_cr0_set(void*);
-extern void* x86_64_cr0_get();
+#include "../types.h"
 
-extern void  x86_64_cr2_set(void*);
-extern void* x86_64_cr2_get();
+// The routines in x86_64.asm take their arguments in System V registers, which
+// the bootloader (built for the Microsoft ABI) must be told explicitly.
+#define X86_64_ASM __attribute__((sysv_abi))
 
-extern void  x86_64_cr3_set(void*);
-extern void* x86_64_cr3_get();
+extern X86_64_ASM void  x86_64_interrupt_3();
 
-extern void  x86_64_load_gdt();
\ No newline at end of file
+extern X86_64_ASM void  x86_64_cr0_set(void*);
+extern X86_64_ASM void* x86_64_cr0_get();
+
+extern X86_64_ASM void  x86_64_cr2_set(void*);
+extern X86_64_ASM void* x86_64_cr2_get();
+
+extern X86_64_ASM void  x86_64_cr3_set(void*);
+extern X86_64_ASM void* x86_64_cr3_get();
+
+extern X86_64_ASM u64   x86_64_cr4_get();
+
+extern X86_64_ASM void  x86_64_load_gdt();
+
+
+#define X86_64_CR4_LA57 12  // 57-bit linear addresses (5-level paging).
+
+#define X86_64_MSR_EFER 0xC0000080
+#define X86_64_EFER_NXE 11  // Bit 63 of paging entries means no-execute.
+
+
+typedef struct CpuidResult
+{
+    u32 eax;
+    u32 ebx;
+    u32 ecx;
+    u32 edx;
+} CpuidResult;
+
+static inline CpuidResult x86_64_cpuid(u32 leaf, u32 subleaf)
+{
+    CpuidResult result;
+    __asm__ __volatile__("cpuid" : "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx), "=d"(result.edx) : "a"(leaf), "c"(subleaf));
+    return result;
+}
+
+static inline void x86_64_invlpg(u64 address)
+{
+    __asm__ __volatile__("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+/// Time stamp counter. Not serializing, so it only brackets work that's
+/// long compared to the out-of-order window.
+static inline u64 x86_64_rdtsc()
+{
+    u32 low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((u64) high << 32) | low;
+}
+
+static inline void x86_64_out8(u16 port, u8 value)
+{
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline u8 x86_64_in8(u16 port)
+{
+    u8 value;
+    __asm__ __volatile__("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline u64 x86_64_rdmsr(u32 msr)
+{
+    u32 low, high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((u64) high << 32) | low;
+}
+
+static inline void x86_64_wrmsr(u32 msr, u64 value)
+{
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((u32) value), "d"((u32) (value >> 32)));
+}